@@ -0,0 +1,546 @@
+/*
+ * Copyright 2025 Mats Kindahl.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you
+ * may not use this file except in compliance with the License.  You
+ * may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+/*
+ * Batched modifications of the memory view.
+ *
+ * This file contains array-based functions to insert, update, and
+ * delete many rows at once, and trigger functions that collect the
+ * rows of a statement into a batch that is applied at the end of the
+ * statement. In both cases, the lock is taken once for the entire
+ * batch.
+ */
+
+#include "memview.h"
+
+#include <postgres.h>
+#include <fmgr.h>
+
+#include <miscadmin.h>
+
+#include <access/xact.h>
+#include <catalog/pg_type.h>
+#include <commands/trigger.h>
+#include <executor/spi.h>
+#include <utils/array.h>
+#include <utils/memutils.h>
+
+PG_FUNCTION_INFO_V1(memview_row_insert_many);
+PG_FUNCTION_INFO_V1(memview_row_update_many);
+PG_FUNCTION_INFO_V1(memview_row_delete_many);
+PG_FUNCTION_INFO_V1(memview_insert_row_batch_tgfunc);
+PG_FUNCTION_INFO_V1(memview_update_row_batch_tgfunc);
+PG_FUNCTION_INFO_V1(memview_delete_row_batch_tgfunc);
+PG_FUNCTION_INFO_V1(memview_apply_batch_tgfunc);
+
+/*
+ * Column numbers for a batch trigger.
+ *
+ * Column numbers are resolved on the first row of the statement and
+ * then reused for all following rows for the same trigger.
+ */
+typedef struct MemoryViewBatchTrigger {
+  Oid tgoid;
+  int row_id_attnum;
+  int owner_attnum;
+  int descr_attnum;
+  int expires_attnum; /* Zero if the trigger has no expiry time */
+} MemoryViewBatchTrigger;
+
+/*
+ * Batch of pending operations.
+ *
+ * The batch is allocated in a memory context under the top
+ * transaction context, so it goes away with the transaction. Each
+ * operation remembers the subtransaction that added it, so that the
+ * operations added by a subtransaction that is aborted can be
+ * discarded without losing the operations added before it started.
+ */
+typedef struct MemoryViewBatch {
+  MemoryContext context;
+  MemoryViewOp* ops;
+  SubTransactionId* subids;
+  size_t nops;
+  size_t maxops;
+  MemoryViewBatchTrigger triggers[3];
+} MemoryViewBatch;
+
+static MemoryViewBatch* memview_batch = NULL;
+static bool memview_batch_callbacks = false;
+
+static void memview_batch_xact_callback(XactEvent event, void* arg) {
+  switch (event) {
+    case XACT_EVENT_PRE_COMMIT:
+    case XACT_EVENT_PARALLEL_PRE_COMMIT:
+    case XACT_EVENT_PRE_PREPARE:
+      if (memview_batch && memview_batch->nops > 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("memory view batch with %zu operations was not "
+                        "applied",
+                        memview_batch->nops),
+                 errhint("Create a statement-level trigger using "
+                         "memview_apply_batch_tgfunc() on the view.")));
+      break;
+
+    default:
+      /* The memory context is deleted with the transaction */
+      memview_batch = NULL;
+      break;
+  }
+}
+
+/*
+ * Discard the operations added by an aborted subtransaction.
+ *
+ * Subtransaction identifiers are assigned in increasing order, so the
+ * operations added since the subtransaction started, by it or by its
+ * children, are the ones at the end of the batch with an identifier
+ * that is not less than the identifier of the subtransaction.
+ */
+static void memview_batch_subxact_callback(SubXactEvent event,
+                                           SubTransactionId mySubid,
+                                           SubTransactionId parentSubid,
+                                           void* arg) {
+  if (event != SUBXACT_EVENT_ABORT_SUB || memview_batch == NULL)
+    return;
+
+  while (memview_batch->nops > 0 &&
+         memview_batch->subids[memview_batch->nops - 1] >= mySubid)
+    --memview_batch->nops;
+}
+
+/*
+ * Get the batch for the current transaction, creating it if
+ * necessary.
+ */
+static MemoryViewBatch* memview_batch_get(void) {
+  MemoryContext context;
+
+  if (memview_batch != NULL)
+    return memview_batch;
+
+  if (!memview_batch_callbacks) {
+    RegisterXactCallback(memview_batch_xact_callback, NULL);
+    RegisterSubXactCallback(memview_batch_subxact_callback, NULL);
+    memview_batch_callbacks = true;
+  }
+
+  context = AllocSetContextCreate(
+      TopTransactionContext, "memview batch", ALLOCSET_DEFAULT_SIZES);
+  memview_batch = MemoryContextAllocZero(context, sizeof(MemoryViewBatch));
+  memview_batch->context = context;
+  memview_batch->maxops = 64;
+  memview_batch->ops = MemoryContextAlloc(
+      context, memview_batch->maxops * sizeof(MemoryViewOp));
+  memview_batch->subids = MemoryContextAlloc(
+      context, memview_batch->maxops * sizeof(SubTransactionId));
+  return memview_batch;
+}
+
+/*
+ * Add an operation to the batch and return it for the caller to fill
+ * in.
+ */
+static MemoryViewOp* memview_batch_add(MemoryViewBatch* batch,
+                                       MemoryViewOpKind kind) {
+  MemoryViewOp* op;
+
+  if (batch->nops == batch->maxops) {
+    batch->maxops *= 2;
+    batch->ops =
+        repalloc_huge(batch->ops, batch->maxops * sizeof(MemoryViewOp));
+    batch->subids = repalloc_huge(batch->subids,
+                                  batch->maxops * sizeof(SubTransactionId));
+  }
+
+  batch->subids[batch->nops] = GetCurrentSubTransactionId();
+  op = &batch->ops[batch->nops++];
+  memset(op, 0, sizeof(*op));
+  op->kind = kind;
+  return op;
+}
+
+/*
+ * Check that the batch trigger is called correctly and return the
+ * cached column numbers for the trigger.
+ *
+ * Insert and update triggers take the column name of the expiry time
+ * as an optional parameter after the "nargs" required parameters.
+ */
+static MemoryViewBatchTrigger* memview_batch_trigger(FunctionCallInfo fcinfo,
+                                                     MemoryViewOpKind kind,
+                                                     int nargs) {
+  bool expiry = (kind != MEMVIEW_OP_DELETE);
+  TriggerData* trigdata;
+  Trigger* trigger;
+  TupleDesc tupdesc;
+  MemoryViewBatchTrigger* cache;
+  int arg = 0;
+
+  if (!CALLED_AS_TRIGGER(fcinfo))
+    ereport(ERROR,
+            (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+             errmsg("must be called as trigger")));
+
+  trigdata = (TriggerData*)fcinfo->context;
+  trigger = trigdata->tg_trigger;
+  cache = &memview_batch_get()->triggers[kind];
+
+  if (cache->tgoid == trigger->tgoid)
+    return cache;
+
+  if (!TRIGGER_FIRED_INSTEAD(trigdata->tg_event))
+    ereport(ERROR,
+            (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+             errmsg("must be called as an INSTEAD OF-trigger")));
+
+  if (!TRIGGER_FIRED_FOR_ROW(trigdata->tg_event))
+    ereport(ERROR,
+            (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+             errmsg("must be called for each row")));
+
+  if (expiry && trigger->tgnargs != nargs && trigger->tgnargs != nargs + 1)
+    ereport(ERROR,
+            (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+             errmsg("must be called with %d or %d parameters, was called "
+                    "with %d",
+                    nargs,
+                    nargs + 1,
+                    trigger->tgnargs)));
+
+  if (!expiry && trigger->tgnargs != nargs)
+    ereport(ERROR,
+            (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+             errmsg("must be called with %d parameters, was called with %d",
+                    nargs,
+                    trigger->tgnargs)));
+
+  tupdesc = trigdata->tg_relation->rd_att;
+  cache->row_id_attnum = cache->owner_attnum = cache->descr_attnum = 0;
+  cache->expires_attnum = 0;
+  if (kind != MEMVIEW_OP_INSERT)
+    cache->row_id_attnum = SPI_fnumber(tupdesc, trigger->tgargs[arg++]);
+  if (kind != MEMVIEW_OP_DELETE) {
+    cache->owner_attnum = SPI_fnumber(tupdesc, trigger->tgargs[arg++]);
+    cache->descr_attnum = SPI_fnumber(tupdesc, trigger->tgargs[arg++]);
+  }
+  if (arg < trigger->tgnargs)
+    cache->expires_attnum = SPI_fnumber(tupdesc, trigger->tgargs[arg++]);
+
+  for (int i = 0; i < trigger->tgnargs; ++i)
+    if (SPI_fnumber(tupdesc, trigger->tgargs[i]) <= 0)
+      ereport(ERROR,
+              (errcode(ERRCODE_UNDEFINED_COLUMN),
+               errmsg("column \"%s\" does not exist", trigger->tgargs[i])));
+
+  if (cache->expires_attnum > 0 &&
+      SPI_gettypeid(tupdesc, cache->expires_attnum) != TIMESTAMPTZOID)
+    ereport(ERROR,
+            (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+             errmsg("column \"%s\" must have type timestamp with time zone",
+                    trigger->tgargs[nargs])));
+
+  cache->tgoid = trigger->tgoid;
+  return cache;
+}
+
+/*
+ * Get a column value from a trigger tuple, raising an error if it is
+ * null.
+ */
+static Datum memview_batch_getattr(TriggerData* trigdata, HeapTuple tuple,
+                                   int attnum) {
+  TupleDesc tupdesc = trigdata->tg_relation->rd_att;
+  bool isnull;
+  Datum value = SPI_getbinval(tuple, tupdesc, attnum, &isnull);
+
+  if (isnull)
+    elog(ERROR, "attribute \"%s\" cannot be null", SPI_fname(tupdesc, attnum));
+  return value;
+}
+
+/*
+ * Set the expiry time of an operation from a trigger tuple, if the
+ * trigger has an expiry time column and it is not null.
+ */
+static void memview_batch_expiry(TriggerData* trigdata,
+                                 HeapTuple tuple,
+                                 int attnum,
+                                 MemoryViewOp* op) {
+  bool isnull;
+  Datum value;
+
+  if (attnum == 0)
+    return;
+
+  value = SPI_getbinval(tuple, trigdata->tg_relation->rd_att, attnum, &isnull);
+  if (!isnull) {
+    op->has_expiry = true;
+    op->expires_at = DatumGetTimestampTz(value);
+  }
+}
+
+/*
+ * Trigger function for adding an inserted row to the batch.
+ *
+ * The trigger need to be created with the column names of the row
+ * owner and the description, and optionally the expiry time.
+ */
+Datum memview_insert_row_batch_tgfunc(PG_FUNCTION_ARGS) {
+  MemoryViewBatchTrigger* cache =
+      memview_batch_trigger(fcinfo, MEMVIEW_OP_INSERT, 2);
+  TriggerData* trigdata = (TriggerData*)fcinfo->context;
+  MemoryViewOp* op = memview_batch_add(memview_batch, MEMVIEW_OP_INSERT);
+  HeapTuple tuple = trigdata->tg_trigtuple;
+
+  op->owner = DatumGetObjectId(
+      memview_batch_getattr(trigdata, tuple, cache->owner_attnum));
+  namestrcpy(&op->description,
+             NameStr(*DatumGetName(memview_batch_getattr(
+                 trigdata, tuple, cache->descr_attnum))));
+  memview_batch_expiry(trigdata, tuple, cache->expires_attnum, op);
+
+  PG_RETURN_POINTER(NULL);
+}
+
+/*
+ * Trigger function for adding an updated row to the batch.
+ *
+ * The trigger need to be created with the column names of the row
+ * id, the row owner, and the description, and optionally the expiry
+ * time.
+ */
+Datum memview_update_row_batch_tgfunc(PG_FUNCTION_ARGS) {
+  MemoryViewBatchTrigger* cache =
+      memview_batch_trigger(fcinfo, MEMVIEW_OP_UPDATE, 3);
+  TriggerData* trigdata = (TriggerData*)fcinfo->context;
+  MemoryViewOp* op;
+  int32 old_row_id, new_row_id;
+
+  old_row_id = DatumGetInt32(memview_batch_getattr(
+      trigdata, trigdata->tg_trigtuple, cache->row_id_attnum));
+  new_row_id = DatumGetInt32(memview_batch_getattr(
+      trigdata, trigdata->tg_newtuple, cache->row_id_attnum));
+
+  if (old_row_id != new_row_id)
+    elog(ERROR,
+         "changing value of attribute \"%s\" is not allowed",
+         trigdata->tg_trigger->tgargs[0]);
+
+  op = memview_batch_add(memview_batch, MEMVIEW_OP_UPDATE);
+  op->row_id = old_row_id;
+  op->owner = DatumGetObjectId(memview_batch_getattr(
+      trigdata, trigdata->tg_newtuple, cache->owner_attnum));
+  namestrcpy(&op->description,
+             NameStr(*DatumGetName(memview_batch_getattr(
+                 trigdata, trigdata->tg_newtuple, cache->descr_attnum))));
+  memview_batch_expiry(
+      trigdata, trigdata->tg_newtuple, cache->expires_attnum, op);
+
+  PG_RETURN_POINTER(NULL);
+}
+
+/*
+ * Trigger function for adding a deleted row to the batch.
+ *
+ * The trigger need to be created with the column name of the row id.
+ */
+Datum memview_delete_row_batch_tgfunc(PG_FUNCTION_ARGS) {
+  MemoryViewBatchTrigger* cache =
+      memview_batch_trigger(fcinfo, MEMVIEW_OP_DELETE, 1);
+  TriggerData* trigdata = (TriggerData*)fcinfo->context;
+  MemoryViewOp* op = memview_batch_add(memview_batch, MEMVIEW_OP_DELETE);
+
+  op->row_id = DatumGetInt32(memview_batch_getattr(
+      trigdata, trigdata->tg_trigtuple, cache->row_id_attnum));
+
+  PG_RETURN_POINTER(NULL);
+}
+
+/*
+ * Statement-level trigger function for applying the batch.
+ *
+ * Views cannot have transition tables, so the rows of the statement
+ * are collected by the row-level INSTEAD OF triggers above and this
+ * trigger applies all of them at the end of the statement.
+ */
+Datum memview_apply_batch_tgfunc(PG_FUNCTION_ARGS) {
+  TriggerData* trigdata;
+
+  if (!CALLED_AS_TRIGGER(fcinfo))
+    ereport(ERROR,
+            (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+             errmsg("must be called as trigger")));
+
+  trigdata = (TriggerData*)fcinfo->context;
+
+  if (!TRIGGER_FIRED_AFTER(trigdata->tg_event) ||
+      !TRIGGER_FIRED_FOR_STATEMENT(trigdata->tg_event))
+    ereport(ERROR,
+            (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+             errmsg("must be called as an AFTER trigger for each statement")));
+
+  if (memview_batch != NULL && memview_batch->nops > 0) {
+    memview_apply(memview_batch->ops, memview_batch->nops);
+    memview_batch->nops = 0;
+  }
+
+  PG_RETURN_POINTER(NULL);
+}
+
+/*
+ * Get the elements of an array argument, raising an error if any of
+ * them is null.
+ */
+static Datum* memview_array_elements(ArrayType* array, Oid elmtype,
+                                     int* nelems) {
+  Datum* elems;
+  bool* nulls;
+
+  deconstruct_array_builtin(array, elmtype, &elems, &nulls, nelems);
+  for (int i = 0; i < *nelems; ++i)
+    if (nulls[i])
+      ereport(ERROR,
+              (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+               errmsg("array elements cannot be null")));
+  return elems;
+}
+
+static void memview_check_lengths(int expected, int actual) {
+  if (expected != actual)
+    ereport(ERROR,
+            (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+             errmsg("arrays must have the same length"),
+             errdetail("Expected %d elements but got %d.", expected, actual)));
+}
+
+/*
+ * Set the expiry times of the operations from an optional array
+ * argument. A null array or a null element means that no expiry time
+ * is given for the row, in the same way as for the single-row
+ * functions.
+ */
+static void memview_ops_expiry(FunctionCallInfo fcinfo,
+                               int argno,
+                               MemoryViewOp* ops,
+                               int nops) {
+  Datum* elems;
+  bool* nulls;
+  int nelems;
+
+  if (PG_NARGS() <= argno || PG_ARGISNULL(argno))
+    return;
+
+  deconstruct_array(PG_GETARG_ARRAYTYPE_P(argno),
+                    TIMESTAMPTZOID,
+                    sizeof(TimestampTz),
+                    FLOAT8PASSBYVAL,
+                    TYPALIGN_DOUBLE,
+                    &elems,
+                    &nulls,
+                    &nelems);
+  memview_check_lengths(nops, nelems);
+
+  for (int i = 0; i < nops; ++i) {
+    if (!nulls[i]) {
+      ops[i].has_expiry = true;
+      ops[i].expires_at = DatumGetTimestampTz(elems[i]);
+    }
+  }
+}
+
+/*
+ * Insert many rows into the memory view.
+ *
+ * The optional third argument is an array with the expiry time of
+ * each row.
+ */
+Datum memview_row_insert_many(PG_FUNCTION_ARGS) {
+  int nowners, ndescrs;
+  Datum* owners =
+      memview_array_elements(PG_GETARG_ARRAYTYPE_P(0), OIDOID, &nowners);
+  Datum* descrs =
+      memview_array_elements(PG_GETARG_ARRAYTYPE_P(1), NAMEOID, &ndescrs);
+  MemoryViewOp* ops;
+
+  memview_check_lengths(nowners, ndescrs);
+
+  ops = palloc0_array(MemoryViewOp, nowners);
+  for (int i = 0; i < nowners; ++i) {
+    ops[i].kind = MEMVIEW_OP_INSERT;
+    ops[i].owner = DatumGetObjectId(owners[i]);
+    namestrcpy(&ops[i].description, NameStr(*DatumGetName(descrs[i])));
+  }
+  memview_ops_expiry(fcinfo, 2, ops, nowners);
+
+  memview_apply(ops, nowners);
+
+  PG_RETURN_VOID();
+}
+
+/*
+ * Update many rows in the memory view.
+ *
+ * The optional fourth argument is an array with the expiry time of
+ * each row.
+ */
+Datum memview_row_update_many(PG_FUNCTION_ARGS) {
+  int nrows, nowners, ndescrs;
+  Datum* row_ids =
+      memview_array_elements(PG_GETARG_ARRAYTYPE_P(0), INT4OID, &nrows);
+  Datum* owners =
+      memview_array_elements(PG_GETARG_ARRAYTYPE_P(1), OIDOID, &nowners);
+  Datum* descrs =
+      memview_array_elements(PG_GETARG_ARRAYTYPE_P(2), NAMEOID, &ndescrs);
+  MemoryViewOp* ops;
+
+  memview_check_lengths(nrows, nowners);
+  memview_check_lengths(nrows, ndescrs);
+
+  ops = palloc0_array(MemoryViewOp, nrows);
+  for (int i = 0; i < nrows; ++i) {
+    ops[i].kind = MEMVIEW_OP_UPDATE;
+    ops[i].row_id = DatumGetInt32(row_ids[i]);
+    ops[i].owner = DatumGetObjectId(owners[i]);
+    namestrcpy(&ops[i].description, NameStr(*DatumGetName(descrs[i])));
+  }
+  memview_ops_expiry(fcinfo, 3, ops, nrows);
+
+  memview_apply(ops, nrows);
+
+  PG_RETURN_VOID();
+}
+
+/*
+ * Delete many rows from the memory view.
+ */
+Datum memview_row_delete_many(PG_FUNCTION_ARGS) {
+  int nrows;
+  Datum* row_ids =
+      memview_array_elements(PG_GETARG_ARRAYTYPE_P(0), INT4OID, &nrows);
+  MemoryViewOp* ops;
+
+  ops = palloc0_array(MemoryViewOp, nrows);
+  for (int i = 0; i < nrows; ++i) {
+    ops[i].kind = MEMVIEW_OP_DELETE;
+    ops[i].row_id = DatumGetInt32(row_ids[i]);
+  }
+
+  memview_apply(ops, nrows);
+
+  PG_RETURN_VOID();
+}
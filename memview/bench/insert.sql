@@ -0,0 +1,3 @@
+-- Insert a row with a random owner into the memory view.
+\set owner random(1, 1000)
+select memview_row_insert(:owner, 'benchmark row');
@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# Measure how the write throughput of the memory view scales with the
+# number of concurrent clients.
+#
+# The insert benchmark inserts the same total number of rows for each
+# client count, so that it does not run into memview.max_records, and
+# the update benchmark updates random rows among the same number of
+# rows for a fixed duration. The memory view is reset before each
+# run. Connection parameters are taken from the usual environment
+# variables, for example PGDATABASE.
+#
+# Usage: run.sh [insert|update]...
+
+set -e
+
+bench=$(dirname "$0")
+rows=${ROWS:-100000}
+duration=${DURATION:-30}
+clients=${CLIENTS:-"1 2 4 8 16 32 64"}
+
+if [ $# -eq 0 ]; then
+    set -- insert update
+fi
+
+psql -X -q -c 'create extension if not exists memview'
+
+run() {
+    pgbench -n -M prepared -D rows="$rows" "$@" | awk '/^tps/ { print $3 }'
+}
+
+printf '%-8s %8s %12s\n' benchmark clients tps
+for workload in "$@"; do
+    for c in $clients; do
+	psql -X -q -c 'call memview_view_reset()'
+	case $workload in
+	    insert)
+		tps=$(run -c "$c" -j "$c" -t $((rows / c)) -f "$bench/insert.sql")
+		;;
+	    update)
+		psql -X -q -c "select memview_row_insert_many(
+				 array_agg(n % 1000 + 1)::oid[],
+				 array_agg('benchmark row'::name))
+			       from generate_series(1, $rows) n"
+		tps=$(run -c "$c" -j "$c" -T "$duration" -f "$bench/update.sql")
+		;;
+	    *)
+		echo "unknown benchmark: $workload" >&2
+		exit 1
+		;;
+	esac
+	printf '%-8s %8d %12.0f\n' "$workload" "$c" "$tps"
+    done
+done
@@ -0,0 +1,4 @@
+-- Update a random row of the rows loaded by run.sh.
+\set row_id random(0, :rows - 1)
+\set owner random(1, 1000)
+select memview_row_update(:row_id, :owner, 'updated row');
@@ -0,0 +1,263 @@
+/*
+ * Copyright 2025 Mats Kindahl.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you
+ * may not use this file except in compliance with the License.  You
+ * may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+/*
+ * Change log of the memory view.
+ *
+ * Each partition has a change log with the last changes to the
+ * partition, which allows consumers to read the changes since the
+ * last position they have seen instead of scanning the memory view
+ * and comparing it with the previous scan. Consumers can wait for new
+ * changes using memview_changes_wait(), which sleeps on a condition
+ * variable that is signalled when changes are added.
+ *
+ * The change log has a fixed size, so a consumer that falls too far
+ * behind will get an error and need to scan the memory view again.
+ */
+
+#include "memview.h"
+
+#include <postgres.h>
+#include <fmgr.h>
+
+#include <funcapi.h>
+#include <miscadmin.h>
+
+#include <pgstat.h>
+#include <utils/builtins.h>
+#include <utils/timestamp.h>
+
+PG_FUNCTION_INFO_V1(memview_changes);
+PG_FUNCTION_INFO_V1(memview_change_position);
+PG_FUNCTION_INFO_V1(memview_changes_wait);
+
+static const char* const memview_change_names[] = {
+    [MEMVIEW_CHANGE_INSERT] = "insert",
+    [MEMVIEW_CHANGE_UPDATE] = "update",
+    [MEMVIEW_CHANGE_DELETE] = "delete",
+    [MEMVIEW_CHANGE_RESET] = "reset",
+    [MEMVIEW_CHANGE_EXPIRE] = "expire",
+};
+
+/*
+ * Scan state for reading the change log.
+ *
+ * The changes are copied when the scan starts so that the lock is not
+ * held while the changes are returned.
+ */
+typedef struct MemoryViewChangeScanState {
+  size_t nchanges;
+  MemoryViewChange* changes;
+  size_t change;
+} MemoryViewChangeScanState;
+
+/*
+ * Add a change to the change log, overwriting the oldest change if
+ * the change log is full.
+ *
+ * Writers of different rows append changes concurrently, so the
+ * change log has a lock of its own. The caller need to hold the stripe
+ * of the row, so the changes to a row are in the same order as the
+ * modifications, and wake up the waiters after releasing its locks.
+ */
+void memview_change_append(MemoryViewSession* session,
+                           MemoryViewChangeKind kind,
+                           int32 row_id,
+                           const MemoryViewRecord* record) {
+  MemoryViewHeader* header = session->header;
+  MemoryViewChange* changes = dsa_get_address(session->area, header->changes);
+  MemoryViewChange* change;
+  uint64 position;
+
+  LWLockAcquire(&header->changes_lock, LW_EXCLUSIVE);
+  position = pg_atomic_read_u64(&header->next_change);
+  change = &changes[position % MEMVIEW_CHANGE_LOG_SIZE];
+  memset(change, 0, sizeof(*change));
+  change->position = position;
+  change->kind = kind;
+  change->row_id = row_id;
+  if (record) {
+    change->owner = record->owner;
+    change->description = record->description;
+  }
+
+  pg_atomic_write_u64(&header->next_change, position + 1);
+  LWLockRelease(&header->changes_lock);
+}
+
+/*
+ * Get the position of the last change to the memory view.
+ *
+ * A consumer reads this position before scanning the memory view and
+ * can then read the changes since the scan using memview_changes().
+ */
+Datum memview_change_position(PG_FUNCTION_ARGS) {
+  MemoryViewHeader* header = memview_session_get()->header;
+
+  PG_RETURN_INT64(pg_atomic_read_u64(&header->next_change) - 1);
+}
+
+/*
+ * Copy the changes after a position from the change log.
+ *
+ * The caller need to hold the change log lock and the memory for the
+ * changes is allocated in the current memory context.
+ */
+static void memview_copy_changes(MemoryViewSession* session,
+                                 int64 since,
+                                 MemoryViewChangeScanState* scan) {
+  MemoryViewHeader* header = session->header;
+  MemoryViewChange* changes = dsa_get_address(session->area, header->changes);
+  uint64 next = pg_atomic_read_u64(&header->next_change);
+  uint64 oldest = next > MEMVIEW_CHANGE_LOG_SIZE
+                      ? next - MEMVIEW_CHANGE_LOG_SIZE
+                      : 1;
+
+  if (since < 0 || (uint64)since >= next) {
+    LWLockRelease(&header->changes_lock);
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("position " INT64_FORMAT " is not in the change log",
+                    since),
+             errdetail("The last change is at position " UINT64_FORMAT ".",
+                       next - 1)));
+  }
+
+  if ((uint64)since + 1 < oldest) {
+    LWLockRelease(&header->changes_lock);
+    ereport(ERROR,
+            (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+             errmsg("changes after position " INT64_FORMAT
+                    " are no longer available",
+                    since),
+             errdetail("The oldest change in the change log is at position "
+                       UINT64_FORMAT ".",
+                       oldest),
+             errhint("Scan the memory view again and read the changes "
+                     "after the position from memview_change_position().")));
+  }
+
+  scan->nchanges = next - since - 1;
+  scan->changes = palloc_array(MemoryViewChange, scan->nchanges + 1);
+  for (size_t i = 0; i < scan->nchanges; ++i)
+    scan->changes[i] = changes[(since + 1 + i) % MEMVIEW_CHANGE_LOG_SIZE];
+}
+
+/*
+ * Get the changes to the memory view after a position.
+ *
+ * An error is raised if the changes are no longer in the change log,
+ * in which case the consumer need to scan the memory view again.
+ */
+Datum memview_changes(PG_FUNCTION_ARGS) {
+  FuncCallContext* funcctx;
+  MemoryViewChangeScanState* scan;
+
+  if (SRF_IS_FIRSTCALL()) {
+    MemoryContext oldcontext;
+    TupleDesc tupdesc;
+    MemoryViewSession* session;
+
+    funcctx = SRF_FIRSTCALL_INIT();
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+      ereport(ERROR,
+              (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+               errmsg("function returning record called in context "
+                      "that cannot accept type record")));
+
+    funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+    session = memview_session_get();
+
+    oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+    scan = palloc0(sizeof(MemoryViewChangeScanState));
+    LWLockAcquire(&session->header->changes_lock, LW_SHARED);
+    memview_copy_changes(session, PG_GETARG_INT64(0), scan);
+    LWLockRelease(&session->header->changes_lock);
+    MemoryContextSwitchTo(oldcontext);
+
+    funcctx->user_fctx = scan;
+  }
+
+  CHECK_FOR_INTERRUPTS();
+
+  funcctx = SRF_PERCALL_SETUP();
+  scan = funcctx->user_fctx;
+
+  if (scan->change < scan->nchanges) {
+    MemoryViewChange* change = &scan->changes[scan->change];
+    bool nulls[5] = {0};
+    Datum values[5] = {0};
+    HeapTuple tuple;
+
+    values[0] = Int64GetDatum(change->position);
+    values[1] = CStringGetTextDatum(memview_change_names[change->kind]);
+    if (change->kind == MEMVIEW_CHANGE_RESET) {
+      nulls[2] = nulls[3] = nulls[4] = true;
+    } else {
+      values[2] = Int32GetDatum(change->row_id);
+      values[3] = ObjectIdGetDatum(change->owner);
+      values[4] = NameGetDatum(&change->description);
+    }
+
+    tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+    ++scan->change;
+
+    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+  }
+
+  SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * Wait for changes after a position.
+ *
+ * Returns true if there are changes after the position and false if
+ * the timeout, in milliseconds, expired before there were any.
+ */
+Datum memview_changes_wait(PG_FUNCTION_ARGS) {
+  MemoryViewHeader* header = memview_session_get()->header;
+  int64 since = PG_GETARG_INT64(0);
+  int32 timeout = PG_GETARG_INT32(1);
+  TimestampTz start = GetCurrentTimestamp();
+  bool available;
+
+  if (since < 0)
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("position " INT64_FORMAT " is not in the change log",
+                    since)));
+
+  ConditionVariablePrepareToSleep(&header->changes_cv);
+  for (;;) {
+    long elapsed;
+
+    available = pg_atomic_read_u64(&header->next_change) > (uint64)since + 1;
+    if (available)
+      break;
+
+    elapsed = TimestampDifferenceMilliseconds(start, GetCurrentTimestamp());
+    if (elapsed >= timeout)
+      break;
+
+    ConditionVariableTimedSleep(
+        &header->changes_cv, timeout - elapsed, PG_WAIT_EXTENSION);
+  }
+  ConditionVariableCancelSleep();
+
+  PG_RETURN_BOOL(available);
+}
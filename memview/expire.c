@@ -0,0 +1,125 @@
+/*
+ * Copyright 2025 Mats Kindahl.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you
+ * may not use this file except in compliance with the License.  You
+ * may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+/*
+ * Removal of expired records.
+ *
+ * Records can be given an expiry time when they are inserted or
+ * updated. Expired records are skipped by scans and cannot be
+ * modified, but they still use a slot until they are removed by the
+ * expiry background worker, which wakes up every
+ * "memview.expire_interval" milliseconds and removes the expired
+ * records of all partitions in batches.
+ *
+ * The background worker is registered when the library is in
+ * shared_preload_libraries. Without it, expired records are not
+ * visible, but they are only removed when the memory view is reset or
+ * when memview_expire_now() is called.
+ */
+
+#include "memview.h"
+
+#include <postgres.h>
+#include <fmgr.h>
+
+#include <miscadmin.h>
+
+#include <pgstat.h>
+#include <postmaster/bgworker.h>
+#include <postmaster/interrupt.h>
+#include <storage/ipc.h>
+#include <storage/latch.h>
+#include <utils/guc.h>
+#include <utils/memutils.h>
+
+PG_FUNCTION_INFO_V1(memview_expire_now);
+
+int memview_expire_interval = 1000;
+int memview_expire_batch_size = 1000;
+
+/*
+ * Register the background worker that removes expired records.
+ */
+void memview_expire_register(void) {
+  BackgroundWorker worker;
+
+  memset(&worker, 0, sizeof(worker));
+  worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+  worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+  worker.bgw_restart_time = 10;
+  snprintf(worker.bgw_library_name, MAXPGPATH, "memview");
+  snprintf(worker.bgw_function_name, BGW_MAXLEN, "memview_expire_main");
+  snprintf(worker.bgw_name, BGW_MAXLEN, "memview expiry");
+  snprintf(worker.bgw_type, BGW_MAXLEN, "memview expiry");
+  RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * Main function for the expiry background worker.
+ *
+ * Each round allocates in a memory context that is reset after the
+ * round, so nothing is leaked even if the worker runs for a long
+ * time.
+ */
+void memview_expire_main(Datum main_arg) {
+  MemoryContext context;
+  MemoryViewSession* session;
+
+  pqsignal(SIGHUP, SignalHandlerForConfigReload);
+  pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+  BackgroundWorkerUnblockSignals();
+
+  session = memview_session_get();
+  context = AllocSetContextCreate(
+      TopMemoryContext, "memview expiry", ALLOCSET_DEFAULT_SIZES);
+
+  while (!ShutdownRequestPending) {
+    int events = WL_LATCH_SET | WL_EXIT_ON_PM_DEATH;
+
+    if (memview_expire_interval > 0)
+      events |= WL_TIMEOUT;
+
+    (void)WaitLatch(
+        MyLatch, events, memview_expire_interval, PG_WAIT_EXTENSION);
+    ResetLatch(MyLatch);
+
+    if (ConfigReloadPending) {
+      ConfigReloadPending = false;
+      ProcessConfigFile(PGC_SIGHUP);
+    }
+
+    if (ShutdownRequestPending || memview_expire_interval == 0)
+      continue;
+
+    MemoryContextSwitchTo(context);
+    memview_expire(session);
+    MemoryContextSwitchTo(TopMemoryContext);
+    MemoryContextReset(context);
+  }
+
+  proc_exit(0);
+}
+
+/*
+ * Remove expired records from all partitions right away.
+ *
+ * This does the same work as a round of the background worker, so it
+ * can be used when the worker is not running.
+ */
+Datum memview_expire_now(PG_FUNCTION_ARGS) {
+  memview_expire(memview_session_get());
+  PG_RETURN_VOID();
+}
@@ -0,0 +1,780 @@
+/*
+ * Copyright 2025 Mats Kindahl.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you
+ * may not use this file except in compliance with the License.  You
+ * may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+/*
+ * Foreign data wrapper for the memory view.
+ *
+ * This allows the memory view to be defined as a foreign table, which
+ * means that the planner gets row estimates from the actual number of
+ * records in the memory view. Equality and IN restrictions on the
+ * "row_id", "dboid", and "owner" columns are pushed down to the scan,
+ * so looking up rows by row identifier only reads the slots for those
+ * rows, and looking up rows by owner only reads the rows of those
+ * owners using the owner index, instead of reading the entire memory
+ * view.
+ *
+ * The columns of the foreign table are matched by name, and columns
+ * that are not part of the memory view are always null.
+ */
+
+#include "memview.h"
+
+#include <postgres.h>
+#include <fmgr.h>
+
+#include <miscadmin.h>
+
+#include <catalog/pg_type.h>
+#include <commands/explain.h>
+#include <executor/executor.h>
+#include <foreign/fdwapi.h>
+#include <nodes/nodeFuncs.h>
+#include <optimizer/cost.h>
+#include <optimizer/optimizer.h>
+#include <optimizer/pathnode.h>
+#include <optimizer/planmain.h>
+#include <optimizer/restrictinfo.h>
+#include <parser/parsetree.h>
+#include <utils/array.h>
+#include <utils/builtins.h>
+#include <utils/fmgroids.h>
+#include <utils/lsyscache.h>
+#include <utils/memutils.h>
+#include <utils/rel.h>
+#include <utils/timestamp.h>
+
+#if PG_VERSION_NUM >= 180000
+#include <commands/explain_format.h>
+#endif
+
+PG_FUNCTION_INFO_V1(memview_fdw_handler);
+
+/*
+ * Number of elements we assume for an array that is not known until
+ * execution time.
+ */
+#define MEMVIEW_FDW_ARRAY_ELEMENTS 10
+
+/*
+ * Columns of the memory view.
+ */
+typedef enum MemoryViewColumn {
+  MEMVIEW_COLUMN_NONE,
+  MEMVIEW_COLUMN_ROW_ID,
+  MEMVIEW_COLUMN_DBOID,
+  MEMVIEW_COLUMN_OWNER,
+  MEMVIEW_COLUMN_DESCRIPTION,
+  MEMVIEW_COLUMN_EXPIRES_AT,
+} MemoryViewColumn;
+
+static const char* const memview_column_names[] = {
+    [MEMVIEW_COLUMN_NONE] = NULL,
+    [MEMVIEW_COLUMN_ROW_ID] = "row_id",
+    [MEMVIEW_COLUMN_DBOID] = "dboid",
+    [MEMVIEW_COLUMN_OWNER] = "owner",
+    [MEMVIEW_COLUMN_DESCRIPTION] = "description",
+    [MEMVIEW_COLUMN_EXPIRES_AT] = "expires_at",
+};
+
+static const Oid memview_column_types[] = {
+    [MEMVIEW_COLUMN_NONE] = InvalidOid,
+    [MEMVIEW_COLUMN_ROW_ID] = INT4OID,
+    [MEMVIEW_COLUMN_DBOID] = OIDOID,
+    [MEMVIEW_COLUMN_OWNER] = OIDOID,
+    [MEMVIEW_COLUMN_DESCRIPTION] = NAMEOID,
+    [MEMVIEW_COLUMN_EXPIRES_AT] = TIMESTAMPTZOID,
+};
+
+/*
+ * Restriction that can be pushed down to the scan.
+ *
+ * The value is either a single value or an array of values, and it
+ * is evaluated when the scan starts.
+ */
+typedef struct MemoryViewQual {
+  MemoryViewColumn column;
+  bool is_array;
+  Expr* value;
+} MemoryViewQual;
+
+/*
+ * Pushed-down restrictions are passed to the executor as a list of
+ * integers in the private part of the plan, with one element for
+ * each value in "fdw_exprs".
+ */
+#define MEMVIEW_QUAL_KIND(COLUMN, IS_ARRAY) (2 * (COLUMN) + (IS_ARRAY))
+#define MEMVIEW_QUAL_COLUMN(KIND) ((MemoryViewColumn)((KIND) / 2))
+#define MEMVIEW_QUAL_IS_ARRAY(KIND) ((KIND) % 2 == 1)
+
+/*
+ * Planner information passed from GetForeignRelSize to
+ * GetForeignPaths.
+ */
+typedef struct MemoryViewPlanInfo {
+  double nscanned; /* Number of slots read by the scan */
+} MemoryViewPlanInfo;
+
+/*
+ * Values for a column that the scan is restricted to.
+ *
+ * Values are kept sorted so that restrictions on the same column can
+ * be intersected.
+ */
+typedef struct MemoryViewValues {
+  bool restricted;
+  int nvalues;
+  Datum* values;
+} MemoryViewValues;
+
+/*
+ * Execution state for the foreign scan.
+ *
+ * The snapshot and the restrictions are allocated in a memory context
+ * of the scan, which is reset when the scan is started again, so that
+ * rescans do not keep the snapshots of earlier scans around until the
+ * end of the query.
+ */
+typedef struct MemoryViewScanState {
+  bool started;
+  MemoryContext context;
+  List* kinds;
+  List* value_states;
+  MemoryViewColumn* columns;
+  MemoryViewSnapshot snapshot;
+  size_t row;
+} MemoryViewScanState;
+
+static MemoryViewColumn memview_column_by_name(const char* attname) {
+  for (int column = MEMVIEW_COLUMN_ROW_ID; column <= MEMVIEW_COLUMN_EXPIRES_AT;
+       ++column)
+    if (strcmp(attname, memview_column_names[column]) == 0)
+      return column;
+  return MEMVIEW_COLUMN_NONE;
+}
+
+static Expr* memview_strip_relabel(Expr* expr) {
+  if (IsA(expr, RelabelType))
+    return ((RelabelType*)expr)->arg;
+  return expr;
+}
+
+/*
+ * Check that an expression can be evaluated when the scan starts.
+ *
+ * We accept constants and parameters, and arrays of those.
+ */
+static bool memview_is_pushable_value(Expr* expr) {
+  if (IsA(expr, Const) || IsA(expr, Param))
+    return true;
+
+  if (IsA(expr, ArrayExpr)) {
+    ListCell* lc;
+    foreach (lc, ((ArrayExpr*)expr)->elements)
+      if (!IsA(lfirst(lc), Const) && !IsA(lfirst(lc), Param))
+        return false;
+    return true;
+  }
+
+  return false;
+}
+
+/*
+ * Get the memory view column for a variable of the foreign table,
+ * checking that the equality operator matches the column type.
+ */
+static MemoryViewColumn memview_qual_column(PlannerInfo* root,
+                                            RelOptInfo* baserel,
+                                            Expr* expr,
+                                            Oid opno) {
+  RangeTblEntry* rte;
+  Var* var;
+  MemoryViewColumn column;
+  char* attname;
+  RegProcedure opcode = get_opcode(opno);
+
+  expr = memview_strip_relabel(expr);
+  if (!IsA(expr, Var))
+    return MEMVIEW_COLUMN_NONE;
+
+  var = (Var*)expr;
+  if (var->varno != baserel->relid || var->varlevelsup != 0 ||
+      var->varattno <= 0)
+    return MEMVIEW_COLUMN_NONE;
+
+  rte = planner_rt_fetch(baserel->relid, root);
+  attname = get_attname(rte->relid, var->varattno, false);
+  column = memview_column_by_name(attname);
+
+  switch (column) {
+    case MEMVIEW_COLUMN_ROW_ID:
+      return opcode == F_INT4EQ ? column : MEMVIEW_COLUMN_NONE;
+    case MEMVIEW_COLUMN_DBOID:
+    case MEMVIEW_COLUMN_OWNER:
+      return opcode == F_OIDEQ ? column : MEMVIEW_COLUMN_NONE;
+    default:
+      return MEMVIEW_COLUMN_NONE;
+  }
+}
+
+/*
+ * Check if a clause is a restriction that can be pushed down to the
+ * scan.
+ *
+ * This is either "column = value" (in any order) or "column =
+ * ANY(array)", where IN lists are turned into the latter by the
+ * parser.
+ */
+static bool memview_classify_qual(PlannerInfo* root,
+                                  RelOptInfo* baserel,
+                                  Expr* clause,
+                                  MemoryViewQual* qual) {
+  if (IsA(clause, OpExpr)) {
+    OpExpr* op = (OpExpr*)clause;
+    Expr* left;
+    Expr* right;
+
+    if (list_length(op->args) != 2)
+      return false;
+
+    left = linitial(op->args);
+    right = lsecond(op->args);
+
+    qual->is_array = false;
+    qual->column = memview_qual_column(root, baserel, left, op->opno);
+    qual->value = memview_strip_relabel(right);
+    if (qual->column == MEMVIEW_COLUMN_NONE) {
+      qual->column = memview_qual_column(root, baserel, right, op->opno);
+      qual->value = memview_strip_relabel(left);
+    }
+
+    return qual->column != MEMVIEW_COLUMN_NONE &&
+           memview_is_pushable_value(qual->value);
+  }
+
+  if (IsA(clause, ScalarArrayOpExpr)) {
+    ScalarArrayOpExpr* saop = (ScalarArrayOpExpr*)clause;
+
+    if (!saop->useOr)
+      return false;
+
+    qual->is_array = true;
+    qual->column =
+        memview_qual_column(root, baserel, linitial(saop->args), saop->opno);
+    qual->value = lsecond(saop->args);
+
+    return qual->column != MEMVIEW_COLUMN_NONE &&
+           memview_is_pushable_value(qual->value);
+  }
+
+  return false;
+}
+
+/*
+ * Estimate the number of values for a pushed-down restriction.
+ */
+static double memview_qual_nvalues(MemoryViewQual* qual) {
+  if (!qual->is_array)
+    return 1;
+
+  if (IsA(qual->value, Const)) {
+    Const* c = (Const*)qual->value;
+    ArrayType* array;
+
+    if (c->constisnull)
+      return 0;
+    array = DatumGetArrayTypeP(c->constvalue);
+    return ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+  }
+
+  if (IsA(qual->value, ArrayExpr))
+    return list_length(((ArrayExpr*)qual->value)->elements);
+
+  return MEMVIEW_FDW_ARRAY_ELEMENTS;
+}
+
+/*
+ * Get the OIDs of a restriction on an OID column, if they are known
+ * at planning time.
+ *
+ * Returns false if the value is not a constant. Null values are
+ * skipped since they do not match any rows.
+ */
+static bool memview_qual_oids(MemoryViewQual* qual, Oid** oids, int* noids) {
+  Const* c;
+  Datum* elems;
+  bool* nulls;
+  int nelems;
+
+  if (!IsA(qual->value, Const))
+    return false;
+
+  c = (Const*)qual->value;
+  *noids = 0;
+  *oids = NULL;
+
+  if (c->constisnull)
+    return true;
+
+  if (!qual->is_array) {
+    *oids = palloc(sizeof(Oid));
+    (*oids)[(*noids)++] = DatumGetObjectId(c->constvalue);
+    return true;
+  }
+
+  deconstruct_array_builtin(
+      DatumGetArrayTypeP(c->constvalue), OIDOID, &elems, &nulls, &nelems);
+  *oids = palloc_array(Oid, nelems + 1);
+  for (int i = 0; i < nelems; ++i)
+    if (!nulls[i])
+      (*oids)[(*noids)++] = DatumGetObjectId(elems[i]);
+  return true;
+}
+
+/*
+ * Check if a restriction on the database OID can match the current
+ * database. If the value is not known until execution time, we assume
+ * that it matches.
+ */
+static bool memview_qual_matches_database(MemoryViewQual* qual) {
+  Oid* oids;
+  int noids;
+
+  if (!memview_qual_oids(qual, &oids, &noids))
+    return true;
+
+  for (int i = 0; i < noids; ++i)
+    if (oids[i] == MyDatabaseId)
+      return true;
+  return false;
+}
+
+/*
+ * Get the number of rows for a restriction on the owner from the
+ * owner index, if the owners are known at planning time.
+ *
+ * Returns a negative number if the owners are not known.
+ */
+static double memview_qual_owner_rows(MemoryViewSession* session,
+                                      MemoryViewQual* qual) {
+  Oid* oids;
+  int noids;
+  double rows = 0;
+
+  if (!memview_qual_oids(qual, &oids, &noids))
+    return -1;
+
+  /* Duplicate owners would be counted twice, but this is just an
+   * estimate. */
+  for (int i = 0; i < noids; ++i)
+    rows += memview_owner_count(session, oids[i]);
+  return rows;
+}
+
+/*
+ * Estimate the number of rows for the scan.
+ *
+ * Since the memory view is partitioned by database, the scan only
+ * reads the rows of the current database, and we know exactly how
+ * many there are. Restrictions on the row identifier limit the scan
+ * to those slots, restrictions on the owner limit the scan to the
+ * rows in the owner index, and a restriction on the database that
+ * does not match the current database means that there are no rows
+ * at all.
+ */
+static void memview_GetForeignRelSize(PlannerInfo* root,
+                                      RelOptInfo* baserel,
+                                      Oid foreigntableid) {
+  MemoryViewSession* session = memview_session_get();
+  MemoryViewPlanInfo* info = palloc0(sizeof(MemoryViewPlanInfo));
+  double nrecords = session->header->nrecords;
+  double rows = nrecords;
+  List* other_quals = NIL;
+  ListCell* lc;
+
+  info->nscanned = session->header->nslots;
+
+  foreach (lc, baserel->baserestrictinfo) {
+    RestrictInfo* rinfo = lfirst_node(RestrictInfo, lc);
+    MemoryViewQual qual;
+    double owner_rows;
+
+    if (!memview_classify_qual(root, baserel, rinfo->clause, &qual)) {
+      other_quals = lappend(other_quals, rinfo);
+      continue;
+    }
+
+    switch (qual.column) {
+      case MEMVIEW_COLUMN_ROW_ID:
+        info->nscanned = Min(info->nscanned, memview_qual_nvalues(&qual));
+        rows = Min(rows, info->nscanned);
+        break;
+
+      case MEMVIEW_COLUMN_DBOID:
+        if (!memview_qual_matches_database(&qual))
+          rows = info->nscanned = 0;
+        break;
+
+      case MEMVIEW_COLUMN_OWNER:
+        owner_rows = memview_qual_owner_rows(session, &qual);
+        if (owner_rows < 0) {
+          other_quals = lappend(other_quals, rinfo);
+        } else {
+          info->nscanned = Min(info->nscanned, owner_rows);
+          rows = Min(rows, owner_rows);
+        }
+        break;
+
+      default:
+        other_quals = lappend(other_quals, rinfo);
+        break;
+    }
+  }
+
+  rows *= clauselist_selectivity(
+      root, other_quals, baserel->relid, JOIN_INNER, NULL);
+
+  baserel->tuples = nrecords;
+  baserel->rows = clamp_row_est(rows);
+  baserel->fdw_private = info;
+}
+
+static void memview_GetForeignPaths(PlannerInfo* root,
+                                    RelOptInfo* baserel,
+                                    Oid foreigntableid) {
+  MemoryViewPlanInfo* info = baserel->fdw_private;
+  Cost total_cost =
+      info->nscanned * cpu_operator_cost + baserel->rows * cpu_tuple_cost;
+
+  add_path(baserel,
+           (Path*)create_foreignscan_path(root,
+                                          baserel,
+                                          NULL,
+                                          baserel->rows,
+#if PG_VERSION_NUM >= 180000
+                                          0,
+#endif
+                                          0,
+                                          total_cost,
+                                          NIL,
+                                          NULL,
+                                          NULL,
+#if PG_VERSION_NUM >= 170000
+                                          NIL,
+#endif
+                                          NIL));
+}
+
+/*
+ * Create the plan for the scan.
+ *
+ * The values of the pushed-down restrictions are passed in
+ * "fdw_exprs" so that parameters are set up correctly for the
+ * executor. All restrictions are still checked by the executor, which
+ * is cheap since the pushed-down restrictions only remove rows.
+ */
+static ForeignScan* memview_GetForeignPlan(PlannerInfo* root,
+                                           RelOptInfo* baserel,
+                                           Oid foreigntableid,
+                                           ForeignPath* best_path,
+                                           List* tlist,
+                                           List* scan_clauses,
+                                           Plan* outer_plan) {
+  List* fdw_exprs = NIL;
+  List* kinds = NIL;
+  ListCell* lc;
+
+  foreach (lc, scan_clauses) {
+    RestrictInfo* rinfo = lfirst_node(RestrictInfo, lc);
+    MemoryViewQual qual;
+
+    if (memview_classify_qual(root, baserel, rinfo->clause, &qual)) {
+      fdw_exprs = lappend(fdw_exprs, qual.value);
+      kinds = lappend_int(kinds, MEMVIEW_QUAL_KIND(qual.column, qual.is_array));
+    }
+  }
+
+  scan_clauses = extract_actual_clauses(scan_clauses, false);
+
+  return make_foreignscan(tlist,
+                          scan_clauses,
+                          baserel->relid,
+                          fdw_exprs,
+                          kinds,
+                          NIL,
+                          NIL,
+                          outer_plan);
+}
+
+/*
+ * Map the attributes of the foreign table to memory view columns,
+ * checking that the column types match.
+ */
+static MemoryViewColumn* memview_map_columns(Relation rel) {
+  TupleDesc tupdesc = RelationGetDescr(rel);
+  MemoryViewColumn* columns = palloc0_array(MemoryViewColumn, tupdesc->natts);
+
+  for (int i = 0; i < tupdesc->natts; ++i) {
+    Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+    MemoryViewColumn column;
+    Oid expected;
+
+    if (attr->attisdropped)
+      continue;
+
+    column = memview_column_by_name(NameStr(attr->attname));
+    expected = memview_column_types[column];
+    if (column != MEMVIEW_COLUMN_NONE && attr->atttypid != expected &&
+        !(column == MEMVIEW_COLUMN_OWNER && attr->atttypid == REGROLEOID))
+      ereport(ERROR,
+              (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+               errmsg("column \"%s\" of foreign table \"%s\" must have type %s",
+                      NameStr(attr->attname),
+                      RelationGetRelationName(rel),
+                      format_type_be(expected))));
+    columns[i] = column;
+  }
+
+  return columns;
+}
+
+static void memview_BeginForeignScan(ForeignScanState* node, int eflags) {
+  ForeignScan* fsplan = (ForeignScan*)node->ss.ps.plan;
+  MemoryViewScanState* state = palloc0(sizeof(MemoryViewScanState));
+
+  state->kinds = fsplan->fdw_private;
+  state->columns = memview_map_columns(node->ss.ss_currentRelation);
+  node->fdw_state = state;
+
+  if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+    return;
+
+  state->context = AllocSetContextCreate(
+      CurrentMemoryContext, "memview scan", ALLOCSET_DEFAULT_SIZES);
+  state->value_states = ExecInitExprList(fsplan->fdw_exprs, (PlanState*)node);
+}
+
+static int memview_datum_cmp(const void* a, const void* b) {
+  Datum lhs = *(const Datum*)a;
+  Datum rhs = *(const Datum*)b;
+  return (lhs > rhs) - (lhs < rhs);
+}
+
+/*
+ * Restrict the values for a column, intersecting with any previous
+ * restriction on the same column.
+ */
+static void memview_restrict_values(MemoryViewValues* values,
+                                    Datum* elems,
+                                    int nelems) {
+  int count = 0;
+
+  qsort(elems, nelems, sizeof(Datum), memview_datum_cmp);
+
+  for (int i = 0; i < nelems; ++i) {
+    if (count > 0 && elems[count - 1] == elems[i])
+      continue;
+    if (values->restricted && bsearch(&elems[i],
+                                      values->values,
+                                      values->nvalues,
+                                      sizeof(Datum),
+                                      memview_datum_cmp) == NULL)
+      continue;
+    elems[count++] = elems[i];
+  }
+
+  values->restricted = true;
+  values->values = elems;
+  values->nvalues = count;
+}
+
+/*
+ * Start the scan by evaluating the pushed-down restrictions and
+ * taking a snapshot of the matching rows.
+ */
+static void memview_start_scan(ForeignScanState* node) {
+  MemoryViewScanState* state = node->fdw_state;
+  ExprContext* econtext = node->ss.ps.ps_ExprContext;
+  MemoryViewValues values[MEMVIEW_COLUMN_EXPIRES_AT + 1] = {0};
+  MemoryViewFilter filter = {0};
+  MemoryContext oldcontext;
+  ListCell *lc_kind, *lc_value;
+
+  MemoryContextReset(state->context);
+  oldcontext = MemoryContextSwitchTo(state->context);
+
+  forboth(lc_kind, state->kinds, lc_value, state->value_states) {
+    int kind = lfirst_int(lc_kind);
+    MemoryViewColumn column = MEMVIEW_QUAL_COLUMN(kind);
+    bool isnull;
+    Datum value = ExecEvalExpr(lfirst(lc_value), econtext, &isnull);
+    Datum* elems;
+    int nelems = 0;
+
+    if (isnull) {
+      elems = NULL;
+    } else if (MEMVIEW_QUAL_IS_ARRAY(kind)) {
+      bool* nulls;
+      int count;
+
+      deconstruct_array_builtin(DatumGetArrayTypeP(value),
+                                memview_column_types[column],
+                                &elems,
+                                &nulls,
+                                &count);
+      for (int i = 0; i < count; ++i)
+        if (!nulls[i])
+          elems[nelems++] = elems[i];
+    } else {
+      elems = palloc(sizeof(Datum));
+      elems[nelems++] = value;
+    }
+
+    memview_restrict_values(&values[column], elems, nelems);
+  }
+
+  state->row = 0;
+  memset(&state->snapshot, 0, sizeof(state->snapshot));
+
+  if (values[MEMVIEW_COLUMN_DBOID].restricted) {
+    Datum dboid = ObjectIdGetDatum(MyDatabaseId);
+    if (bsearch(&dboid,
+                values[MEMVIEW_COLUMN_DBOID].values,
+                values[MEMVIEW_COLUMN_DBOID].nvalues,
+                sizeof(Datum),
+                memview_datum_cmp) == NULL)
+      goto done;
+  }
+
+  if (values[MEMVIEW_COLUMN_ROW_ID].restricted) {
+    MemoryViewValues* row_ids = &values[MEMVIEW_COLUMN_ROW_ID];
+    int32* array = palloc_array(int32, row_ids->nvalues + 1);
+
+    for (int i = 0; i < row_ids->nvalues; ++i)
+      array[i] = DatumGetInt32(row_ids->values[i]);
+    filter.row_ids = array;
+    filter.nrow_ids = row_ids->nvalues;
+  }
+
+  if (values[MEMVIEW_COLUMN_OWNER].restricted) {
+    MemoryViewValues* owners = &values[MEMVIEW_COLUMN_OWNER];
+    Oid* array = palloc_array(Oid, owners->nvalues + 1);
+
+    for (int i = 0; i < owners->nvalues; ++i)
+      array[i] = DatumGetObjectId(owners->values[i]);
+    filter.owners = array;
+    filter.nowners = owners->nvalues;
+  }
+
+  memview_snapshot(memview_session_get(), &filter, &state->snapshot);
+
+done:
+  state->started = true;
+  MemoryContextSwitchTo(oldcontext);
+}
+
+static TupleTableSlot* memview_IterateForeignScan(ForeignScanState* node) {
+  MemoryViewScanState* state = node->fdw_state;
+  TupleTableSlot* slot = node->ss.ss_ScanTupleSlot;
+  MemoryViewRecord* record;
+
+  if (!state->started)
+    memview_start_scan(node);
+
+  ExecClearTuple(slot);
+
+  if (state->row >= state->snapshot.nrows)
+    return slot;
+
+  record = &state->snapshot.records[state->row];
+  for (int i = 0; i < slot->tts_tupleDescriptor->natts; ++i) {
+    slot->tts_isnull[i] = false;
+    switch (state->columns[i]) {
+      case MEMVIEW_COLUMN_ROW_ID:
+        slot->tts_values[i] =
+            Int32GetDatum(state->snapshot.row_ids[state->row]);
+        break;
+      case MEMVIEW_COLUMN_DBOID:
+        slot->tts_values[i] = ObjectIdGetDatum(record->dboid);
+        break;
+      case MEMVIEW_COLUMN_OWNER:
+        slot->tts_values[i] = ObjectIdGetDatum(record->owner);
+        slot->tts_isnull[i] = !OidIsValid(record->owner);
+        break;
+      case MEMVIEW_COLUMN_DESCRIPTION:
+        slot->tts_values[i] = NameGetDatum(&record->description);
+        slot->tts_isnull[i] = !OidIsValid(record->owner);
+        break;
+      case MEMVIEW_COLUMN_EXPIRES_AT:
+        slot->tts_values[i] = TimestampTzGetDatum(record->expires_at);
+        slot->tts_isnull[i] = record->expires_at == MEMVIEW_NO_EXPIRY;
+        break;
+      case MEMVIEW_COLUMN_NONE:
+        slot->tts_values[i] = (Datum)0;
+        slot->tts_isnull[i] = true;
+        break;
+    }
+  }
+
+  ++state->row;
+
+  return ExecStoreVirtualTuple(slot);
+}
+
+static void memview_ReScanForeignScan(ForeignScanState* node) {
+  MemoryViewScanState* state = node->fdw_state;
+
+  /* Parameters might have changed, so we need to start over */
+  state->started = false;
+}
+
+static void memview_EndForeignScan(ForeignScanState* node) {
+}
+
+static void memview_ExplainForeignScan(ForeignScanState* node,
+                                       ExplainState* es) {
+  MemoryViewScanState* state = node->fdw_state;
+  StringInfoData buf;
+  ListCell* lc;
+
+  if (state->kinds == NIL)
+    return;
+
+  initStringInfo(&buf);
+  foreach (lc, state->kinds) {
+    int kind = lfirst_int(lc);
+    if (buf.len > 0)
+      appendStringInfoString(&buf, ", ");
+    appendStringInfoString(&buf,
+                           memview_column_names[MEMVIEW_QUAL_COLUMN(kind)]);
+  }
+
+  ExplainPropertyText("Pushed Down", buf.data, es);
+}
+
+Datum memview_fdw_handler(PG_FUNCTION_ARGS) {
+  FdwRoutine* routine = makeNode(FdwRoutine);
+
+  routine->GetForeignRelSize = memview_GetForeignRelSize;
+  routine->GetForeignPaths = memview_GetForeignPaths;
+  routine->GetForeignPlan = memview_GetForeignPlan;
+  routine->BeginForeignScan = memview_BeginForeignScan;
+  routine->IterateForeignScan = memview_IterateForeignScan;
+  routine->ReScanForeignScan = memview_ReScanForeignScan;
+  routine->EndForeignScan = memview_EndForeignScan;
+  routine->ExplainForeignScan = memview_ExplainForeignScan;
+
+  PG_RETURN_POINTER(routine);
+}
@@ -0,0 +1,412 @@
+/*
+ * Copyright 2025 Mats Kindahl.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you
+ * may not use this file except in compliance with the License.  You
+ * may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+/*
+ * Write-behind of the memory view to a table.
+ *
+ * If "memview.flush_table" is set, a background worker connected to
+ * "memview.flush_database" writes the rows of the partition for that
+ * database to the table every "memview.flush_interval" milliseconds.
+ * Writers only mark the records they modify as dirty, so rows can be
+ * updated at shared memory speed and the table is written in batches
+ * of at most "memview.flush_batch_size" rows using one upsert and one
+ * delete statement for each batch.
+ *
+ * When the background worker starts for the first time after the
+ * server has started, the memory view is empty unless it was loaded
+ * from a file, so it is seeded from the table instead, which keeps
+ * the rows of the table across restarts and crashes. Otherwise, and
+ * after the memory view has been reset, the table is cleared and
+ * rebuilt from the memory view in a single transaction, so readers of
+ * the table never see a partial copy. Modifications that have not been
+ * written when the server crashes are lost.
+ */
+
+#include "memview.h"
+
+#include <postgres.h>
+#include <fmgr.h>
+
+#include <miscadmin.h>
+
+#include <access/xact.h>
+#include <catalog/namespace.h>
+#include <catalog/pg_type.h>
+#include <executor/spi.h>
+#include <pgstat.h>
+#include <postmaster/bgworker.h>
+#include <postmaster/interrupt.h>
+#include <storage/ipc.h>
+#include <storage/latch.h>
+#include <utils/array.h>
+#include <utils/builtins.h>
+#include <utils/guc.h>
+#include <utils/memutils.h>
+#include <utils/snapmgr.h>
+#include <utils/varlena.h>
+
+char* memview_flush_table = NULL;
+char* memview_flush_database = NULL;
+int memview_flush_interval = 5000;
+int memview_flush_batch_size = 1000;
+
+/*
+ * Statement used to write to the table.
+ *
+ * The statements are prepared on first use and the plans are kept for
+ * the lifetime of the background worker.
+ */
+typedef struct MemoryViewFlushQuery {
+  char* query;
+  int nargs;
+  Oid argtypes[3];
+  int ok;
+  SPIPlanPtr plan;
+} MemoryViewFlushQuery;
+
+static MemoryViewFlushQuery memview_flush_upsert = {
+    .nargs = 3,
+    .argtypes = {INT4ARRAYOID, OIDARRAYOID, NAMEARRAYOID},
+    .ok = SPI_OK_INSERT,
+};
+
+static MemoryViewFlushQuery memview_flush_delete = {
+    .nargs = 1,
+    .argtypes = {INT4ARRAYOID},
+    .ok = SPI_OK_DELETE,
+};
+
+static MemoryViewFlushQuery memview_flush_clear = {
+    .nargs = 0,
+    .ok = SPI_OK_DELETE,
+};
+
+static MemoryViewFlushQuery memview_flush_read = {
+    .nargs = 0,
+    .ok = SPI_OK_SELECT,
+};
+
+/*
+ * Build the statements for the table.
+ *
+ * The table name can be qualified with a schema and is quoted, so it
+ * is not possible to inject anything through the parameter.
+ */
+static void memview_flush_prepare(void) {
+  List* names = stringToQualifiedNameList(memview_flush_table, NULL);
+  char* table = NameListToQuotedString(names);
+  MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+  memview_flush_upsert.query =
+      psprintf("insert into %s (row_id, owner, description)"
+               " select * from unnest($1, $2, $3)"
+               " on conflict (row_id) do update"
+               " set owner = excluded.owner,"
+               " description = excluded.description",
+               table);
+  memview_flush_delete.query =
+      psprintf("delete from %s where row_id = any($1)", table);
+  memview_flush_clear.query = psprintf("delete from %s", table);
+  memview_flush_read.query = psprintf(
+      "select row_id, owner, description from %s where row_id >= 0 and "
+      "row_id < %d",
+      table,
+      MEMVIEW_MAX_RECORDS);
+
+  MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Execute one of the statements.
+ */
+static void memview_flush_execute(MemoryViewFlushQuery* query,
+                                  Datum* values) {
+  int rc;
+
+  debug_query_string = query->query;
+  pgstat_report_activity(STATE_RUNNING, query->query);
+
+  if (query->plan == NULL) {
+    SPIPlanPtr plan =
+        SPI_prepare(query->query, query->nargs, query->argtypes);
+    if (plan == NULL)
+      elog(ERROR, "SPI_prepare failed for \"%s\"", query->query);
+    if (SPI_keepplan(plan))
+      elog(ERROR, "SPI_keepplan failed for \"%s\"", query->query);
+    query->plan = plan;
+  }
+
+  rc = SPI_execute_plan(query->plan, values, NULL, false, 0);
+  if (rc != query->ok)
+    elog(ERROR, "SPI_execute_plan failed for \"%s\"", query->query);
+
+  debug_query_string = NULL;
+  pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+/*
+ * Write a batch of rows to the table.
+ *
+ * Rows that are used are inserted or updated, and rows that are no
+ * longer used are deleted, using one statement each with the values
+ * passed as arrays.
+ */
+static void memview_flush_write(MemoryViewFlushRow* rows, int nrows) {
+  Datum* row_ids = palloc_array(Datum, nrows);
+  Datum* owners = palloc_array(Datum, nrows);
+  Datum* descrs = palloc_array(Datum, nrows);
+  Datum* deleted = palloc_array(Datum, nrows);
+  int nused = 0, ndeleted = 0;
+
+  for (int i = 0; i < nrows; ++i) {
+    if (rows[i].used) {
+      row_ids[nused] = Int32GetDatum(rows[i].row_id);
+      owners[nused] = ObjectIdGetDatum(rows[i].owner);
+      descrs[nused] = NameGetDatum(&rows[i].description);
+      ++nused;
+    } else {
+      deleted[ndeleted++] = Int32GetDatum(rows[i].row_id);
+    }
+  }
+
+  if (nused > 0) {
+    Datum values[3];
+
+    values[0] =
+        PointerGetDatum(construct_array_builtin(row_ids, nused, INT4OID));
+    values[1] =
+        PointerGetDatum(construct_array_builtin(owners, nused, OIDOID));
+    values[2] =
+        PointerGetDatum(construct_array_builtin(descrs, nused, NAMEOID));
+    memview_flush_execute(&memview_flush_upsert, values);
+  }
+
+  if (ndeleted > 0) {
+    Datum values[1];
+
+    values[0] =
+        PointerGetDatum(construct_array_builtin(deleted, ndeleted, INT4OID));
+    memview_flush_execute(&memview_flush_delete, values);
+  }
+}
+
+/*
+ * Start a transaction for writing to the table.
+ */
+static void memview_flush_begin(void) {
+  SetCurrentStatementStartTimestamp();
+  StartTransactionCommand();
+  if (SPI_connect() != SPI_OK_CONNECT)
+    elog(ERROR, "%s: SPI_connect failed", __func__);
+  PushActiveSnapshot(GetTransactionSnapshot());
+}
+
+/*
+ * Commit a transaction started with memview_flush_begin().
+ */
+static void memview_flush_commit(MemoryContext context) {
+  if (SPI_finish() != SPI_OK_FINISH)
+    elog(ERROR, "%s: SPI_finish failed", __func__);
+  PopActiveSnapshot();
+  CommitTransactionCommand();
+  pgstat_report_stat(true);
+  MemoryContextSwitchTo(context);
+}
+
+/*
+ * Start writing to the table.
+ *
+ * The rows of the table are read so that the memory view can be
+ * seeded from them if it has not been used since the server started.
+ * Returns true if the table is in sync with the memory view and false
+ * if it has to be rebuilt.
+ */
+static bool memview_flush_sync(MemoryViewSession* session) {
+  MemoryContext context = CurrentMemoryContext;
+  MemoryViewFlushRow* rows;
+  int nrows = 0;
+  bool synced;
+
+  memview_flush_begin();
+  memview_flush_execute(&memview_flush_read, NULL);
+
+  rows = MemoryContextAlloc(
+      context, Max(SPI_processed, 1) * sizeof(MemoryViewFlushRow));
+  for (uint64 i = 0; i < SPI_processed; ++i) {
+    HeapTuple tuple = SPI_tuptable->vals[i];
+    TupleDesc tupdesc = SPI_tuptable->tupdesc;
+    MemoryViewFlushRow* row = &rows[nrows++];
+    bool isnull;
+    Datum value;
+
+    memset(row, 0, sizeof(*row));
+    row->used = true;
+    row->row_id = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+    value = SPI_getbinval(tuple, tupdesc, 2, &isnull);
+    row->owner = isnull ? InvalidOid : DatumGetObjectId(value);
+    value = SPI_getbinval(tuple, tupdesc, 3, &isnull);
+    if (!isnull)
+      namestrcpy(&row->description, NameStr(*DatumGetName(value)));
+  }
+
+  memview_flush_commit(context);
+
+  synced = memview_flush_start(session, rows, nrows);
+  if (synced)
+    ereport(LOG,
+            (errmsg("loaded %d rows into memory view from \"%s\"",
+                    nrows,
+                    memview_flush_table)));
+
+  pfree(rows);
+  return synced;
+}
+
+/*
+ * Write the dirty rows of the memory view to the table.
+ *
+ * Each batch is written in a separate transaction and the rows are
+ * only marked as clean after the transaction has committed, so if
+ * writing fails, the rows are written again by the next attempt.
+ *
+ * If the memory view has been reset since the last write, or the table
+ * was not in sync when the worker started, the table is cleared and
+ * all batches are written in the same transaction, so that readers of
+ * the table see either the old or the new copy. The number of resets
+ * is read before the rows are copied, so a reset while the rows are
+ * copied is caught by the next round.
+ */
+static void memview_flush(MemoryViewSession* session,
+                          bool* synced,
+                          uint64* flushed_resets) {
+  MemoryContext context = CurrentMemoryContext;
+  MemoryViewFlushRow* rows =
+      palloc_array(MemoryViewFlushRow, memview_flush_batch_size);
+  size_t cursor = 0;
+
+  for (;;) {
+    uint64 resets = pg_atomic_read_u64(&session->header->nresets);
+    bool clear = !*synced || resets != *flushed_resets;
+    int nrows = 0, nbatch;
+
+    nbatch = memview_flush_collect(
+        session, &cursor, rows, memview_flush_batch_size);
+    if (nbatch == 0 && !clear)
+      break;
+
+    memview_flush_begin();
+
+    if (clear)
+      memview_flush_execute(&memview_flush_clear, NULL);
+
+    for (;;) {
+      memview_flush_write(rows + nrows, nbatch);
+      nrows += nbatch;
+      if (!clear || nbatch < memview_flush_batch_size)
+        break;
+
+      CHECK_FOR_INTERRUPTS();
+      rows = repalloc_array(
+          rows, MemoryViewFlushRow, nrows + memview_flush_batch_size);
+      nbatch = memview_flush_collect(
+          session, &cursor, rows + nrows, memview_flush_batch_size);
+    }
+
+    memview_flush_commit(context);
+
+    *synced = true;
+    *flushed_resets = resets;
+    memview_flush_clean(session, rows, nrows, resets);
+
+    if (nbatch < memview_flush_batch_size)
+      break;
+
+    CHECK_FOR_INTERRUPTS();
+  }
+
+  pfree(rows);
+}
+
+/*
+ * Register the write-behind background worker.
+ */
+void memview_flush_register(void) {
+  BackgroundWorker worker;
+
+  memset(&worker, 0, sizeof(worker));
+  worker.bgw_flags =
+      BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+  worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+  worker.bgw_restart_time = 10;
+  snprintf(worker.bgw_library_name, MAXPGPATH, "memview");
+  snprintf(worker.bgw_function_name, BGW_MAXLEN, "memview_flush_main");
+  snprintf(worker.bgw_name, BGW_MAXLEN, "memview write-behind");
+  snprintf(worker.bgw_type, BGW_MAXLEN, "memview write-behind");
+  RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * Main function for the write-behind background worker.
+ *
+ * The memory view is written one last time when the worker is asked
+ * to shut down, so a clean shutdown does not lose any modifications.
+ */
+void memview_flush_main(Datum main_arg) {
+  MemoryViewSession* session;
+  MemoryContext context;
+  bool synced = false;
+  uint64 flushed_resets = 0;
+
+  pqsignal(SIGHUP, SignalHandlerForConfigReload);
+  pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+  BackgroundWorkerUnblockSignals();
+
+  BackgroundWorkerInitializeConnection(memview_flush_database, NULL, 0);
+
+  session = memview_session_get();
+  memview_flush_prepare();
+
+  context = AllocSetContextCreate(
+      TopMemoryContext, "memview write-behind", ALLOCSET_DEFAULT_SIZES);
+
+  MemoryContextSwitchTo(context);
+  synced = memview_flush_sync(session);
+  MemoryContextSwitchTo(TopMemoryContext);
+  MemoryContextReset(context);
+
+  for (;;) {
+    MemoryContextSwitchTo(context);
+    memview_flush(session, &synced, &flushed_resets);
+    MemoryContextSwitchTo(TopMemoryContext);
+    MemoryContextReset(context);
+
+    if (ShutdownRequestPending)
+      break;
+
+    (void)WaitLatch(MyLatch,
+                    WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                    memview_flush_interval,
+                    PG_WAIT_EXTENSION);
+    ResetLatch(MyLatch);
+
+    if (ConfigReloadPending) {
+      ConfigReloadPending = false;
+      ProcessConfigFile(PGC_SIGHUP);
+    }
+  }
+
+  proc_exit(0);
+}
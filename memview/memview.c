@@ -22,34 +22,47 @@
 #include <funcapi.h>
 #include <miscadmin.h>
 
+#include <catalog/pg_type.h>
 #include <commands/trigger.h>
 #include <executor/spi.h>
-#include <storage/dsm.h>
+#include <lib/dshash.h>
+#include <nodes/bitmapset.h>
+#include <nodes/pg_list.h>
 #include <storage/lwlock.h>
-#include <storage/shm_toc.h>
 #include <storage/shmem.h>
+#include <storage/spin.h>
+#include <utils/acl.h>
 #include <utils/builtins.h>
+#include <utils/dsa.h>
+#include <utils/guc.h>
+#include <utils/memutils.h>
+#include <utils/timestamp.h>
 
 PG_MODULE_MAGIC;
 
 #define TRACE(FMT, ...) elog(DEBUG1, "%s: " FMT, __func__, ##__VA_ARGS__)
 
-#define MEMVIEW_MAGIC 0x12345678
-
-enum {
-  MEMVIEW_KEY_CONTEXT,
-  MEMVIEW_KEY_MANIFEST,
-};
-
 PG_FUNCTION_INFO_V1(memview_row_delete);
 PG_FUNCTION_INFO_V1(memview_row_insert);
 PG_FUNCTION_INFO_V1(memview_row_update);
 PG_FUNCTION_INFO_V1(memview_view_scan);
 PG_FUNCTION_INFO_V1(memview_view_reset);
+PG_FUNCTION_INFO_V1(memview_view_compact);
 PG_FUNCTION_INFO_V1(memview_insert_row_tgfunc);
 PG_FUNCTION_INFO_V1(memview_delete_row_tgfunc);
 PG_FUNCTION_INFO_V1(memview_update_row_tgfunc);
 
+/*
+ * Maximum number of records that can be stored in the memory view.
+ */
+int memview_max_records = 100000;
+
+/*
+ * Fraction of free slots in allocated chunks before the memory view
+ * is compacted.
+ */
+static double memview_compaction_threshold = 0.5;
+
 /*
  * Helper function to get a role name using a role OID.
  *
@@ -61,96 +74,311 @@ static char* get_role_name(Oid roleoid) {
 }
 
 static void memview_row_delete_internal(int32 row_id);
-static void memview_row_update_internal(int32 row_id, Oid owner, Name descr);
-static void memview_row_insert_internal(Oid owner, Name descr);
+static void memview_row_update_internal(int32 row_id,
+                                        Oid owner,
+                                        Name descr,
+                                        const TimestampTz* expires_at);
+static void memview_row_insert_internal(Oid owner,
+                                        Name descr,
+                                        const TimestampTz* expires_at);
+
+/*
+ * Number of attempts that a reader makes to copy the memory view
+ * without a lock before falling back on taking the lock.
+ */
+#define MEMVIEW_SNAPSHOT_ATTEMPTS 8
+
+/*
+ * Kind of statistics that each kind of operation is counted as.
+ */
+static const MemoryViewStatsKind memview_op_stats_kind[] = {
+    [MEMVIEW_OP_INSERT] = MEMVIEW_STATS_INSERT,
+    [MEMVIEW_OP_UPDATE] = MEMVIEW_STATS_UPDATE,
+    [MEMVIEW_OP_DELETE] = MEMVIEW_STATS_DELETE,
+    [MEMVIEW_OP_EXPIRE] = MEMVIEW_STATS_EXPIRE,
+};
 
 /*
  * Structure with the shared memory state containing, among other
- * things, the DSM handle.
+ * things, the DSA handle and the handles for the partition table and
+ * the named view registry in the dynamic shared area.
  */
 typedef struct MemoryViewState {
-  LWLock lock;
-  dsm_handle handle;
+  int tranche_id;
+  dsa_handle handle;
+  dshash_table_handle partitions;
+  dshash_table_handle views;
 } MemoryViewState;
 
-static MemoryViewState* memview_state = NULL;
-static MemoryViewSession memview_session = {.segment = 0};
+/*
+ * Entry in the partition table, mapping a database OID to the
+ * partition header for the database.
+ */
+typedef struct MemoryViewPartitionEntry {
+  Oid dboid;
+  dsa_pointer header;
+} MemoryViewPartitionEntry;
 
 /*
- * Get a session DSM handle.
- *
- * This will set up the DSM segment if necessary.
+ * Entry in the owner index of a partition, with the first record in
+ * the list of records for the owner and the number of records in the
+ * list.
  */
-dsm_handle memview_dsm_handle(void) {
-  MemoryContext old_context;
-  Size size;
-  dsm_segment* seg;
-  shm_toc* toc;
-  shm_toc_estimator estimator;
-  MemoryViewHeader* header;
-  MemoryViewRecord* manifest;
-  Size manifest_size;
+typedef struct MemoryViewOwnerEntry {
+  Oid owner;
+  int32 first_slot;
+  uint32 nrecords;
+} MemoryViewOwnerEntry;
 
-  if (memview_session.segment != NULL) {
-    TRACE("returning existing handle %d",
-          dsm_segment_handle(memview_session.segment));
-    return dsm_segment_handle(memview_session.segment);
-  }
+/*
+ * Scan state for the memory view scan.
+ *
+ * The scan returns rows from a snapshot of the memory view, so we
+ * keep track of the next row in the snapshot to return.
+ */
+typedef struct MemoryViewScanState {
+  MemoryViewSnapshot snapshot;
+  size_t row;
+} MemoryViewScanState;
 
-  TRACE("creating DSM segment and handle");
+static MemoryViewState* memview_state = NULL;
+static MemoryViewSession memview_session = {.area = NULL};
+
+static dshash_parameters memview_partition_params = {
+    .key_size = sizeof(Oid),
+    .entry_size = sizeof(MemoryViewPartitionEntry),
+    .compare_function = dshash_memcmp,
+    .hash_function = dshash_memhash,
+#if PG_VERSION_NUM >= 170000
+    .copy_function = dshash_memcpy,
+#endif
+};
 
-  old_context = MemoryContextSwitchTo(TopMemoryContext);
+static dshash_parameters memview_owner_params = {
+    .key_size = sizeof(Oid),
+    .entry_size = sizeof(MemoryViewOwnerEntry),
+    .compare_function = dshash_memcmp,
+    .hash_function = dshash_memhash,
+#if PG_VERSION_NUM >= 170000
+    .copy_function = dshash_memcpy,
+#endif
+};
 
-  /*
-   * Estimate the size of the TOC for the DSM segment. It contains a
-   * few different fields.
-   */
-  shm_toc_initialize_estimator(&estimator);
-  manifest_size = mul_size(sizeof(MemoryViewRecord), MEMVIEW_MAX_RECORDS);
-  shm_toc_estimate_keys(&estimator, 2);
+static dshash_parameters memview_views_params = {
+    .key_size = sizeof(MemoryViewNamedKey),
+    .entry_size = sizeof(MemoryViewNamedEntry),
+    .compare_function = dshash_memcmp,
+    .hash_function = dshash_memhash,
+#if PG_VERSION_NUM >= 170000
+    .copy_function = dshash_memcpy,
+#endif
+};
 
-  /* Counter for number of records */
-  shm_toc_estimate_chunk(&estimator, sizeof(int));
+void _PG_init(void) {
+  DefineCustomIntVariable("memview.max_records",
+                          "Maximum number of records in the memory view.",
+                          "Memory for records is allocated in chunks of "
+                          "1024 records as rows are inserted.",
+                          &memview_max_records,
+                          100000,
+                          0,
+                          MEMVIEW_MAX_RECORDS,
+                          PGC_SUSET,
+                          0,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomRealVariable("memview.compaction_threshold",
+                           "Fraction of free slots that triggers compaction.",
+                           "When the fraction of free slots in the allocated "
+                           "chunks exceeds this, chunks without records are "
+                           "released.",
+                           &memview_compaction_threshold,
+                           0.5,
+                           0.0,
+                           1.0,
+                           PGC_SUSET,
+                           0,
+                           NULL,
+                           NULL,
+                           NULL);
+
+  DefineCustomBoolVariable("memview.persist",
+                           "Save the memory view on shutdown and load it "
+                           "on startup.",
+                           "The memory view is saved to a file in the data "
+                           "directory by a background worker, which requires "
+                           "the library to be in shared_preload_libraries.",
+                           &memview_persist,
+                           false,
+                           PGC_POSTMASTER,
+                           0,
+                           NULL,
+                           NULL,
+                           NULL);
+
+  DefineCustomIntVariable("memview.expire_interval",
+                          "Time between runs of the expiry background worker.",
+                          "Expired records are not visible to scans, but "
+                          "they are only removed when the background worker "
+                          "runs. Zero disables removal of expired records.",
+                          &memview_expire_interval,
+                          1000,
+                          0,
+                          INT_MAX,
+                          PGC_SIGHUP,
+                          GUC_UNIT_MS,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("memview.expire_batch_size",
+                          "Maximum number of expired records removed at a "
+                          "time.",
+                          "Expired records are removed in batches so that "
+                          "writers are not blocked for long.",
+                          &memview_expire_batch_size,
+                          1000,
+                          1,
+                          MEMVIEW_MAX_RECORDS,
+                          PGC_SIGHUP,
+                          0,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomStringVariable("memview.flush_table",
+                             "Table that the memory view is written to.",
+                             "If set, a background worker writes modified "
+                             "rows of the memory view to the table. The "
+                             "table need to have the columns row_id, owner, "
+                             "and description, with a unique constraint on "
+                             "row_id.",
+                             &memview_flush_table,
+                             "",
+                             PGC_POSTMASTER,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+  DefineCustomStringVariable("memview.flush_database",
+                             "Database of the table that the memory view is "
+                             "written to.",
+                             "Only the partition of the memory view for this "
+                             "database is written to the table.",
+                             &memview_flush_database,
+                             "postgres",
+                             PGC_POSTMASTER,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+  DefineCustomIntVariable("memview.flush_interval",
+                          "Time between writes of the memory view to the "
+                          "table.",
+                          NULL,
+                          &memview_flush_interval,
+                          5000,
+                          1,
+                          INT_MAX,
+                          PGC_SIGHUP,
+                          GUC_UNIT_MS,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("memview.flush_batch_size",
+                          "Maximum number of rows written to the table in "
+                          "one statement.",
+                          NULL,
+                          &memview_flush_batch_size,
+                          1000,
+                          1,
+                          MEMVIEW_MAX_RECORDS,
+                          PGC_SIGHUP,
+                          0,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomBoolVariable("memview.track_timing",
+                           "Collect timing statistics for the memory view.",
+                           "Enables timing of operations and lock waits in "
+                           "the statistics shown by memview_stats(). The "
+                           "number of operations and lock waits are always "
+                           "collected.",
+                           &memview_track_timing,
+                           false,
+                           PGC_SUSET,
+                           0,
+                           NULL,
+                           NULL,
+                           NULL);
+
+  MarkGUCPrefixReserved("memview");
+
+  if (process_shared_preload_libraries_in_progress) {
+    if (memview_persist)
+      memview_persist_register();
+    if (memview_flush_table[0] != '\0')
+      memview_flush_register();
+    memview_expire_register();
+  }
+}
 
-  /* Memory for the actual manifest */
-  shm_toc_estimate_chunk(&estimator, manifest_size);
-  size = shm_toc_estimate(&estimator);
+/*
+ * Get a session DSA handle.
+ *
+ * This will set up the dynamic shared area, the partition table, and
+ * the named view registry if necessary. The area is pinned so that it
+ * is not removed even if there are no attached sessions.
+ */
+dsa_handle memview_dsa_handle(void) {
+  MemoryContext old_context;
+  dsa_area* area;
+  dshash_table* partitions;
+  dshash_table* views;
 
-  /* Create the shared memory segment, and the TOC for the data in the
-     segment. */
-  seg = dsm_create(size, DSM_CREATE_NULL_IF_MAXSEGMENTS);
-  if (seg == NULL) {
-    MemoryContextSwitchTo(old_context);
-    return DSM_HANDLE_INVALID;
+  if (memview_session.area != NULL) {
+    TRACE("returning existing handle %d", dsa_get_handle(memview_session.area));
+    return dsa_get_handle(memview_session.area);
   }
-  toc = shm_toc_create(MEMVIEW_MAGIC, dsm_segment_address(seg), size);
 
-  /* Add the information about the view */
-  header = shm_toc_allocate(toc, sizeof(MemoryViewHeader));
-  header->nrecords = 0;
-  shm_toc_insert(toc, MEMVIEW_KEY_CONTEXT, header);
+  TRACE("creating dynamic shared area and handle");
+
+  old_context = MemoryContextSwitchTo(TopMemoryContext);
 
-  /* Add the manifest, which is an array of fixed-size records */
-  manifest = shm_toc_allocate(toc, manifest_size);
-  memset(manifest, 0, manifest_size);
-  shm_toc_insert(toc, MEMVIEW_KEY_MANIFEST, manifest);
+  area = dsa_create(memview_state->tranche_id);
 
-  /* Pin the segment so that it is not removed even if there are no attached
-   * sessions. */
-  dsm_pin_segment(seg);
+  /* Pin the area so that it is not removed even if there are no
+   * attached sessions. */
+  dsa_pin(area);
 
   /* Pin the mapping so that it stays mapped longer than for a single
    * query. Pinning the mapping means that it has no resource
    * owner. */
-  dsm_pin_mapping(seg);
+  dsa_pin_mapping(area);
 
-  memview_session.segment = seg;
-  memview_session.header = header;
-  memview_session.manifest = manifest;
+  /* Add the partition table. Partitions are added when a database
+   * first uses the memory view. */
+  memview_partition_params.tranche_id = memview_state->tranche_id;
+  partitions = dshash_create(area, &memview_partition_params, NULL);
+  memview_state->partitions = dshash_get_hash_table_handle(partitions);
+
+  memview_views_params.tranche_id = memview_state->tranche_id;
+  views = dshash_create(area, &memview_views_params, NULL);
+  memview_state->views = dshash_get_hash_table_handle(views);
+
+  memview_session.area = area;
+  memview_session.partitions = partitions;
+  memview_session.views = views;
 
   MemoryContextSwitchTo(old_context);
 
-  return dsm_segment_handle(seg);
+  return dsa_get_handle(area);
 }
 
 /*
@@ -165,51 +393,1638 @@ static bool memview_init_shmem(void) {
   LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
   memview_state = ShmemInitStruct("memview", sizeof(MemoryViewState), &found);
   if (!found) {
-    LWLockInitialize(&memview_state->lock, LWLockNewTrancheId());
-    memview_state->handle = memview_dsm_handle();
+    memview_state->tranche_id = LWLockNewTrancheId();
+    memview_state->handle = memview_dsa_handle();
+
+    /* Load the file while holding the lock so that nobody uses the
+     * memory view before it is loaded. */
+    if (memview_persist)
+      memview_file_load(&memview_session);
   }
   LWLockRelease(AddinShmemInitLock);
 
-  LWLockRegisterTranche(memview_state->lock.tranche, "memview");
+  LWLockRegisterTranche(memview_state->tranche_id, "memview");
 
   return found;
 }
 
-MemoryViewSession* memview_session_get(dsm_handle handle) {
+/*
+ * Get the tranche identifier for the locks of the memory view.
+ */
+int memview_tranche_id(void) {
   memview_init_shmem();
+  return memview_state->tranche_id;
+}
 
-  /* If memory view segment is not there, attach to it. We need to
-   * take the lock before checking the session otherwise somebody else
-   * could come along and try to create a segment after we have
-   * checked the value. */
-  if (memview_session.segment == NULL) {
-    shm_toc* toc;
-    dsm_segment* seg;
-    MemoryViewHeader* header;
-    MemoryViewRecord* manifest;
+/*
+ * Get the partition for a database, creating it if requested.
+ *
+ * Returns NULL if the partition does not exist and we were not asked
+ * to create it. Partitions are never removed, so the header remains
+ * valid for the lifetime of the session.
+ *
+ * The owner index of a new partition is created here, but the caller
+ * need to attach to it to use it.
+ */
+MemoryViewHeader* memview_partition_get(MemoryViewSession* session,
+                                        Oid dboid,
+                                        bool create) {
+  MemoryViewPartitionEntry* entry;
+  MemoryViewHeader* header;
+  bool found = true;
 
-    seg = dsm_attach(handle);
-    if (seg == NULL)
-      ereport(ERROR,
-              (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-               errmsg("could not map dynamic shared memory segment")));
+  if (create)
+    entry = dshash_find_or_insert(session->partitions, &dboid, &found);
+  else
+    entry = dshash_find(session->partitions, &dboid, false);
+
+  if (entry == NULL)
+    return NULL;
+
+  if (!found) {
+    dshash_table* owners;
+
+    TRACE("creating partition for database %u", dboid);
+    entry->header = dsa_allocate0(session->area, sizeof(MemoryViewHeader));
+    header = dsa_get_address(session->area, entry->header);
+    header->dboid = dboid;
+    header->free_slot = MEMVIEW_NO_SLOT;
+
+    memview_owner_params.tranche_id = memview_state->tranche_id;
+    owners = dshash_create(session->area, &memview_owner_params, NULL);
+    header->owners = dshash_get_hash_table_handle(owners);
+    dshash_detach(owners);
+
+    header->changes = dsa_allocate0(
+        session->area,
+        mul_size(sizeof(MemoryViewChange), MEMVIEW_CHANGE_LOG_SIZE));
+    pg_atomic_init_u64(&header->next_change, 1);
+    ConditionVariableInit(&header->changes_cv);
+
+    pg_atomic_init_u64(&header->writes_started, 0);
+    pg_atomic_init_u64(&header->writes_finished, 0);
+    pg_atomic_init_u32(&header->nexpiring, 0);
+    pg_atomic_init_u64(&header->nresets, 0);
+    memview_stats_init(&header->stats);
+    LWLockInitialize(&header->reclaim_lock, memview_state->tranche_id);
+    LWLockInitialize(&header->alloc_lock, memview_state->tranche_id);
+    LWLockInitialize(&header->changes_lock, memview_state->tranche_id);
+    for (int i = 0; i < MEMVIEW_LOCK_STRIPES; ++i)
+      LWLockInitialize(&header->stripes[i], memview_state->tranche_id);
+  } else {
+    header = dsa_get_address(session->area, entry->header);
+  }
+
+  dshash_release_lock(session->partitions, entry);
+
+  return header;
+}
 
-    toc = shm_toc_attach(MEMVIEW_MAGIC, dsm_segment_address(seg));
-    header = shm_toc_lookup(toc, MEMVIEW_KEY_CONTEXT, false);
-    manifest = shm_toc_lookup(toc, MEMVIEW_KEY_MANIFEST, false);
+/*
+ * Set up a session for a partition other than the one of the current
+ * database, attaching to its owner index.
+ *
+ * The caller need to detach from the owner index when done.
+ */
+static void memview_partition_attach(MemoryViewSession* session,
+                                     MemoryViewHeader* header,
+                                     MemoryViewSession* partition) {
+  *partition = *session;
+  memview_owner_params.tranche_id = memview_state->tranche_id;
+  partition->header = header;
+  partition->owners = dshash_attach(
+      session->area, &memview_owner_params, header->owners, NULL);
+}
+
+/*
+ * Get the memory view session.
+ *
+ * This will attach to the dynamic shared area and the partition table
+ * if necessary, and look up the partition for the current database,
+ * which is created if it does not exist, and attach to its owner
+ * index.
+ */
+MemoryViewSession* memview_session_get(void) {
+  memview_init_shmem();
+
+  if (memview_session.area == NULL) {
+    MemoryContext old_context = MemoryContextSwitchTo(TopMemoryContext);
+    dsa_area* area = dsa_attach(memview_state->handle);
+
+    dsa_pin_mapping(area);
+
+    memview_partition_params.tranche_id = memview_state->tranche_id;
+    memview_session.area = area;
+    memview_session.partitions = dshash_attach(
+        area, &memview_partition_params, memview_state->partitions, NULL);
+
+    memview_views_params.tranche_id = memview_state->tranche_id;
+    memview_session.views = dshash_attach(
+        area, &memview_views_params, memview_state->views, NULL);
+
+    MemoryContextSwitchTo(old_context);
+  }
 
-    memview_session.segment = seg;
+  /* The database of a backend does not change, so we only need to
+   * look up the partition once. */
+  if (memview_session.header == NULL && OidIsValid(MyDatabaseId)) {
+    MemoryContext old_context = MemoryContextSwitchTo(TopMemoryContext);
+    MemoryViewHeader* header =
+        memview_partition_get(&memview_session, MyDatabaseId, true);
+
+    memview_owner_params.tranche_id = memview_state->tranche_id;
+    memview_session.owners = dshash_attach(
+        memview_session.area, &memview_owner_params, header->owners, NULL);
     memview_session.header = header;
-    memview_session.manifest = manifest;
 
-    dsm_pin_mapping(seg);
+    MemoryContextSwitchTo(old_context);
   }
 
   return &memview_session;
 }
 
+/*
+ * Get a pointer to a record in the memory view.
+ *
+ * The caller need to hold the stripe of the slot or the allocation
+ * lock and make sure that the slot is inside an allocated chunk.
+ */
+MemoryViewRecord* memview_record_get(MemoryViewSession* session, size_t row) {
+  MemoryViewRecord* chunk;
+  dsa_pointer chunk_ptr;
+
+  Assert(row / MEMVIEW_CHUNK_RECORDS < session->header->nchunks);
+
+  chunk_ptr = session->header->chunks[row / MEMVIEW_CHUNK_RECORDS];
+  Assert(DsaPointerIsValid(chunk_ptr));
+
+  chunk = dsa_get_address(session->area, chunk_ptr);
+  return &chunk[row % MEMVIEW_CHUNK_RECORDS];
+}
+
+/*
+ * Look up a used record in the memory view.
+ *
+ * Returns NULL if there is no row with the row identifier. The caller
+ * need to hold the stripe of the row and the reclaim lock.
+ */
+MemoryViewRecord* memview_record_lookup(MemoryViewSession* session,
+                                        int32 row_id) {
+  MemoryViewHeader* header = session->header;
+  MemoryViewRecord* record;
+
+  if (row_id < 0 || (size_t)row_id >= header->nslots)
+    return NULL;
+
+  if (!DsaPointerIsValid(header->chunks[row_id / MEMVIEW_CHUNK_RECORDS]))
+    return NULL;
+
+  record = memview_record_get(session, row_id);
+  return record->used ? record : NULL;
+}
+
+/*
+ * Get the stripe lock protecting a slot.
+ *
+ * Invalid row identifiers from the user are mapped to some stripe as
+ * well, so that the caller can take the lock before checking the row.
+ */
+static LWLock* memview_stripe_lock(MemoryViewHeader* header, int32 slot) {
+  return &header->stripes[(uint32)slot % MEMVIEW_LOCK_STRIPES];
+}
+
+/*
+ * Acquire a lock and count the wait for it in the statistics.
+ *
+ * LWLockAcquire() tells us if it had to wait, so waits are always
+ * counted, but the time is only measured if timing is enabled. The
+ * time the lock was acquired is stored in "acquired" so that
+ * memview_lock_release() can count the time the lock was held.
+ */
+static void memview_lock_acquire(MemoryViewStatsCounts* counts,
+                                 LWLock* lock,
+                                 LWLockMode mode,
+                                 instr_time* acquired) {
+  instr_time start;
+
+  memview_stats_start(&start);
+  if (!LWLockAcquire(lock, mode))
+    ++counts->lock_waits;
+  if (!INSTR_TIME_IS_ZERO(start)) {
+    INSTR_TIME_SET_CURRENT(*acquired);
+    INSTR_TIME_ACCUM_DIFF(counts->lock_wait_time, *acquired, start);
+  } else {
+    INSTR_TIME_SET_ZERO(*acquired);
+  }
+}
+
+/*
+ * Release a lock acquired using memview_lock_acquire() and count the
+ * time it was held.
+ */
+static void memview_lock_release(MemoryViewStatsCounts* counts,
+                                 LWLock* lock,
+                                 const instr_time* acquired) {
+  if (!INSTR_TIME_IS_ZERO(*acquired)) {
+    instr_time released;
+
+    INSTR_TIME_SET_CURRENT(released);
+    INSTR_TIME_ACCUM_DIFF(counts->lock_hold_time, released, *acquired);
+  }
+  LWLockRelease(lock);
+}
+
+/*
+ * Take the allocation lock and all stripes of the partition.
+ *
+ * Every writer holds the allocation lock or a stripe in exclusive
+ * mode while modifying the partition, so this excludes all writers.
+ */
+static void memview_lock_all(MemoryViewHeader* header, LWLockMode mode) {
+  LWLockAcquire(&header->alloc_lock, mode);
+  for (int i = 0; i < MEMVIEW_LOCK_STRIPES; ++i)
+    LWLockAcquire(&header->stripes[i], mode);
+}
+
+/*
+ * Release the locks taken by memview_lock_all().
+ */
+static void memview_unlock_all(MemoryViewHeader* header) {
+  for (int i = MEMVIEW_LOCK_STRIPES; i > 0; --i)
+    LWLockRelease(&header->stripes[i - 1]);
+  LWLockRelease(&header->alloc_lock);
+}
+
+/*
+ * Mark the start of a modification of the memory view.
+ *
+ * The caller need to hold the allocation lock or a stripe in
+ * exclusive mode, and keep holding one of them until the end of the
+ * modification.
+ */
+static void memview_write_begin(MemoryViewHeader* header) {
+  pg_atomic_fetch_add_u64(&header->writes_started, 1);
+}
+
+/*
+ * Mark the end of a modification of the memory view.
+ *
+ * The caller need to hold the allocation lock or a stripe in
+ * exclusive mode.
+ */
+static void memview_write_end(MemoryViewHeader* header) {
+  pg_atomic_fetch_add_u64(&header->writes_finished, 1);
+}
+
+/*
+ * Add a record to the front of the list for its owner in the owner
+ * index.
+ *
+ * The caller need to hold the stripe of the record in exclusive mode.
+ * The list is protected by the lock on the owner entry.
+ */
+static void memview_owner_link(MemoryViewSession* session,
+                               int32 slot,
+                               MemoryViewRecord* record) {
+  MemoryViewOwnerEntry* entry;
+  bool found;
+
+  entry = dshash_find_or_insert(session->owners, &record->owner, &found);
+  if (!found) {
+    entry->first_slot = MEMVIEW_NO_SLOT;
+    entry->nrecords = 0;
+  }
+
+  record->prev_owner = MEMVIEW_NO_SLOT;
+  record->next_owner = entry->first_slot;
+  if (entry->first_slot != MEMVIEW_NO_SLOT)
+    memview_record_get(session, entry->first_slot)->prev_owner = slot;
+  entry->first_slot = slot;
+  ++entry->nrecords;
+
+  dshash_release_lock(session->owners, entry);
+}
+
+/*
+ * Remove a record from the list for its owner in the owner index. The
+ * entry for the owner is removed when the list becomes empty.
+ *
+ * The caller need to hold the stripe of the record in exclusive mode.
+ */
+static void memview_owner_unlink(MemoryViewSession* session,
+                                 MemoryViewRecord* record) {
+  MemoryViewOwnerEntry* entry;
+
+  entry = dshash_find(session->owners, &record->owner, true);
+  Assert(entry != NULL && entry->nrecords > 0);
+
+  if (record->prev_owner == MEMVIEW_NO_SLOT)
+    entry->first_slot = record->next_owner;
+  else
+    memview_record_get(session, record->prev_owner)->next_owner =
+        record->next_owner;
+
+  if (record->next_owner != MEMVIEW_NO_SLOT)
+    memview_record_get(session, record->next_owner)->prev_owner =
+        record->prev_owner;
+
+  record->prev_owner = MEMVIEW_NO_SLOT;
+  record->next_owner = MEMVIEW_NO_SLOT;
+
+  if (--entry->nrecords == 0)
+    dshash_delete_entry(session->owners, entry);
+  else
+    dshash_release_lock(session->owners, entry);
+}
+
+/*
+ * Remove all owners from the owner index.
+ *
+ * The caller need to hold the reclaim lock in exclusive mode.
+ */
+static void memview_owner_reset(MemoryViewSession* session) {
+  dshash_seq_status status;
+
+  dshash_seq_init(&status, session->owners, true);
+  while (dshash_seq_next(&status) != NULL)
+    dshash_delete_current(&status);
+  dshash_seq_term(&status);
+}
+
+/*
+ * Get the number of records for an owner using the owner index.
+ *
+ * This does not take the lock, so the number might be out of date by
+ * the time it is used, but it is good enough for estimates.
+ */
+size_t memview_owner_count(MemoryViewSession* session, Oid owner) {
+  MemoryViewOwnerEntry* entry = dshash_find(session->owners, &owner, false);
+  size_t nrecords = 0;
+
+  if (entry != NULL) {
+    nrecords = entry->nrecords;
+    dshash_release_lock(session->owners, entry);
+  }
+
+  return nrecords;
+}
+
+/*
+ * Get the owners in the owner index that the current user is a member
+ * of, in the same sense as pg_has_role() with 'MEMBER'.
+ *
+ * The owners are collected first and checked after the owner index is
+ * released, since checking membership might need to read the catalog.
+ * Role memberships of the current user are cached by
+ * is_member_of_role() and invalidated when they change, so this is one
+ * cache lookup for each owner with rows in the memory view rather than
+ * one for each row.
+ */
+static Oid* memview_member_owners(MemoryViewSession* session, int* nowners) {
+  Oid roleid = GetUserId();
+  dshash_seq_status status;
+  MemoryViewOwnerEntry* entry;
+  List* owners = NIL;
+  Oid* members;
+  ListCell* lc;
+
+  dshash_seq_init(&status, session->owners, false);
+  while ((entry = dshash_seq_next(&status)) != NULL)
+    owners = lappend_oid(owners, entry->owner);
+  dshash_seq_term(&status);
+
+  members = palloc_array(Oid, list_length(owners) + 1);
+  *nowners = 0;
+  foreach (lc, owners)
+    if (is_member_of_role(roleid, lfirst_oid(lc)))
+      members[(*nowners)++] = lfirst_oid(lc);
+
+  list_free(owners);
+  return members;
+}
+
+/*
+ * Check if a record matches the owners of the filter.
+ */
+static bool memview_filter_owner(const MemoryViewFilter* filter,
+                                 const MemoryViewRecord* record) {
+  if (filter == NULL || filter->owners == NULL)
+    return true;
+
+  for (int i = 0; i < filter->nowners; ++i)
+    if (filter->owners[i] == record->owner)
+      return true;
+  return false;
+}
+
+/*
+ * Add a copy of a record to the snapshot if it is used, has not
+ * expired, and matches the filter.
+ */
+static void memview_copy_record(const MemoryViewFilter* filter,
+                                MemoryViewSnapshot* snapshot,
+                                MemoryViewRecord* record,
+                                size_t slot) {
+  if (record->used && record->expires_at > snapshot->now &&
+      memview_filter_owner(filter, record)) {
+    snapshot->row_ids[snapshot->nrows] = slot;
+    snapshot->records[snapshot->nrows] = *record;
+    ++snapshot->nrows;
+  }
+}
+
+/*
+ * Get a record for reading without holding the lock.
+ *
+ * Since a writer can modify the memory view while we are reading, the
+ * slot is checked against the bounds read at the start of the copy
+ * and NULL is returned if it is not inside an allocated chunk.
+ */
+static MemoryViewRecord* memview_record_peek(MemoryViewSession* session,
+                                             size_t nslots,
+                                             size_t nchunks,
+                                             int32 slot) {
+  size_t chunk = slot / MEMVIEW_CHUNK_RECORDS;
+  dsa_pointer chunk_ptr;
+  MemoryViewRecord* records;
+
+  if (slot < 0 || (size_t)slot >= nslots || chunk >= nchunks)
+    return NULL;
+
+  chunk_ptr = session->header->chunks[chunk];
+  if (!DsaPointerIsValid(chunk_ptr))
+    return NULL;
+
+  records = dsa_get_address(session->area, chunk_ptr);
+  return &records[slot % MEMVIEW_CHUNK_RECORDS];
+}
+
+/*
+ * Copy the records of the owners in the filter by following the lists
+ * in the owner index.
+ *
+ * If a writer modified the lists while we were following them, the
+ * copy will be discarded by the caller, but we still need to make sure
+ * that we terminate, so we never follow more links than there are
+ * records to copy.
+ */
+static void memview_copy_owner_records(MemoryViewSession* session,
+                                       const MemoryViewFilter* filter,
+                                       MemoryViewSnapshot* snapshot,
+                                       size_t nslots,
+                                       size_t nchunks) {
+  int32* first_slots = palloc_array(int32, filter->nowners + 1);
+  size_t maxrows = 0;
+
+  for (int i = 0; i < filter->nowners; ++i) {
+    MemoryViewOwnerEntry* entry =
+        dshash_find(session->owners, &filter->owners[i], false);
+
+    first_slots[i] = MEMVIEW_NO_SLOT;
+    if (entry != NULL) {
+      first_slots[i] = entry->first_slot;
+      maxrows += entry->nrecords;
+      dshash_release_lock(session->owners, entry);
+    }
+  }
+
+  snapshot->records = palloc(mul_size(sizeof(MemoryViewRecord), maxrows + 1));
+  snapshot->row_ids = palloc(mul_size(sizeof(int32), maxrows + 1));
+
+  for (int i = 0; i < filter->nowners; ++i) {
+    int32 slot = first_slots[i];
+    size_t steps = 0;
+
+    while (slot != MEMVIEW_NO_SLOT && steps++ < maxrows) {
+      MemoryViewRecord* record =
+          memview_record_peek(session, nslots, nchunks, slot);
+
+      if (record == NULL || snapshot->nrows == maxrows)
+        break;
+      memview_copy_record(filter, snapshot, record, slot);
+      slot = record->next_owner;
+    }
+  }
+
+  pfree(first_slots);
+}
+
+/*
+ * Copy the used records of the memory view that match the filter into
+ * the snapshot.
+ *
+ * If the filter has a list of row identifiers, only those slots are
+ * read. Otherwise, if the filter has a list of owners, the records are
+ * found using the owner index, and if neither is given, all slots are
+ * read.
+ *
+ * This reads the shared memory without holding the lock, so the copy
+ * might be inconsistent and need to be validated by the caller. The
+ * caller need to hold the reclaim lock, so all chunks that we read
+ * remain allocated.
+ */
+static void memview_copy_records(MemoryViewSession* session,
+                                 const MemoryViewFilter* filter,
+                                 MemoryViewSnapshot* snapshot) {
+  MemoryViewHeader* header = session->header;
+  size_t nslots = header->nslots;
+  size_t nchunks = header->nchunks;
+  size_t maxrows;
+
+  pg_read_barrier();
+
+  if (snapshot->records) {
+    pfree(snapshot->records);
+    pfree(snapshot->row_ids);
+  }
+
+  snapshot->nrows = 0;
+
+  if (filter && filter->owners && !filter->row_ids) {
+    memview_copy_owner_records(session, filter, snapshot, nslots, nchunks);
+    return;
+  }
+
+  if (filter && filter->row_ids)
+    maxrows = filter->nrow_ids;
+  else
+    maxrows = nslots;
+
+  snapshot->records = palloc(mul_size(sizeof(MemoryViewRecord), maxrows + 1));
+  snapshot->row_ids = palloc(mul_size(sizeof(int32), maxrows + 1));
+
+  if (filter && filter->row_ids) {
+    for (int i = 0; i < filter->nrow_ids; ++i) {
+      int32 slot = filter->row_ids[i];
+      MemoryViewRecord* record =
+          memview_record_peek(session, nslots, nchunks, slot);
+
+      if (record != NULL)
+        memview_copy_record(filter, snapshot, record, slot);
+    }
+    return;
+  }
+
+  for (size_t chunk = 0; chunk < nchunks; ++chunk) {
+    size_t first = chunk * MEMVIEW_CHUNK_RECORDS;
+    size_t last = Min(first + MEMVIEW_CHUNK_RECORDS, nslots);
+    dsa_pointer chunk_ptr = header->chunks[chunk];
+    MemoryViewRecord* records;
+
+    if (!DsaPointerIsValid(chunk_ptr))
+      continue;
+
+    records = dsa_get_address(session->area, chunk_ptr);
+    for (size_t slot = first; slot < last; ++slot)
+      memview_copy_record(filter, snapshot, &records[slot - first], slot);
+  }
+}
+
+/*
+ * Take a snapshot of the memory view, optionally only containing the
+ * records matching a filter.
+ *
+ * We first try to copy the records without taking any locks and check
+ * that there were no writers active while we were copying. If that
+ * fails a few times, we take the allocation lock and all stripes in
+ * shared mode and copy the records. In either case, we hold the
+ * reclaim lock in shared mode, which does not block writers, only
+ * operations that release chunks.
+ *
+ * In the statistics, falling back on the locked copy counts as one
+ * lock wait, and the time to take all the locks as the wait time.
+ */
+void memview_snapshot(MemoryViewSession* session,
+                      const MemoryViewFilter* filter,
+                      MemoryViewSnapshot* snapshot) {
+  MemoryViewHeader* header = session->header;
+  MemoryViewStatsCounts counts;
+  instr_time start, acquired, locked;
+
+  memset(&counts, 0, sizeof(counts));
+  memview_stats_start(&start);
+
+  memset(snapshot, 0, sizeof(*snapshot));
+  snapshot->now = GetCurrentTimestamp();
+
+  memview_lock_acquire(&counts, &header->reclaim_lock, LW_SHARED, &acquired);
+
+  for (int attempt = 0; attempt < MEMVIEW_SNAPSHOT_ATTEMPTS; ++attempt) {
+    uint64 finished, started;
+
+    /* Read finished before started, so that if they are equal, there
+     * were no writers active when we read started. */
+    finished = pg_atomic_read_u64(&header->writes_finished);
+    pg_read_barrier();
+    started = pg_atomic_read_u64(&header->writes_started);
+
+    if (started != finished) {
+      pg_spin_delay();
+      continue;
+    }
+
+    memview_copy_records(session, filter, snapshot);
+
+    pg_read_barrier();
+    if (pg_atomic_read_u64(&header->writes_started) == started)
+      goto done;
+  }
+
+  TRACE("falling back on locked copy");
+
+  memview_stats_start(&locked);
+  memview_lock_all(header, LW_SHARED);
+  ++counts.lock_waits;
+  if (!INSTR_TIME_IS_ZERO(locked)) {
+    instr_time now;
+
+    INSTR_TIME_SET_CURRENT(now);
+    INSTR_TIME_ACCUM_DIFF(counts.lock_wait_time, now, locked);
+  }
+
+  memview_copy_records(session, filter, snapshot);
+  memview_unlock_all(header);
+
+done:
+  memview_lock_release(&counts, &header->reclaim_lock, &acquired);
+  counts.rows = snapshot->nrows;
+  memview_stats_count(&counts, &start);
+  memview_stats_add(&header->stats, MEMVIEW_STATS_SCAN, &counts);
+}
+
+/*
+ * Allocate a chunk and add all slots in the chunk that are below the
+ * high-water mark to the free list.
+ *
+ * Slots are pushed in reverse order so that they are popped in slot
+ * order.
+ */
+static void memview_allocate_chunk(MemoryViewSession* session, size_t chunk) {
+  MemoryViewHeader* header = session->header;
+  Size chunk_size = mul_size(sizeof(MemoryViewRecord), MEMVIEW_CHUNK_RECORDS);
+  size_t first = chunk * MEMVIEW_CHUNK_RECORDS;
+  size_t last = Min(first + MEMVIEW_CHUNK_RECORDS, header->nslots);
+  dsa_pointer chunk_ptr;
+
+  TRACE("allocating chunk %zu", chunk);
+
+  Assert(chunk < MEMVIEW_MAX_CHUNKS);
+  Assert(!DsaPointerIsValid(header->chunks[chunk]));
+
+  /* Slots are allocated outside modifications, so make sure that
+   * readers see a zeroed chunk before they see the chunk. */
+  chunk_ptr = dsa_allocate0(session->area, chunk_size);
+  pg_write_barrier();
+  header->chunks[chunk] = chunk_ptr;
+  if (chunk >= header->nchunks)
+    header->nchunks = chunk + 1;
+
+  for (size_t slot = last; slot > first; --slot) {
+    MemoryViewRecord* record = memview_record_get(session, slot - 1);
+    record->next_free = header->free_slot;
+    header->free_slot = slot - 1;
+  }
+}
+
+/*
+ * Allocate a slot for a new record in the memory view.
+ *
+ * Slots are taken from the free list if there are any. If the free
+ * list is empty and some chunk was released by a compaction, the
+ * chunk is allocated again and the slots added to the free list,
+ * otherwise a new slot is taken from the end, allocating a new chunk
+ * if necessary. All of these are constant-time operations.
+ *
+ * The slot is not marked as used, since the record is protected by
+ * its stripe, which the caller need to take before using the record.
+ *
+ * The caller need to hold the allocation lock in exclusive mode.
+ */
+static int32 memview_allocate_slot(MemoryViewSession* session) {
+  MemoryViewHeader* header = session->header;
+  MemoryViewRecord* record;
+  int32 slot;
+
+  if (header->nrecords >= (size_t)memview_max_records)
+    ereport(ERROR,
+            (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+             errmsg("memory view is full"),
+             errdetail("The memory view contains %zu records.",
+                       header->nrecords),
+             errhint("You might need to increase \"memview.max_records\".")));
+
+  if (header->free_slot == MEMVIEW_NO_SLOT && header->nreleased > 0) {
+    size_t chunk = 0;
+    while (DsaPointerIsValid(header->chunks[chunk]))
+      ++chunk;
+    memview_allocate_chunk(session, chunk);
+    --header->nreleased;
+  }
+
+  if (header->free_slot != MEMVIEW_NO_SLOT) {
+    slot = header->free_slot;
+    record = memview_record_get(session, slot);
+    header->free_slot = record->next_free;
+  } else {
+    if (header->nslots == header->nchunks * MEMVIEW_CHUNK_RECORDS)
+      memview_allocate_chunk(session, header->nchunks);
+    slot = header->nslots++;
+    record = memview_record_get(session, slot);
+  }
+
+  Assert(!record->used);
+  record->next_free = MEMVIEW_NO_SLOT;
+  ++header->nrecords;
+  return slot;
+}
+
+/*
+ * Release a slot and add it to the free list.
+ *
+ * The record is left as a tombstone in the slot, so the row
+ * identifiers of other records are not affected. The caller need to
+ * have marked the record as unused while holding its stripe, so
+ * nobody else will modify the record.
+ *
+ * The caller need to hold the allocation lock in exclusive mode.
+ */
+static void memview_release_slot(MemoryViewSession* session, int32 slot) {
+  MemoryViewHeader* header = session->header;
+  MemoryViewRecord* record = memview_record_get(session, slot);
+
+  Assert(!record->used);
+  record->next_free = header->free_slot;
+  header->free_slot = slot;
+  --header->nrecords;
+  ++header->ndeleted;
+}
+
+/*
+ * Compact the memory view.
+ *
+ * Chunks that do not contain any used records are released, the
+ * high-water mark is moved down to the last used slot, and the free
+ * list is rebuilt in slot order so that new rows are packed into the
+ * low chunks, which allows the high chunks to be released by later
+ * compactions. Records are never moved, so row identifiers are not
+ * affected.
+ *
+ * The caller need to hold the reclaim lock and the allocation lock in
+ * exclusive mode.
+ */
+static void memview_compact(MemoryViewSession* session) {
+  MemoryViewHeader* header = session->header;
+  size_t nslots = 0;
+
+  TRACE("compacting %zu records in %zu slots",
+        header->nrecords,
+        header->nslots);
+
+  header->nreleased = 0;
+  for (size_t chunk = 0; chunk < header->nchunks; ++chunk) {
+    size_t first = chunk * MEMVIEW_CHUNK_RECORDS;
+    size_t last = Min(first + MEMVIEW_CHUNK_RECORDS, header->nslots);
+    bool empty = true;
+
+    if (!DsaPointerIsValid(header->chunks[chunk])) {
+      ++header->nreleased;
+      continue;
+    }
+
+    /* Dirty records that are not used are deletes that have not been
+     * written yet, so they need to be kept as well. */
+    for (size_t slot = first; slot < last; ++slot) {
+      MemoryViewRecord* record = memview_record_get(session, slot);
+      if (record->used || record->dirty) {
+        nslots = slot + 1;
+        empty = false;
+      }
+    }
+
+    if (empty) {
+      dsa_free(session->area, header->chunks[chunk]);
+      header->chunks[chunk] = InvalidDsaPointer;
+      ++header->nreleased;
+    }
+  }
+
+  /* Released chunks at the end are not holes, so drop them from the
+   * directory. */
+  while (header->nchunks > 0 &&
+         !DsaPointerIsValid(header->chunks[header->nchunks - 1])) {
+    --header->nchunks;
+    --header->nreleased;
+  }
+
+  header->nslots = nslots;
+  header->free_slot = MEMVIEW_NO_SLOT;
+  for (size_t slot = nslots; slot > 0; --slot) {
+    MemoryViewRecord* record;
+
+    if (!DsaPointerIsValid(header->chunks[(slot - 1) / MEMVIEW_CHUNK_RECORDS]))
+      continue;
+
+    record = memview_record_get(session, slot - 1);
+    if (!record->used) {
+      record->next_free = header->free_slot;
+      header->free_slot = slot - 1;
+    }
+  }
+
+  header->ndeleted = 0;
+}
+
+/*
+ * Check if the memory view is sufficiently fragmented to compact.
+ *
+ * To keep the amortized cost of deletes constant, we only compact
+ * after at least a chunk worth of deletes since the last compaction.
+ *
+ * The caller need to hold the allocation lock.
+ */
+static bool memview_needs_compaction(MemoryViewSession* session) {
+  MemoryViewHeader* header = session->header;
+  size_t nallocated = header->nchunks - header->nreleased;
+  double free_fraction;
+
+  if (header->ndeleted < MEMVIEW_CHUNK_RECORDS || nallocated == 0)
+    return false;
+
+  free_fraction =
+      1.0 - (double)header->nrecords / (nallocated * MEMVIEW_CHUNK_RECORDS);
+  return free_fraction > memview_compaction_threshold;
+}
+
+/*
+ * Compact the memory view.
+ *
+ * Compaction releases chunks, so we need to take the reclaim lock in
+ * exclusive mode, which also excludes all writers. Unless forced, we
+ * check again after taking the locks since somebody else could have
+ * compacted the view.
+ */
+static void memview_compact_view(MemoryViewSession* session, bool force) {
+  MemoryViewHeader* header = session->header;
+
+  LWLockAcquire(&header->reclaim_lock, LW_EXCLUSIVE);
+  LWLockAcquire(&header->alloc_lock, LW_EXCLUSIVE);
+  if (force || memview_needs_compaction(session)) {
+    memview_write_begin(header);
+    memview_compact(session);
+    memview_write_end(header);
+  }
+  LWLockRelease(&header->alloc_lock);
+  LWLockRelease(&header->reclaim_lock);
+}
+
+/*
+ * Release all chunks of the memory view.
+ *
+ * The caller need to hold the reclaim lock and the allocation lock in
+ * exclusive mode.
+ */
+static void memview_release_chunks(MemoryViewSession* session) {
+  MemoryViewHeader* header = session->header;
+
+  while (header->nchunks > 0) {
+    --header->nchunks;
+    if (DsaPointerIsValid(header->chunks[header->nchunks]))
+      dsa_free(session->area, header->chunks[header->nchunks]);
+    header->chunks[header->nchunks] = InvalidDsaPointer;
+  }
+  header->nrecords = 0;
+  header->nslots = 0;
+  header->ndeleted = 0;
+  header->nreleased = 0;
+  header->free_slot = MEMVIEW_NO_SLOT;
+  pg_atomic_write_u32(&header->nexpiring, 0);
+
+  memview_owner_reset(session);
+}
+
+/*
+ * Record of a partition in the memory view file.
+ */
+typedef struct MemoryViewFileRecord {
+  int32 slot;
+  Oid owner;
+  NameData description;
+  TimestampTz expires_at;
+} MemoryViewFileRecord;
+
+/*
+ * Write the used records of all partitions to a buffer.
+ *
+ * For each partition, the database OID and the number of records is
+ * written, followed by the records with their slot number. Each
+ * partition is locked in shared mode while it is written, so it is
+ * consistent, but different partitions might be written at different
+ * points in time.
+ */
+void memview_save_records(MemoryViewSession* session, StringInfo buf) {
+  dshash_seq_status status;
+  MemoryViewPartitionEntry* entry;
+  List* headers = NIL;
+  uint32 npartitions;
+  ListCell* lc;
+
+  /* Collect the headers first so that we do not hold the lock on the
+   * partition table while waiting for the partition locks. */
+  dshash_seq_init(&status, session->partitions, false);
+  while ((entry = dshash_seq_next(&status)) != NULL)
+    headers = lappend(headers, dsa_get_address(session->area, entry->header));
+  dshash_seq_term(&status);
+
+  npartitions = list_length(headers);
+  appendBinaryStringInfo(buf, &npartitions, sizeof(npartitions));
+
+  foreach (lc, headers) {
+    MemoryViewHeader* header = lfirst(lc);
+    uint32 nrecords;
+
+    memview_lock_all(header, LW_SHARED);
+    nrecords = header->nrecords;
+    appendBinaryStringInfo(buf, &header->dboid, sizeof(header->dboid));
+    appendBinaryStringInfo(buf, &nrecords, sizeof(nrecords));
+    for (size_t slot = 0; slot < header->nslots; ++slot) {
+      dsa_pointer chunk_ptr = header->chunks[slot / MEMVIEW_CHUNK_RECORDS];
+      MemoryViewRecord* record;
+      MemoryViewFileRecord file_record;
+
+      if (!DsaPointerIsValid(chunk_ptr)) {
+        slot += MEMVIEW_CHUNK_RECORDS - 1 - slot % MEMVIEW_CHUNK_RECORDS;
+        continue;
+      }
+
+      record = dsa_get_address(session->area, chunk_ptr);
+      record += slot % MEMVIEW_CHUNK_RECORDS;
+      if (!record->used)
+        continue;
+
+      file_record.slot = slot;
+      file_record.owner = record->owner;
+      file_record.description = record->description;
+      file_record.expires_at = record->expires_at;
+      appendBinaryStringInfo(buf, &file_record, sizeof(file_record));
+    }
+    memview_unlock_all(header);
+  }
+}
+
+/*
+ * Check the records of all partitions in a buffer without loading
+ * them.
+ *
+ * This reads the records the same way as memview_load_records(), so
+ * that a file that cannot be loaded is found before anything is put
+ * into shared memory. Returns false if the records are not valid.
+ */
+bool memview_check_records(StringInfo buf) {
+  List* dboids = NIL;
+  uint32 npartitions;
+  bool valid = true;
+
+  if (!memview_file_try_read(buf, &npartitions, sizeof(npartitions)))
+    return false;
+
+  for (uint32 i = 0; i < npartitions && valid; ++i) {
+    Bitmapset* slots = NULL;
+    Oid dboid;
+    uint32 nrecords;
+
+    if (!memview_file_try_read(buf, &dboid, sizeof(dboid)) ||
+        !memview_file_try_read(buf, &nrecords, sizeof(nrecords)) ||
+        list_member_oid(dboids, dboid)) {
+      valid = false;
+      break;
+    }
+    dboids = lappend_oid(dboids, dboid);
+
+    for (uint32 j = 0; j < nrecords && valid; ++j) {
+      MemoryViewFileRecord file_record;
+
+      valid =
+          memview_file_try_read(buf, &file_record, sizeof(file_record)) &&
+          file_record.slot >= 0 && file_record.slot < MEMVIEW_MAX_RECORDS &&
+          !bms_is_member(file_record.slot, slots);
+      if (valid)
+        slots = bms_add_member(slots, file_record.slot);
+    }
+    bms_free(slots);
+  }
+
+  list_free(dboids);
+  return valid;
+}
+
+/*
+ * Put a record back into a given slot of a partition.
+ *
+ * The chunk of the slot is allocated if necessary. The free list is
+ * not updated, so the caller has to compact the partition when all
+ * records have been restored. The caller need to hold the reclaim
+ * lock and all stripes of the partition in exclusive mode.
+ *
+ * Returns false if the slot is already used.
+ */
+static bool memview_record_restore(MemoryViewSession* partition,
+                                   int32 slot,
+                                   Oid owner,
+                                   const NameData* description,
+                                   TimestampTz expires_at) {
+  MemoryViewHeader* header = partition->header;
+  Size chunk_size = mul_size(sizeof(MemoryViewRecord), MEMVIEW_CHUNK_RECORDS);
+  size_t chunk = slot / MEMVIEW_CHUNK_RECORDS;
+  MemoryViewRecord* record;
+
+  Assert(slot >= 0 && slot < MEMVIEW_MAX_RECORDS);
+
+  if (!DsaPointerIsValid(header->chunks[chunk]))
+    header->chunks[chunk] = dsa_allocate0(partition->area, chunk_size);
+  header->nchunks = Max(header->nchunks, chunk + 1);
+  header->nslots = Max(header->nslots, (size_t)slot + 1);
+
+  record = memview_record_get(partition, slot);
+  if (record->used)
+    return false;
+  record->used = true;
+  record->next_free = MEMVIEW_NO_SLOT;
+  record->dboid = header->dboid;
+  record->owner = owner;
+  record->description = *description;
+  record->expires_at = expires_at;
+  if (record->expires_at != MEMVIEW_NO_EXPIRY)
+    pg_atomic_fetch_add_u32(&header->nexpiring, 1);
+  memview_owner_link(partition, slot, record);
+  ++header->nrecords;
+  return true;
+}
+
+/*
+ * Load the records of all partitions from a buffer.
+ *
+ * The records are put back into the same slots, so row identifiers
+ * are the same as before the restart, and the free list and owner
+ * index are rebuilt from the loaded records.
+ */
+void memview_load_records(MemoryViewSession* session, StringInfo buf) {
+  uint32 npartitions;
+
+  memview_file_read(buf, &npartitions, sizeof(npartitions));
+  for (uint32 i = 0; i < npartitions; ++i) {
+    MemoryViewSession partition;
+    MemoryViewHeader* header;
+    Oid dboid;
+    uint32 nrecords;
+
+    memview_file_read(buf, &dboid, sizeof(dboid));
+    memview_file_read(buf, &nrecords, sizeof(nrecords));
+
+    header = memview_partition_get(session, dboid, true);
+    memview_partition_attach(session, header, &partition);
+
+    LWLockAcquire(&header->reclaim_lock, LW_EXCLUSIVE);
+    memview_lock_all(header, LW_EXCLUSIVE);
+    memview_write_begin(header);
+    for (uint32 j = 0; j < nrecords; ++j) {
+      MemoryViewFileRecord file_record;
+
+      memview_file_read(buf, &file_record, sizeof(file_record));
+      if (file_record.slot < 0 || file_record.slot >= MEMVIEW_MAX_RECORDS)
+        ereport(ERROR,
+                (errcode(ERRCODE_DATA_CORRUPTED),
+                 errmsg("invalid slot %d in memory view file",
+                        file_record.slot)));
+
+      if (!memview_record_restore(&partition,
+                                  file_record.slot,
+                                  file_record.owner,
+                                  &file_record.description,
+                                  file_record.expires_at))
+        ereport(ERROR,
+                (errcode(ERRCODE_DATA_CORRUPTED),
+                 errmsg("duplicate slot %d in memory view file",
+                        file_record.slot)));
+    }
+
+    /* Compaction builds the free list and counts the chunks that were
+     * not allocated since they did not contain any records. */
+    memview_compact(&partition);
+    memview_write_end(header);
+    memview_unlock_all(header);
+    LWLockRelease(&header->reclaim_lock);
+
+    dshash_detach(partition.owners);
+  }
+}
+
+/*
+ * Look up a used record for a row that is to be modified, raising an
+ * error if it does not exist. A row that has expired does not exist,
+ * even if it has not been removed yet.
+ */
+static MemoryViewRecord* memview_record_modify(MemoryViewSession* session,
+                                               int32 row_id,
+                                               TimestampTz now) {
+  MemoryViewRecord* record = memview_record_lookup(session, row_id);
+
+  if (record == NULL || record->expires_at <= now)
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("row %d does not exist in memory view", row_id)));
+  return record;
+}
+
+/*
+ * Keep track of the number of records with an expiry time when the
+ * expiry time of a record changes.
+ */
+static void memview_count_expiring(MemoryViewHeader* header,
+                                   TimestampTz old_expires_at,
+                                   TimestampTz new_expires_at) {
+  bool had_expiry = old_expires_at != MEMVIEW_NO_EXPIRY;
+  bool has_expiry = new_expires_at != MEMVIEW_NO_EXPIRY;
+
+  if (has_expiry && !had_expiry)
+    pg_atomic_fetch_add_u32(&header->nexpiring, 1);
+  else if (had_expiry && !has_expiry)
+    pg_atomic_fetch_sub_u32(&header->nexpiring, 1);
+}
+
+/*
+ * Mark a record as modified.
+ *
+ * The caller need to hold the stripe of the record in exclusive mode.
+ */
+static void memview_mark_dirty(MemoryViewHeader* header,
+                               MemoryViewRecord* record) {
+  ++record->version;
+  if (header->flush_enabled)
+    record->dirty = true;
+}
+
+/*
+ * Insert a record into the memory view.
+ *
+ * The slot is allocated while holding the allocation lock, and we
+ * take the stripe of the slot before releasing it, so the record is
+ * marked as used while holding the stripe.
+ *
+ * The slot is allocated before the modification is started, so that
+ * an error when the memory view is full does not leave the write
+ * counters unbalanced. Readers do not copy unused records, so they do
+ * not need to see the allocation as a modification.
+ */
+static void memview_apply_insert(MemoryViewSession* session,
+                                 MemoryViewOp* op,
+                                 MemoryViewStatsCounts* counts) {
+  MemoryViewHeader* header = session->header;
+  MemoryViewRecord* record;
+  LWLock* stripe;
+  instr_time alloc_acquired, stripe_acquired;
+
+  memview_lock_acquire(
+      counts, &header->alloc_lock, LW_EXCLUSIVE, &alloc_acquired);
+  op->row_id = memview_allocate_slot(session);
+  if (header->nrecords > pg_atomic_read_u64(&header->stats.max_records))
+    pg_atomic_write_u64(&header->stats.max_records, header->nrecords);
+  stripe = memview_stripe_lock(header, op->row_id);
+  memview_lock_acquire(counts, stripe, LW_EXCLUSIVE, &stripe_acquired);
+  memview_lock_release(counts, &header->alloc_lock, &alloc_acquired);
+
+  record = memview_record_get(session, op->row_id);
+  memview_write_begin(header);
+  record->used = true;
+  record->dboid = header->dboid;
+  record->owner = op->owner;
+  record->description = op->description;
+  record->expires_at = op->has_expiry ? op->expires_at : MEMVIEW_NO_EXPIRY;
+  memview_count_expiring(header, MEMVIEW_NO_EXPIRY, record->expires_at);
+  memview_mark_dirty(header, record);
+  memview_owner_link(session, op->row_id, record);
+  memview_change_append(session, MEMVIEW_CHANGE_INSERT, op->row_id, record);
+  memview_write_end(header);
+  memview_lock_release(counts, stripe, &stripe_acquired);
+  ++counts->rows;
+}
+
+/*
+ * Update a record in the memory view while holding its stripe.
+ *
+ * The record is looked up before the modification is started, so that
+ * an error for a missing record does not leave the write counters
+ * unbalanced.
+ */
+static void memview_apply_update(MemoryViewSession* session,
+                                 MemoryViewOp* op,
+                                 TimestampTz now,
+                                 MemoryViewStatsCounts* counts) {
+  MemoryViewHeader* header = session->header;
+  LWLock* stripe = memview_stripe_lock(header, op->row_id);
+  MemoryViewRecord* record;
+  instr_time acquired;
+
+  memview_lock_acquire(counts, stripe, LW_EXCLUSIVE, &acquired);
+  record = memview_record_modify(session, op->row_id, now);
+  memview_write_begin(header);
+  /* No need to change the database OID. It remains the same */
+  if (record->owner != op->owner) {
+    memview_owner_unlink(session, record);
+    record->owner = op->owner;
+    memview_owner_link(session, op->row_id, record);
+  }
+  record->description = op->description;
+  if (op->has_expiry) {
+    memview_count_expiring(header, record->expires_at, op->expires_at);
+    record->expires_at = op->expires_at;
+  }
+  memview_mark_dirty(header, record);
+  memview_change_append(session, MEMVIEW_CHANGE_UPDATE, op->row_id, record);
+  memview_write_end(header);
+  memview_lock_release(counts, stripe, &acquired);
+  ++counts->rows;
+}
+
+/*
+ * Delete a record from the memory view.
+ *
+ * The record is marked as unused while holding its stripe, and the
+ * slot is then added to the free list while holding the allocation
+ * lock. Readers do not copy unused records, so the slot can be added
+ * to the free list without marking it as a modification.
+ *
+ * For expire operations, the record is only deleted if it exists and
+ * has expired, since it might have been deleted or updated with a new
+ * expiry time after it was picked for removal.
+ *
+ * Returns true if the memory view needs to be compacted.
+ */
+static bool memview_apply_delete(MemoryViewSession* session,
+                                 MemoryViewOp* op,
+                                 TimestampTz now,
+                                 MemoryViewStatsCounts* counts) {
+  MemoryViewHeader* header = session->header;
+  LWLock* stripe = memview_stripe_lock(header, op->row_id);
+  MemoryViewChangeKind change = MEMVIEW_CHANGE_DELETE;
+  MemoryViewRecord* record;
+  instr_time acquired;
+  bool compact;
+
+  memview_lock_acquire(counts, stripe, LW_EXCLUSIVE, &acquired);
+  if (op->kind == MEMVIEW_OP_EXPIRE) {
+    record = memview_record_lookup(session, op->row_id);
+    if (record == NULL || record->expires_at > now) {
+      memview_lock_release(counts, stripe, &acquired);
+      return false;
+    }
+    change = MEMVIEW_CHANGE_EXPIRE;
+  } else {
+    record = memview_record_modify(session, op->row_id, now);
+  }
+
+  memview_write_begin(header);
+  memview_change_append(session, change, op->row_id, record);
+  memview_owner_unlink(session, record);
+  memview_count_expiring(header, record->expires_at, MEMVIEW_NO_EXPIRY);
+  memview_mark_dirty(header, record);
+  record->used = false;
+  memview_write_end(header);
+  memview_lock_release(counts, stripe, &acquired);
+
+  memview_lock_acquire(counts, &header->alloc_lock, LW_EXCLUSIVE, &acquired);
+  memview_release_slot(session, op->row_id);
+  compact = memview_needs_compaction(session);
+  memview_lock_release(counts, &header->alloc_lock, &acquired);
+  ++counts->rows;
+
+  return compact;
+}
+
+/*
+ * Apply a batch of operations to a partition of the memory view.
+ *
+ * All operations are applied in order while holding the reclaim lock
+ * in shared mode, so the chunks cannot be released in the middle of
+ * the batch, but each operation only takes the locks it needs, so
+ * writers modifying different rows can run concurrently. The row
+ * identifiers of inserted rows are stored in the operations.
+ *
+ * The statistics are collected for the entire batch and added to the
+ * partition at the end. Waiting for the reclaim lock is counted for
+ * the first operation of the batch.
+ */
+static void memview_apply_partition(MemoryViewSession* session,
+                                    MemoryViewOp* ops,
+                                    size_t nops) {
+  MemoryViewHeader* header = session->header;
+  TimestampTz now = GetCurrentTimestamp();
+  MemoryViewStatsCounts counts[MEMVIEW_STATS_KINDS];
+  instr_time acquired;
+  bool compact = false;
+
+  if (nops == 0)
+    return;
+
+  memset(counts, 0, sizeof(counts));
+  memview_lock_acquire(&counts[memview_op_stats_kind[ops[0].kind]],
+                       &header->reclaim_lock,
+                       LW_SHARED,
+                       &acquired);
+  for (size_t i = 0; i < nops; ++i) {
+    MemoryViewOp* op = &ops[i];
+    MemoryViewStatsCounts* op_counts = &counts[memview_op_stats_kind[op->kind]];
+    instr_time start;
+
+    memview_stats_start(&start);
+    switch (op->kind) {
+      case MEMVIEW_OP_INSERT:
+        memview_apply_insert(session, op, op_counts);
+        break;
+
+      case MEMVIEW_OP_UPDATE:
+        memview_apply_update(session, op, now, op_counts);
+        break;
+
+      case MEMVIEW_OP_DELETE:
+      case MEMVIEW_OP_EXPIRE:
+        if (memview_apply_delete(session, op, now, op_counts))
+          compact = true;
+        break;
+    }
+    memview_stats_count(op_counts, &start);
+  }
+  LWLockRelease(&header->reclaim_lock);
+
+  ConditionVariableBroadcast(&header->changes_cv);
+
+  for (int kind = 0; kind < MEMVIEW_STATS_KINDS; ++kind)
+    memview_stats_add(&header->stats, kind, &counts[kind]);
+
+  if (compact)
+    memview_compact_view(session, false);
+}
+
+/*
+ * Apply a batch of operations to the memory view of the current
+ * database.
+ */
+void memview_apply(MemoryViewOp* ops, size_t nops) {
+  memview_apply_partition(memview_session_get(), ops, nops);
+}
+
+/*
+ * Remove expired records from a partition.
+ *
+ * The slots are read without taking the stripes to find records that
+ * have expired, and these are then removed in batches of at most
+ * "memview.expire_batch_size" records using expire operations, which
+ * check that the record has expired while holding the stripe.
+ */
+static void memview_expire_partition(MemoryViewSession* session,
+                                     TimestampTz now) {
+  MemoryViewHeader* header = session->header;
+  MemoryViewOp* ops = palloc0_array(MemoryViewOp, memview_expire_batch_size);
+  size_t slot = 0;
+  size_t nexpired = 0;
+
+  for (;;) {
+    size_t nslots, nchunks;
+    int nops = 0;
+
+    LWLockAcquire(&header->reclaim_lock, LW_SHARED);
+    nslots = header->nslots;
+    nchunks = header->nchunks;
+    pg_read_barrier();
+    for (; slot < nslots && nops < memview_expire_batch_size; ++slot) {
+      MemoryViewRecord* record =
+          memview_record_peek(session, nslots, nchunks, slot);
+
+      if (record != NULL && record->used && record->expires_at <= now) {
+        ops[nops].kind = MEMVIEW_OP_EXPIRE;
+        ops[nops].row_id = slot;
+        ++nops;
+      }
+    }
+    LWLockRelease(&header->reclaim_lock);
+
+    if (nops == 0)
+      break;
+
+    memview_apply_partition(session, ops, nops);
+    nexpired += nops;
+
+    CHECK_FOR_INTERRUPTS();
+  }
+
+  if (nexpired > 0)
+    TRACE("found %zu expired records in database %u",
+          nexpired,
+          header->dboid);
+
+  pfree(ops);
+}
+
+/*
+ * Remove expired records from all partitions of the memory view.
+ *
+ * Partitions without records with an expiry time are skipped without
+ * reading the slots.
+ */
+void memview_expire(MemoryViewSession* session) {
+  dshash_seq_status status;
+  MemoryViewPartitionEntry* entry;
+  List* headers = NIL;
+  TimestampTz now = GetCurrentTimestamp();
+  ListCell* lc;
+
+  dshash_seq_init(&status, session->partitions, false);
+  while ((entry = dshash_seq_next(&status)) != NULL)
+    headers = lappend(headers, dsa_get_address(session->area, entry->header));
+  dshash_seq_term(&status);
+
+  foreach (lc, headers) {
+    MemoryViewHeader* header = lfirst(lc);
+    MemoryViewSession partition;
+
+    if (pg_atomic_read_u32(&header->nexpiring) == 0)
+      continue;
+
+    memview_partition_attach(session, header, &partition);
+    memview_expire_partition(&partition, now);
+    dshash_detach(partition.owners);
+  }
+
+  list_free(headers);
+}
+
+/*
+ * Start writing the partition of the session to a table.
+ *
+ * The rows read from the table are passed in "rows". If the partition
+ * has not been used since the server started, which is the case after
+ * a restart without persistence and after a crash, the memory view is
+ * seeded from the rows, so that the table is not cleared. The seeded
+ * records are not dirty since they are already in the table, and true
+ * is returned to tell the caller that the table is in sync.
+ *
+ * Otherwise all used records are marked as dirty, so that the table
+ * can be rebuilt from the memory view, and false is returned. In both
+ * cases, records that are modified after this are marked as dirty by
+ * the writers.
+ */
+bool memview_flush_start(MemoryViewSession* session,
+                         const MemoryViewFlushRow* rows,
+                         int nrows) {
+  MemoryViewHeader* header = session->header;
+  bool seed;
+
+  LWLockAcquire(&header->reclaim_lock, LW_EXCLUSIVE);
+  memview_lock_all(header, LW_EXCLUSIVE);
+  seed = !header->flush_enabled && header->nslots == 0 &&
+         pg_atomic_read_u64(&header->nresets) == 0;
+  header->flush_enabled = true;
+
+  if (seed) {
+    memview_write_begin(header);
+    for (int i = 0; i < nrows; ++i)
+      (void)memview_record_restore(session,
+                                   rows[i].row_id,
+                                   rows[i].owner,
+                                   &rows[i].description,
+                                   MEMVIEW_NO_EXPIRY);
+    memview_compact(session);
+    memview_write_end(header);
+    memview_unlock_all(header);
+    LWLockRelease(&header->reclaim_lock);
+    return true;
+  }
+
+  for (size_t slot = 0; slot < header->nslots; ++slot) {
+    MemoryViewRecord* record;
+
+    if (!DsaPointerIsValid(header->chunks[slot / MEMVIEW_CHUNK_RECORDS])) {
+      slot += MEMVIEW_CHUNK_RECORDS - 1 - slot % MEMVIEW_CHUNK_RECORDS;
+      continue;
+    }
+
+    /* The table is rebuilt, so pending deletes are not needed. */
+    record = memview_record_get(session, slot);
+    record->dirty = record->used;
+  }
+  memview_unlock_all(header);
+  LWLockRelease(&header->reclaim_lock);
+  return false;
+}
+
+/*
+ * Copy dirty records of the partition, starting at a slot.
+ *
+ * The slots are read without taking the stripes to find the dirty
+ * records, and each dirty record is then copied while holding its
+ * stripe. The slot to continue from is stored in "cursor", and fewer
+ * than "maxrows" rows are returned when there are no more slots.
+ */
+int memview_flush_collect(MemoryViewSession* session,
+                          size_t* cursor,
+                          MemoryViewFlushRow* rows,
+                          int maxrows) {
+  MemoryViewHeader* header = session->header;
+  size_t nslots, nchunks;
+  int nrows = 0;
+
+  LWLockAcquire(&header->reclaim_lock, LW_SHARED);
+  nslots = header->nslots;
+  nchunks = header->nchunks;
+  pg_read_barrier();
+  for (; *cursor < nslots && nrows < maxrows; ++*cursor) {
+    int32 slot = *cursor;
+    MemoryViewRecord* record =
+        memview_record_peek(session, nslots, nchunks, slot);
+    LWLock* stripe;
+
+    if (record == NULL || !record->dirty)
+      continue;
+
+    stripe = memview_stripe_lock(header, slot);
+    LWLockAcquire(stripe, LW_SHARED);
+    if (record->dirty) {
+      MemoryViewFlushRow* row = &rows[nrows++];
+
+      row->row_id = slot;
+      row->version = record->version;
+      row->used = record->used;
+      row->owner = record->owner;
+      row->description = record->description;
+    }
+    LWLockRelease(stripe);
+  }
+  LWLockRelease(&header->reclaim_lock);
+
+  return nrows;
+}
+
+/*
+ * Clear the dirty flag of records that have been written.
+ *
+ * Records that were modified after they were copied keep the dirty
+ * flag, so they are written again. If the memory view was reset after
+ * the rows were copied, the slots might have been reused, so nothing
+ * is cleared and the table is rebuilt instead. The reclaim lock
+ * prevents a reset while the flags are cleared, and dirty records are
+ * never released by compaction, so the chunks are still allocated.
+ */
+void memview_flush_clean(MemoryViewSession* session,
+                         const MemoryViewFlushRow* rows,
+                         int nrows,
+                         uint64 resets) {
+  MemoryViewHeader* header = session->header;
+
+  LWLockAcquire(&header->reclaim_lock, LW_SHARED);
+  if (pg_atomic_read_u64(&header->nresets) == resets) {
+    for (int i = 0; i < nrows; ++i) {
+      LWLock* stripe = memview_stripe_lock(header, rows[i].row_id);
+      MemoryViewRecord* record;
+
+      LWLockAcquire(stripe, LW_EXCLUSIVE);
+      record = memview_record_get(session, rows[i].row_id);
+      if (record->version == rows[i].version)
+        record->dirty = false;
+      LWLockRelease(stripe);
+    }
+  }
+  LWLockRelease(&header->reclaim_lock);
+}
+
+/*
+ * Get the expiry time of a row from a column given as a trigger
+ * parameter.
+ */
+static TimestampTz memview_trigger_expiry(TriggerData* trigdata,
+                                          HeapTuple tuple,
+                                          const char* attname,
+                                          bool* isnull) {
+  TupleDesc tupdesc = trigdata->tg_relation->rd_att;
+  int attnum = SPI_fnumber(tupdesc, attname);
+
+  if (attnum <= 0)
+    ereport(ERROR,
+            (errcode(ERRCODE_UNDEFINED_COLUMN),
+             errmsg("column \"%s\" does not exist", attname)));
+
+  if (SPI_gettypeid(tupdesc, attnum) != TIMESTAMPTZOID)
+    ereport(ERROR,
+            (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+             errmsg("column \"%s\" must have type timestamp with time zone",
+                    attname)));
+
+  return DatumGetTimestampTz(SPI_getbinval(tuple, tupdesc, attnum, isnull));
+}
+
 /*
  * Trigger function for inserting a row in the memory view.
+ *
+ * The trigger parameters are the column names of the owner, the
+ * description, and optionally the expiry time of the row.
  */
 Datum memview_insert_row_tgfunc(PG_FUNCTION_ARGS) {
   TriggerData* trigdata;
@@ -225,6 +2040,9 @@ Datum memview_insert_row_tgfunc(PG_FUNCTION_ARGS) {
   Datum descr_value;
   bool descr_isnull;
 
+  TimestampTz expires_at;
+  bool expires_isnull = true;
+
   if (!CALLED_AS_TRIGGER(fcinfo))
     ereport(ERROR,
             (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
@@ -243,13 +2061,15 @@ Datum memview_insert_row_tgfunc(PG_FUNCTION_ARGS) {
             (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
              errmsg("must be called for each row")));
 
-  if (trigdata->tg_trigger->tgnargs != 2)
+  if (trigdata->tg_trigger->tgnargs != 2 && trigdata->tg_trigger->tgnargs != 3)
     ereport(ERROR,
             (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
-             errmsg("must be called with 2 parameters, was called with %d",
+             errmsg("must be called with 2 or 3 parameters, was called "
+                    "with %d",
                     trigdata->tg_trigger->tgnargs),
              errdetail("Trigger need to be created with the column names of "
-                       "the row owner and the description text field.")));
+                       "the row owner and the description text field, and "
+                       "optionally the expiry time.")));
 
   TRACE("tgargs: (%s,%s)", tgargs[0], tgargs[1]);
 
@@ -267,7 +2087,12 @@ Datum memview_insert_row_tgfunc(PG_FUNCTION_ARGS) {
                               &descr_isnull);
   descr = DatumGetName(descr_value);
 
-  memview_row_insert_internal(owner, descr);
+  if (trigdata->tg_trigger->tgnargs > 2)
+    expires_at = memview_trigger_expiry(
+        trigdata, trigdata->tg_trigtuple, tgargs[2], &expires_isnull);
+
+  memview_row_insert_internal(
+      owner, descr, expires_isnull ? NULL : &expires_at);
 
   PG_RETURN_POINTER(NULL);
 }
@@ -275,41 +2100,76 @@ Datum memview_insert_row_tgfunc(PG_FUNCTION_ARGS) {
 Datum memview_row_insert(PG_FUNCTION_ARGS) {
   Oid owner = PG_GETARG_OID(0);
   Name descr = PG_GETARG_NAME(1);
+  TimestampTz expires_at;
 
-  memview_row_insert_internal(owner, descr);
+  if (PG_ARGISNULL(2)) {
+    memview_row_insert_internal(owner, descr, NULL);
+  } else {
+    expires_at = PG_GETARG_TIMESTAMPTZ(2);
+    memview_row_insert_internal(owner, descr, &expires_at);
+  }
 
   PG_RETURN_VOID();
 }
 
-void memview_row_insert_internal(Oid owner, Name descr) {
-  MemoryViewRecord* record;
-  MemoryViewSession* session;
-
-  memview_init_shmem();
+/*
+ * Insert a row in the memory view.
+ *
+ * If no expiry time is given, the row never expires.
+ */
+void memview_row_insert_internal(Oid owner,
+                                 Name descr,
+                                 const TimestampTz* expires_at) {
+  MemoryViewOp op = {.kind = MEMVIEW_OP_INSERT, .owner = owner};
 
   TRACE("inserting row (%d,'%s'::regrole,%s)",
         MyDatabaseId,
         get_role_name(owner),
         NameStr(*descr));
 
-  LWLockAcquire(&memview_state->lock, LW_EXCLUSIVE);
-  session = memview_session_get(memview_state->handle);
-  record = &session->manifest[session->header->nrecords++];
-  record->dboid = MyDatabaseId;
-  record->owner = owner;
-  namestrcpy(&record->description, NameStr(*descr));
-  LWLockRelease(&memview_state->lock);
+  namestrcpy(&op.description, NameStr(*descr));
+  if (expires_at) {
+    op.has_expiry = true;
+    op.expires_at = *expires_at;
+  }
+  memview_apply(&op, 1);
 }
 
 Datum memview_view_reset(PG_FUNCTION_ARGS) {
   MemoryViewSession* session;
+  MemoryViewHeader* header;
+  MemoryViewStatsCounts counts;
+  instr_time start, reclaim_acquired, alloc_acquired;
 
   memview_init_shmem();
 
-  LWLockAcquire(&memview_state->lock, LW_EXCLUSIVE);
-  session = memview_session_get(memview_state->handle);
-  session->header->nrecords = 0;
-  LWLockRelease(&memview_state->lock);
+  memset(&counts, 0, sizeof(counts));
+  memview_stats_start(&start);
+
+  session = memview_session_get();
+  header = session->header;
+  memview_lock_acquire(
+      &counts, &header->reclaim_lock, LW_EXCLUSIVE, &reclaim_acquired);
+  memview_lock_acquire(
+      &counts, &header->alloc_lock, LW_EXCLUSIVE, &alloc_acquired);
+  memview_write_begin(header);
+  counts.rows = header->nrecords;
+  memview_release_chunks(session);
+  pg_atomic_fetch_add_u64(&header->nresets, 1);
+  memview_change_append(session, MEMVIEW_CHANGE_RESET, MEMVIEW_NO_SLOT, NULL);
+  memview_write_end(header);
+  memview_lock_release(&counts, &header->alloc_lock, &alloc_acquired);
+  memview_lock_release(&counts, &header->reclaim_lock, &reclaim_acquired);
+
+  ConditionVariableBroadcast(&header->changes_cv);
+
+  memview_stats_count(&counts, &start);
+  memview_stats_add(&header->stats, MEMVIEW_STATS_RESET, &counts);
+  PG_RETURN_VOID();
+}
+
+Datum memview_view_compact(PG_FUNCTION_ARGS) {
+  memview_compact_view(memview_session_get(), true);
   PG_RETURN_VOID();
 }
 
@@ -375,19 +2235,11 @@ Datum memview_row_delete(PG_FUNCTION_ARGS) {
 }
 
 void memview_row_delete_internal(int32 row_id) {
-  MemoryViewSession* session;
-
-  memview_init_shmem();
+  MemoryViewOp op = {.kind = MEMVIEW_OP_DELETE, .row_id = row_id};
 
   TRACE("deleting row %d", row_id);
 
-  LWLockAcquire(&memview_state->lock, LW_EXCLUSIVE);
-  session = memview_session_get(memview_state->handle);
-  memmove(&session->manifest[row_id],
-          &session->manifest[row_id + 1],
-          (session->header->nrecords - row_id) * sizeof(MemoryViewRecord));
-  --session->header->nrecords;
-  LWLockRelease(&memview_state->lock);
+  memview_apply(&op, 1);
 }
 
 /*
@@ -412,6 +2264,9 @@ Datum memview_update_row_tgfunc(PG_FUNCTION_ARGS) {
   Datum descr_value;
   bool descr_isnull;
 
+  TimestampTz expires_at;
+  bool expires_isnull = true;
+
   if (!CALLED_AS_TRIGGER(fcinfo))
     ereport(ERROR,
             (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
@@ -430,15 +2285,16 @@ Datum memview_update_row_tgfunc(PG_FUNCTION_ARGS) {
             (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
              errmsg("must be called for each row")));
 
-  if (trigdata->tg_trigger->tgnargs != 3)
+  if (trigdata->tg_trigger->tgnargs != 3 && trigdata->tg_trigger->tgnargs != 4)
     ereport(
         ERROR,
         (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
-         errmsg("must be called with 3 parameters, was called with %d",
+         errmsg("must be called with 3 or 4 parameters, was called with %d",
                 trigdata->tg_trigger->tgnargs),
          errdetail("Trigger need to be created with the column name of the row "
-                   "id, the column name of the row owner, and the column name "
-                   "of the description.")));
+                   "id, the column name of the row owner, the column name "
+                   "of the description, and optionally the column name of "
+                   "the expiry time.")));
 
   TRACE("tgargs: (%s,%s,%s)", tgargs[0], tgargs[1], tgargs[2]);
 
@@ -480,7 +2336,12 @@ Datum memview_update_row_tgfunc(PG_FUNCTION_ARGS) {
                               &descr_isnull);
   descr = DatumGetName(descr_value);
 
-  memview_row_update_internal(row_id, owner, descr);
+  if (trigdata->tg_trigger->tgnargs > 3)
+    expires_at = memview_trigger_expiry(
+        trigdata, trigdata->tg_newtuple, tgargs[3], &expires_isnull);
+
+  memview_row_update_internal(
+      row_id, owner, descr, expires_isnull ? NULL : &expires_at);
 
   PG_RETURN_POINTER(NULL);
 }
@@ -489,41 +2350,62 @@ Datum memview_row_update(PG_FUNCTION_ARGS) {
   int32 row_id = PG_GETARG_INT32(0);
   Oid owner = PG_GETARG_OID(1);
   Name descr = PG_GETARG_NAME(2);
+  TimestampTz expires_at;
 
-  memview_row_update_internal(row_id, owner, descr);
+  if (PG_ARGISNULL(3)) {
+    memview_row_update_internal(row_id, owner, descr, NULL);
+  } else {
+    expires_at = PG_GETARG_TIMESTAMPTZ(3);
+    memview_row_update_internal(row_id, owner, descr, &expires_at);
+  }
 
   PG_RETURN_VOID();
 }
 
-void memview_row_update_internal(int32 row_id, Oid owner, Name descr) {
-  MemoryViewRecord* record;
-  MemoryViewSession* session;
-
-  memview_init_shmem();
+/*
+ * Update a row in the memory view.
+ *
+ * If no expiry time is given, the row keeps its expiry time.
+ */
+void memview_row_update_internal(int32 row_id,
+                                 Oid owner,
+                                 Name descr,
+                                 const TimestampTz* expires_at) {
+  MemoryViewOp op = {
+      .kind = MEMVIEW_OP_UPDATE,
+      .row_id = row_id,
+      .owner = owner,
+  };
 
   TRACE("updating row %d with ('%s'::regrole,%s)",
         row_id,
         get_role_name(owner),
         NameStr(*descr));
 
-  LWLockAcquire(&memview_state->lock, LW_EXCLUSIVE);
-  session = memview_session_get(memview_state->handle);
-  record = &session->manifest[row_id];
-  /* No need to change the database OID. It remains the same */
-  record->owner = owner;
-  namestrcpy(&record->description, NameStr(*descr));
-  LWLockRelease(&memview_state->lock);
+  namestrcpy(&op.description, NameStr(*descr));
+  if (expires_at) {
+    op.has_expiry = true;
+    op.expires_at = *expires_at;
+  }
+  memview_apply(&op, 1);
 }
 
 /*
  * Get the the memory view as a result set.
  *
- * Note that we lock the region for the entire result set. It is
- * possible to optimize the locking here but that requires a little
- * more care, so we don't do that right now.
+ * On the first call, we take a snapshot of the memory view, which
+ * normally does not require taking the lock, and then return the
+ * rows from the snapshot. This means that many readers can scan the
+ * view at the same time without blocking each other or the writers.
+ *
+ * If "member_only" is true, only rows with an owner that the current
+ * user is a member of are returned. The owners are checked once for
+ * the scan and the rows are read using the owner index, so rows of
+ * other owners are never read.
  */
 Datum memview_view_scan(PG_FUNCTION_ARGS) {
   FuncCallContext* funcctx;
+  MemoryViewScanState* scan;
 
   memview_init_shmem();
 
@@ -540,34 +2422,39 @@ Datum memview_view_scan(PG_FUNCTION_ARGS) {
                errmsg("function returning record called in context "
                       "that cannot accept type record")));
 
-    LWLockAcquire(&memview_state->lock, LW_EXCLUSIVE);
-    session = memview_session_get(memview_state->handle);
-    funcctx->max_calls = session->header->nrecords;
-    funcctx->user_fctx = session;
-    LWLockRelease(&memview_state->lock);
-
     funcctx->tuple_desc = BlessTupleDesc(tupdesc);
 
+    session = memview_session_get();
+
     oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+    scan = palloc0(sizeof(MemoryViewScanState));
+    if (PG_GETARG_BOOL(0) && !superuser()) {
+      MemoryViewFilter filter = {0};
+      Oid* owners = memview_member_owners(session, &filter.nowners);
+
+      filter.owners = owners;
+      memview_snapshot(session, &filter, &scan->snapshot);
+      pfree(owners);
+    } else {
+      memview_snapshot(session, NULL, &scan->snapshot);
+    }
     MemoryContextSwitchTo(oldcontext);
+
+    funcctx->user_fctx = scan;
   }
 
   CHECK_FOR_INTERRUPTS();
 
   funcctx = SRF_PERCALL_SETUP();
+  scan = funcctx->user_fctx;
 
-  if (funcctx->call_cntr < funcctx->max_calls) {
-    MemoryViewSession* session = funcctx->user_fctx;
-    bool nulls[4] = {0};
-    Datum values[4] = {0};
+  if (scan->row < scan->snapshot.nrows) {
+    MemoryViewRecord* record = &scan->snapshot.records[scan->row];
+    bool nulls[5] = {0};
+    Datum values[5] = {0};
     HeapTuple tuple;
-    MemoryViewRecord* record;
-
-    LWLockAcquire(&memview_state->lock, LW_EXCLUSIVE);
 
-    record = &session->manifest[funcctx->call_cntr];
-
-    values[0] = UInt32GetDatum(funcctx->call_cntr);
+    values[0] = Int32GetDatum(scan->snapshot.row_ids[scan->row]);
     values[1] = ObjectIdGetDatum(record->dboid);
     if (record->owner) {
       values[2] = ObjectIdGetDatum(record->owner);
@@ -575,10 +2462,13 @@ Datum memview_view_scan(PG_FUNCTION_ARGS) {
     } else {
       nulls[2] = nulls[3] = true;
     }
+    if (record->expires_at != MEMVIEW_NO_EXPIRY)
+      values[4] = TimestampTzGetDatum(record->expires_at);
+    else
+      nulls[4] = true;
 
     tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
-
-    LWLockRelease(&memview_state->lock);
+    ++scan->row;
 
     SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
   }
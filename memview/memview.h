@@ -3,9 +3,43 @@
 
 #include "c.h"
 
-#include <storage/dsm.h>
+#include <lib/dshash.h>
+#include <lib/stringinfo.h>
+#include <port/atomics.h>
+#include <portability/instr_time.h>
+#include <storage/condition_variable.h>
+#include <datatype/timestamp.h>
+#include <storage/lwlock.h>
+#include <utils/dsa.h>
 
-#define MEMVIEW_MAX_RECORDS 100
+/*
+ * Records are stored in slots that are allocated in chunks from the
+ * dynamic shared area, so the memory view grows one chunk at a time
+ * as rows are inserted.
+ *
+ * The chunk directory is a fixed-size array in the header, which
+ * gives an upper bound on the number of records that can be stored
+ * in the view. The actual limit is controlled by the
+ * memview.max_records configuration parameter.
+ */
+#define MEMVIEW_CHUNK_RECORDS 1024
+#define MEMVIEW_MAX_CHUNKS 1024
+#define MEMVIEW_MAX_RECORDS (MEMVIEW_CHUNK_RECORDS * MEMVIEW_MAX_CHUNKS)
+
+/* End marker for the free list */
+#define MEMVIEW_NO_SLOT (-1)
+
+/* Number of changes kept in the change log of each partition */
+#define MEMVIEW_CHANGE_LOG_SIZE 4096
+
+/* Number of locks protecting the records of each partition */
+#define MEMVIEW_LOCK_STRIPES 16
+
+/* Expiry time of records that never expire */
+#define MEMVIEW_NO_EXPIRY DT_NOEND
+
+/* Number of buckets in the latency histograms of the statistics */
+#define MEMVIEW_STATS_BUCKETS 16
 
 /*
  * Memory view record with some example data.
@@ -16,28 +50,325 @@
  * We have added an owner to be able to play around with row-level
  * security to show only permitted rows by defining a view on top of
  * the set-returning function to read the records.
+ *
+ * The row identifier of a record is the slot number, so it remains
+ * the same for the lifetime of the row. Deleted records are marked as
+ * unused and linked into the free list of the header using
+ * "next_free".
+ *
+ * Used records are also linked into a doubly-linked list of records
+ * with the same owner using "prev_owner" and "next_owner", which is
+ * used by the owner index.
+ *
+ * A record with an expiry time is not visible after that time and is
+ * removed by the expiry background worker. Records without an expiry
+ * time have MEMVIEW_NO_EXPIRY.
+ *
+ * If the partition is written to a table by the write-behind
+ * background worker, modified records are marked as dirty until they
+ * have been written. Deleted records stay dirty until the delete has
+ * been written, so their chunk is not released before that. The
+ * version is incremented on each modification, so that the background
+ * worker can tell if a record was modified while it was written.
  */
 typedef struct MemoryViewRecord {
+  bool used;
+  int32 next_free;
+  int32 prev_owner;
+  int32 next_owner;
   Oid dboid;
   Oid owner;
   NameData description;
+  TimestampTz expires_at;
+  bool dirty;
+  uint32 version;
 } MemoryViewRecord;
 
+/*
+ * Statistics for the operations on a partition.
+ *
+ * Each kind of operation has counters for the number of operations
+ * and rows, the number of times a lock was not immediately available,
+ * and, if "memview.track_timing" is on, the time spent on the
+ * operations, waiting for locks, and holding locks, in nanoseconds.
+ * The latency histogram counts the operations by their duration,
+ * where bucket N has the operations that took less than 2^(N+1)
+ * microseconds and more than the previous bucket, except that the
+ * last bucket has all the operations that took longer than that.
+ *
+ * The counters are collected in backend-local memory using
+ * MemoryViewStatsCounts while a batch of operations is applied and
+ * added to the shared counters when the batch is done, so the shared
+ * counters are only touched once for each batch.
+ */
+typedef enum MemoryViewStatsKind {
+  MEMVIEW_STATS_INSERT,
+  MEMVIEW_STATS_UPDATE,
+  MEMVIEW_STATS_DELETE,
+  MEMVIEW_STATS_EXPIRE,
+  MEMVIEW_STATS_SCAN,
+  MEMVIEW_STATS_RESET,
+} MemoryViewStatsKind;
+
+#define MEMVIEW_STATS_KINDS (MEMVIEW_STATS_RESET + 1)
+
+typedef struct MemoryViewStatsCounts {
+  uint64 calls;
+  uint64 rows;
+  uint64 lock_waits;
+  instr_time lock_wait_time;
+  instr_time lock_hold_time;
+  instr_time total_time;
+  uint64 latency[MEMVIEW_STATS_BUCKETS];
+} MemoryViewStatsCounts;
+
+typedef struct MemoryViewOpStats {
+  pg_atomic_uint64 calls;
+  pg_atomic_uint64 rows;
+  pg_atomic_uint64 lock_waits;
+  pg_atomic_uint64 lock_wait_time;
+  pg_atomic_uint64 lock_hold_time;
+  pg_atomic_uint64 total_time;
+  pg_atomic_uint64 latency[MEMVIEW_STATS_BUCKETS];
+} MemoryViewOpStats;
+
+typedef struct MemoryViewStats {
+  MemoryViewOpStats ops[MEMVIEW_STATS_KINDS];
+  pg_atomic_uint64 max_records; /* High-water mark for used slots */
+  pg_atomic_uint64 reset_time;  /* Timestamp of last reset */
+} MemoryViewStats;
+
+/*
+ * Memory view header.
+ *
+ * The memory view is partitioned by database, and each partition has
+ * a header that is allocated in the dynamic shared area when the
+ * database first uses the memory view. The header contains the
+ * directory of allocated chunks as well as the bookkeeping for the
+ * slots, so a backend never reads or locks the records of other
+ * databases.
+ *
+ * To allow concurrent writers, the partition is protected by several
+ * locks:
+ *
+ * - "alloc_lock" protects the slot bookkeeping and the chunk
+ *   directory, that is, the free list, the counters, and the chunks,
+ *   and is only held while a slot is allocated or released.
+ *
+ * - "stripes" protect the records, where slot N is protected by
+ *   stripe N % MEMVIEW_LOCK_STRIPES, so that consecutive slots are
+ *   protected by different stripes.
+ *
+ * - "changes_lock" protects the change log.
+ *
+ * - "reclaim_lock" is held in shared mode by readers and writers to
+ *   prevent chunks from being released under their feet, and in
+ *   exclusive mode by operations that release chunks.
+ *
+ * The locks are taken in the order they are listed above, after
+ * "reclaim_lock", and at most one stripe is taken at a time except
+ * when all stripes are taken, in which case they are taken in
+ * ascending order. A writer always holds "alloc_lock" or a stripe
+ * in exclusive mode while it modifies the partition, so taking
+ * "alloc_lock" and all the stripes excludes all writers.
+ *
+ * Readers do not take any of the locks unless they fail to get a
+ * consistent copy of the partition, in which case they take
+ * "alloc_lock" and all the stripes in shared mode.
+ *
+ * The owner index is a hash table in the dynamic shared area mapping
+ * each owner to the first record in the list of records for that
+ * owner. The lists of different owners are disjoint, so the list of
+ * an owner is protected by the lock on the entry for the owner in the
+ * hash table, which is taken while holding the stripe of the record
+ * that is added or removed.
+ *
+ * All slots below "nslots" have been handed out at some point and are
+ * either used or in the free list, unless the chunk they belong to
+ * was released by a compaction, in which case the chunk pointer is
+ * invalid. Slots at or above "nslots" have never been used.
+ */
 typedef struct MemoryViewHeader {
-  size_t nrecords;
+  Oid dboid;
+  LWLock reclaim_lock;
+  LWLock alloc_lock;
+  LWLock changes_lock;
+  LWLock stripes[MEMVIEW_LOCK_STRIPES];
+
+  size_t nrecords;     /* Number of used slots */
+  size_t nslots;       /* High-water mark for slots */
+  size_t ndeleted;     /* Deletes since last compaction */
+  size_t nreleased;    /* Chunks released below nchunks */
+  int32 free_slot;     /* First slot in free list */
+
+  dshash_table_handle owners; /* Owner index */
+
+  /* Number of used records with an expiry time, which is used by the
+   * expiry background worker to skip partitions without such records */
+  pg_atomic_uint32 nexpiring;
+
+  /* Set when the write-behind background worker writes the partition
+   * to a table, so that modified records are marked as dirty. The
+   * number of resets is used to detect that the table need to be
+   * cleared. */
+  bool flush_enabled;
+  pg_atomic_uint64 nresets;
+
+  MemoryViewStats stats;
+
+  /*
+   * Counters for modifications of the memory view, used by readers
+   * to check that they got a consistent copy without taking the
+   * lock. Writers increment "writes_started" before they modify the
+   * view and "writes_finished" when they are done.
+   */
+  pg_atomic_uint64 writes_started;
+  pg_atomic_uint64 writes_finished;
+
+  /*
+   * Change log, which is a ring buffer with the last
+   * MEMVIEW_CHANGE_LOG_SIZE changes to the partition. Changes are
+   * numbered from 1 and "next_change" is the position of the next
+   * change. Changes are added while holding "changes_lock" in
+   * exclusive mode and waiters on "changes_cv" are woken up when the
+   * writer has released its locks.
+   */
+  dsa_pointer changes;
+  pg_atomic_uint64 next_change;
+  ConditionVariable changes_cv;
+
+  size_t nchunks;
+  dsa_pointer chunks[MEMVIEW_MAX_CHUNKS];
 } MemoryViewHeader;
 
+/*
+ * Snapshot of the used records of the memory view.
+ *
+ * This is a copy of the records in backend-local memory that is
+ * consistent, that is, no modifications were made to the view while
+ * the copy was made.
+ */
+typedef struct MemoryViewSnapshot {
+  TimestampTz now; /* Records that expired before this are skipped */
+  size_t nrows;
+  int32* row_ids;
+  MemoryViewRecord* records;
+} MemoryViewSnapshot;
+
+/*
+ * Filter for a snapshot of the memory view.
+ *
+ * If "row_ids" is not NULL, only the listed rows are read, which means
+ * that the other slots are not scanned at all. If "owners" is not
+ * NULL, only rows with one of the listed owners are included, and if
+ * there are no row identifiers, the rows are found using the owner
+ * index. The owners have to be distinct.
+ */
+typedef struct MemoryViewFilter {
+  int nrow_ids;
+  const int32* row_ids;
+  int nowners;
+  const Oid* owners;
+} MemoryViewFilter;
+
+/*
+ * Operation on the memory view.
+ *
+ * Operations are applied in batches using memview_apply(), which
+ * takes the reclaim lock once for the entire batch. For inserts, the
+ * row identifier is set when the operation is applied.
+ *
+ * The expiry time is only used if "has_expiry" is set. Otherwise,
+ * inserted rows never expire and updated rows keep their expiry time.
+ * An expire operation deletes the row if it has expired, and does
+ * nothing otherwise.
+ */
+typedef enum MemoryViewOpKind {
+  MEMVIEW_OP_INSERT,
+  MEMVIEW_OP_UPDATE,
+  MEMVIEW_OP_DELETE,
+  MEMVIEW_OP_EXPIRE,
+} MemoryViewOpKind;
+
+typedef struct MemoryViewOp {
+  MemoryViewOpKind kind;
+  int32 row_id;
+  Oid owner;
+  NameData description;
+  bool has_expiry;
+  TimestampTz expires_at;
+} MemoryViewOp;
+
+/*
+ * Change in the change log of a partition.
+ *
+ * For inserts and updates, the owner and description are the new
+ * values of the row. For deletes and expired rows, they are the values
+ * of the removed row. A reset removes all rows, so it does not have a
+ * row.
+ */
+typedef enum MemoryViewChangeKind {
+  MEMVIEW_CHANGE_INSERT,
+  MEMVIEW_CHANGE_UPDATE,
+  MEMVIEW_CHANGE_DELETE,
+  MEMVIEW_CHANGE_RESET,
+  MEMVIEW_CHANGE_EXPIRE,
+} MemoryViewChangeKind;
+
+typedef struct MemoryViewChange {
+  uint64 position;
+  MemoryViewChangeKind kind;
+  int32 row_id;
+  Oid owner;
+  NameData description;
+} MemoryViewChange;
+
+/*
+ * Copy of a dirty record that is written to the write-behind table.
+ *
+ * Records that are no longer used are deleted from the table.
+ */
+typedef struct MemoryViewFlushRow {
+  int32 row_id;
+  uint32 version;
+  bool used;
+  Oid owner;
+  NameData description;
+} MemoryViewFlushRow;
+
+/*
+ * Entry in the registry of named memory views.
+ *
+ * Named views are created using memview_create() and store rows of a
+ * composite type. Composite types are local to a database, so the
+ * views are identified by the database OID and the name of the view.
+ * The key need to be zeroed before the name is copied into it since
+ * the entire key is hashed.
+ */
+typedef struct MemoryViewNamedKey {
+  Oid dboid;
+  NameData name;
+} MemoryViewNamedKey;
+
+typedef struct MemoryViewNamedEntry {
+  MemoryViewNamedKey key;
+  Oid typid;
+  dsa_pointer view;
+} MemoryViewNamedEntry;
+
 /*
  * A memory view session.
  *
  * This is the session's memory view exists for the duration of the
- * running session.
+ * running session. The header is the partition for the database of
+ * the session and "owners" is the owner index of the partition.
  */
 typedef struct MemoryViewSession {
-  dsm_segment* segment;
-
+  dsa_area* area;
+  dshash_table* partitions;
   MemoryViewHeader* header;
-  MemoryViewRecord* manifest;
+  dshash_table* owners;
+  dshash_table* views;
 } MemoryViewSession;
 
 extern PGDLLEXPORT Datum memview_row_delete(PG_FUNCTION_ARGS);
@@ -45,9 +376,98 @@ extern PGDLLEXPORT Datum memview_row_insert(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum memview_row_update(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum memview_view_reset(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum memview_view_scan(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_view_compact(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum memview_delete_row_tgfunc(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum memview_insert_row_tgfunc(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum memview_update_row_tgfunc(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_row_insert_many(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_row_update_many(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_row_delete_many(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_insert_row_batch_tgfunc(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_update_row_batch_tgfunc(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_delete_row_batch_tgfunc(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_apply_batch_tgfunc(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_fdw_handler(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_create(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_drop(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_insert(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_update(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_delete(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_scan(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_save(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_changes(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_change_position(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_changes_wait(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_stats(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_stats_records(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum memview_stats_reset(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT void memview_persist_main(Datum main_arg);
+extern PGDLLEXPORT void memview_expire_main(Datum main_arg);
+extern PGDLLEXPORT void memview_flush_main(Datum main_arg);
+
+extern void _PG_init(void);
+
+extern int memview_max_records;
+extern bool memview_persist;
+extern int memview_expire_interval;
+extern int memview_expire_batch_size;
+extern char* memview_flush_table;
+extern char* memview_flush_database;
+extern int memview_flush_interval;
+extern int memview_flush_batch_size;
+extern bool memview_track_timing;
+
+extern int memview_tranche_id(void);
+extern MemoryViewSession* memview_session_get(void);
+extern MemoryViewHeader* memview_partition_get(MemoryViewSession* session,
+                                               Oid dboid,
+                                               bool create);
+extern MemoryViewRecord* memview_record_get(MemoryViewSession* session,
+                                            size_t row);
+extern MemoryViewRecord* memview_record_lookup(MemoryViewSession* session,
+                                               int32 row_id);
+extern size_t memview_owner_count(MemoryViewSession* session, Oid owner);
+extern void memview_apply(MemoryViewOp* ops, size_t nops);
+extern void memview_snapshot(MemoryViewSession* session,
+                             const MemoryViewFilter* filter,
+                             MemoryViewSnapshot* snapshot);
+extern dsa_handle memview_dsa_handle(void);
+
+extern void memview_change_append(MemoryViewSession* session,
+                                  MemoryViewChangeKind kind,
+                                  int32 row_id,
+                                  const MemoryViewRecord* record);
 
-extern MemoryViewSession* memview_session_get(dsm_handle handle);
-extern dsm_handle memview_dsm_handle(void);
+extern void memview_save_records(MemoryViewSession* session, StringInfo buf);
+extern void memview_load_records(MemoryViewSession* session, StringInfo buf);
+extern bool memview_check_records(StringInfo buf);
+extern void memview_named_save(MemoryViewSession* session, StringInfo buf);
+extern void memview_named_load(MemoryViewSession* session, StringInfo buf);
+extern bool memview_named_check(StringInfo buf);
+extern bool memview_file_try_read(StringInfo buf, void* data, size_t size);
+extern void memview_file_read(StringInfo buf, void* data, size_t size);
+extern void memview_file_save(bool shutdown);
+extern void memview_file_load(MemoryViewSession* session);
+extern void memview_file_remove(void);
+extern void memview_persist_register(void);
+extern void memview_expire(MemoryViewSession* session);
+extern void memview_expire_register(void);
+extern bool memview_flush_start(MemoryViewSession* session,
+                                const MemoryViewFlushRow* rows,
+                                int nrows);
+extern int memview_flush_collect(MemoryViewSession* session,
+                                 size_t* cursor,
+                                 MemoryViewFlushRow* rows,
+                                 int maxrows);
+extern void memview_flush_clean(MemoryViewSession* session,
+                                const MemoryViewFlushRow* rows,
+                                int nrows,
+                                uint64 resets);
+extern void memview_flush_register(void);
+extern void memview_stats_init(MemoryViewStats* stats);
+extern void memview_stats_start(instr_time* start);
+extern void memview_stats_count(MemoryViewStatsCounts* counts,
+                                const instr_time* start);
+extern void memview_stats_add(MemoryViewStats* stats,
+                              MemoryViewStatsKind kind,
+                              const MemoryViewStatsCounts* counts);
@@ -1,21 +1,104 @@
 -- complain if script is sourced in psql, rather than via CREATE EXTENSION
 \echo Use "CREATE EXTENSION memview" to load this file. \quit
 
-create function memview_view_scan()
-returns table(row_id integer, dboid Oid, owner oid, description name)
+create function memview_view_scan(member_only boolean default false)
+returns table(row_id integer, dboid Oid, owner oid, description name,
+              expires_at timestamptz)
 as 'memview' language c;
 
 create procedure memview_view_reset() as 'memview' language c;
+create procedure memview_view_compact() as 'memview' language c;
 
-create function memview_row_insert(owner oid, description name)
+create function memview_row_insert(owner oid, description name,
+                                   expires_at timestamptz default null)
     returns void as 'memview' language c;
 
-create function memview_row_update(row_id integer, owner oid, description name)
+create function memview_row_update(row_id integer, owner oid, description name,
+                                   expires_at timestamptz default null)
     returns void as 'memview' language c;
 
 create function memview_row_delete(row_id integer)
     returns void as 'memview' language c;
 
+create function memview_row_insert_many(owners oid[], descriptions name[],
+                                        expires_at timestamptz[] default null)
+    returns void as 'memview' language c;
+
+create function memview_row_update_many(row_ids integer[], owners oid[], descriptions name[],
+                                        expires_at timestamptz[] default null)
+    returns void as 'memview' language c;
+
+create function memview_row_delete_many(row_ids integer[])
+    returns void as 'memview' language c;
+
 create function memview_insert_row_tgfunc() returns trigger as 'memview' language c;
 create function memview_delete_row_tgfunc() returns trigger as 'memview' language c;
 create function memview_update_row_tgfunc() returns trigger as 'memview' language c;
+
+create function memview_insert_row_batch_tgfunc() returns trigger as 'memview' language c;
+create function memview_delete_row_batch_tgfunc() returns trigger as 'memview' language c;
+create function memview_update_row_batch_tgfunc() returns trigger as 'memview' language c;
+create function memview_apply_batch_tgfunc() returns trigger as 'memview' language c;
+
+create function memview_fdw_handler() returns fdw_handler
+    as 'memview' language c strict;
+
+create foreign data wrapper memview_fdw handler memview_fdw_handler;
+create server memview_server foreign data wrapper memview_fdw;
+
+create function memview_create(view name, rowtype regtype)
+    returns void as 'memview' language c strict;
+
+create function memview_drop(view name)
+    returns void as 'memview' language c strict;
+
+create function memview_insert(view name, data anyelement)
+    returns integer as 'memview' language c;
+
+create function memview_update(view name, row_id integer, data anyelement)
+    returns void as 'memview' language c;
+
+create function memview_delete(view name, row_id integer)
+    returns void as 'memview' language c strict;
+
+create function memview_scan(view name, rowtype anyelement,
+                             out row_id integer, out data anyelement)
+    returns setof record as 'memview' language c;
+
+create function memview_save()
+    returns void as 'memview' language c;
+revoke execute on function memview_save() from public;
+
+create function memview_expire_now()
+    returns void as 'memview' language c;
+revoke execute on function memview_expire_now() from public;
+
+create function memview_change_position()
+    returns bigint as 'memview' language c strict;
+
+create function memview_changes(since bigint,
+                                out position bigint, out operation text,
+                                out row_id integer, out owner oid,
+                                out description name)
+    returns setof record as 'memview' language c strict;
+
+create function memview_changes_wait(since bigint, timeout integer default 1000)
+    returns boolean as 'memview' language c strict;
+
+create function memview_stats(out operation text, out calls bigint,
+                              out rows bigint, out lock_waits bigint,
+                              out lock_wait_time double precision,
+                              out lock_hold_time double precision,
+                              out total_time double precision,
+                              out latency bigint[])
+    returns setof record as 'memview' language c;
+
+create function memview_stats_records(out records bigint,
+                                      out max_records bigint,
+                                      out slots bigint,
+                                      out stats_reset timestamptz)
+    returns record as 'memview' language c;
+
+create function memview_stats_reset()
+    returns void as 'memview' language c;
+revoke execute on function memview_stats_reset() from public;
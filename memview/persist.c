@@ -0,0 +1,352 @@
+/*
+ * Copyright 2025 Mats Kindahl.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you
+ * may not use this file except in compliance with the License.  You
+ * may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+/*
+ * Persistence of the memory view.
+ *
+ * If "memview.persist" is enabled, the contents of the memory view,
+ * including the named views, are written to a file in the data
+ * directory on clean shutdown or when memview_save() is called, and
+ * loaded when the shared memory state is set up after a restart.
+ * Only files written on shutdown are loaded, since a file written on
+ * demand is older than the memory view that was lost in a crash.
+ *
+ * The file consists of a header with a magic number, a version, the
+ * size of the data, and a checksum of the data, followed by the
+ * records of all partitions and the rows of all named views. The
+ * entire file is built in memory and written in one go, and read
+ * back the same way, so saving and loading is a single pass over the
+ * file.
+ *
+ * The file is removed after it has been loaded, in the same way as
+ * the statistics file, and when the background worker starts while the
+ * memory view is already in use, so that a crash does not bring back
+ * a stale copy of the memory view. The whole file is checked before
+ * anything is loaded, so a file that cannot be used does not leave a
+ * partially loaded memory view behind.
+ *
+ * Saving on shutdown is done by a background worker, which is
+ * registered when the library is in shared_preload_libraries. The
+ * background worker also sets up the shared memory state at startup,
+ * so the file is loaded before it is needed by a backend.
+ */
+
+#include "memview.h"
+
+#include <postgres.h>
+#include <fmgr.h>
+
+#include <miscadmin.h>
+
+#include <pgstat.h>
+#include <port/pg_crc32c.h>
+#include <postmaster/bgworker.h>
+#include <postmaster/interrupt.h>
+#include <storage/fd.h>
+#include <storage/ipc.h>
+#include <storage/latch.h>
+#include <utils/guc.h>
+
+PG_FUNCTION_INFO_V1(memview_save);
+
+#define MEMVIEW_FILE "memview.dat"
+#define MEMVIEW_FILE_MAGIC 0x4D564945 /* "MVIE" */
+#define MEMVIEW_FILE_VERSION 3
+
+/* The file was written on shutdown */
+#define MEMVIEW_FILE_SHUTDOWN 0x0001
+
+/*
+ * Header of the memory view file.
+ *
+ * The file is only read by the same server that wrote it, so the
+ * data is stored in native byte order.
+ */
+typedef struct MemoryViewFileHeader {
+  uint32 magic;
+  uint32 version;
+  uint32 flags;
+  uint64 size;    /* Size of the data following the header */
+  pg_crc32c crc;  /* Checksum of the data following the header */
+} MemoryViewFileHeader;
+
+bool memview_persist = false;
+
+/*
+ * Read data from a buffer with the contents of the memory view file,
+ * or skip it if "data" is NULL.
+ *
+ * Returns false if there is not enough data left in the buffer.
+ */
+bool memview_file_try_read(StringInfo buf, void* data, size_t size) {
+  if (size > (size_t)(buf->len - buf->cursor))
+    return false;
+  if (data != NULL)
+    memcpy(data, buf->data + buf->cursor, size);
+  buf->cursor += size;
+  return true;
+}
+
+/*
+ * Read data from a buffer with the contents of the memory view file.
+ *
+ * The contents are checked before the data is loaded, so running out
+ * of data is an internal error.
+ */
+void memview_file_read(StringInfo buf, void* data, size_t size) {
+  if (!memview_file_try_read(buf, data, size))
+    ereport(ERROR,
+            (errcode(ERRCODE_DATA_CORRUPTED),
+             errmsg("memory view file \"%s\" is truncated", MEMVIEW_FILE)));
+}
+
+/*
+ * Write the memory view to the file.
+ *
+ * The file is written to a temporary file first and then renamed, so
+ * a crash while writing does not leave a partial file behind. Only
+ * files written on shutdown are loaded on startup.
+ */
+void memview_file_save(bool shutdown) {
+  MemoryViewSession* session = memview_session_get();
+  MemoryViewFileHeader header = {
+      .magic = MEMVIEW_FILE_MAGIC,
+      .version = MEMVIEW_FILE_VERSION,
+      .flags = shutdown ? MEMVIEW_FILE_SHUTDOWN : 0,
+  };
+  char tmpfile[MAXPGPATH];
+  StringInfoData buf;
+  int fd;
+
+  initStringInfo(&buf);
+  memview_save_records(session, &buf);
+  memview_named_save(session, &buf);
+
+  header.size = buf.len;
+  INIT_CRC32C(header.crc);
+  COMP_CRC32C(header.crc, buf.data, buf.len);
+  FIN_CRC32C(header.crc);
+
+  snprintf(tmpfile, sizeof(tmpfile), "%s.%d.tmp", MEMVIEW_FILE, MyProcPid);
+  fd = OpenTransientFile(tmpfile, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY);
+  if (fd < 0)
+    ereport(ERROR,
+            (errcode_for_file_access(),
+             errmsg("could not create file \"%s\": %m", tmpfile)));
+
+  errno = 0;
+  if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+      write(fd, buf.data, buf.len) != buf.len) {
+    /* If write didn't set errno, assume problem is no disk space */
+    if (errno == 0)
+      errno = ENOSPC;
+    ereport(ERROR,
+            (errcode_for_file_access(),
+             errmsg("could not write file \"%s\": %m", tmpfile)));
+  }
+
+  if (pg_fsync(fd) != 0)
+    ereport(ERROR,
+            (errcode_for_file_access(),
+             errmsg("could not fsync file \"%s\": %m", tmpfile)));
+
+  if (CloseTransientFile(fd) != 0)
+    ereport(ERROR,
+            (errcode_for_file_access(),
+             errmsg("could not close file \"%s\": %m", tmpfile)));
+
+  durable_rename(tmpfile, MEMVIEW_FILE, ERROR);
+
+  ereport(LOG,
+          (errmsg("saved memory view to \"%s\"", MEMVIEW_FILE),
+           errdetail("Wrote %zu bytes.", sizeof(header) + buf.len)));
+
+  pfree(buf.data);
+}
+
+/*
+ * Load the memory view from the file, if there is one.
+ *
+ * This is called when the shared memory state is set up, so nobody
+ * else is using the memory view yet. A file that cannot be used is
+ * ignored with a warning rather than preventing the memory view from
+ * being used.
+ */
+void memview_file_load(MemoryViewSession* session) {
+  MemoryViewFileHeader header;
+  StringInfoData buf;
+  pg_crc32c crc;
+  int fd;
+
+  fd = OpenTransientFile(MEMVIEW_FILE, O_RDONLY | PG_BINARY);
+  if (fd < 0) {
+    if (errno != ENOENT)
+      ereport(WARNING,
+              (errcode_for_file_access(),
+               errmsg("could not open file \"%s\": %m", MEMVIEW_FILE)));
+    return;
+  }
+
+  if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+      header.magic != MEMVIEW_FILE_MAGIC ||
+      header.version != MEMVIEW_FILE_VERSION || header.size > MaxAllocSize) {
+    ereport(WARNING,
+            (errmsg("ignoring memory view file \"%s\"", MEMVIEW_FILE),
+             errdetail("The file header is not valid.")));
+    CloseTransientFile(fd);
+    return;
+  }
+
+  if ((header.flags & MEMVIEW_FILE_SHUTDOWN) == 0) {
+    ereport(LOG,
+            (errmsg("removing memory view file \"%s\"", MEMVIEW_FILE),
+             errdetail("The file was not written on shutdown.")));
+    CloseTransientFile(fd);
+    memview_file_remove();
+    return;
+  }
+
+  initStringInfo(&buf);
+  enlargeStringInfo(&buf, header.size);
+  if (read(fd, buf.data, header.size) != (ssize_t)header.size) {
+    ereport(WARNING,
+            (errmsg("ignoring memory view file \"%s\"", MEMVIEW_FILE),
+             errdetail("The file is truncated.")));
+    CloseTransientFile(fd);
+    pfree(buf.data);
+    return;
+  }
+  buf.len = header.size;
+  CloseTransientFile(fd);
+
+  INIT_CRC32C(crc);
+  COMP_CRC32C(crc, buf.data, buf.len);
+  FIN_CRC32C(crc);
+  if (!EQ_CRC32C(crc, header.crc)) {
+    ereport(WARNING,
+            (errmsg("ignoring memory view file \"%s\"", MEMVIEW_FILE),
+             errdetail("The checksum of the file is not valid.")));
+    pfree(buf.data);
+    return;
+  }
+
+  if (!memview_check_records(&buf) || !memview_named_check(&buf)) {
+    ereport(WARNING,
+            (errmsg("ignoring memory view file \"%s\"", MEMVIEW_FILE),
+             errdetail("The contents of the file are not valid.")));
+    pfree(buf.data);
+    return;
+  }
+
+  buf.cursor = 0;
+  memview_load_records(session, &buf);
+  memview_named_load(session, &buf);
+
+  ereport(LOG,
+          (errmsg("loaded memory view from \"%s\"", MEMVIEW_FILE),
+           errdetail("Read %zu bytes.", sizeof(header) + buf.len)));
+
+  pfree(buf.data);
+  memview_file_remove();
+}
+
+/*
+ * Remove the file, if there is one.
+ */
+void memview_file_remove(void) {
+  if (unlink(MEMVIEW_FILE) < 0 && errno != ENOENT)
+    ereport(WARNING,
+            (errcode_for_file_access(),
+             errmsg("could not remove file \"%s\": %m", MEMVIEW_FILE)));
+}
+
+/*
+ * Save the memory view on demand.
+ *
+ * The file is only loaded on startup when persistence is enabled, so
+ * saving it otherwise would leave a stale file behind. The file is not
+ * marked as written on shutdown, so it is removed rather than loaded
+ * on the next startup.
+ */
+Datum memview_save(PG_FUNCTION_ARGS) {
+  if (!memview_persist)
+    ereport(ERROR,
+            (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+             errmsg("memory view persistence is not enabled"),
+             errhint("Set \"memview.persist\" to on and restart the "
+                     "server.")));
+
+  memview_file_save(false);
+  PG_RETURN_VOID();
+}
+
+/*
+ * Register the background worker that saves the memory view on
+ * shutdown.
+ */
+void memview_persist_register(void) {
+  BackgroundWorker worker;
+
+  memset(&worker, 0, sizeof(worker));
+  worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+  worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+  worker.bgw_restart_time = 10;
+  snprintf(worker.bgw_library_name, MAXPGPATH, "memview");
+  snprintf(worker.bgw_function_name, BGW_MAXLEN, "memview_persist_main");
+  snprintf(worker.bgw_name, BGW_MAXLEN, "memview persistence");
+  snprintf(worker.bgw_type, BGW_MAXLEN, "memview persistence");
+  RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * Main function for the persistence background worker.
+ *
+ * Setting up the session loads the file, if there is one, and then we
+ * wait until we are asked to shut down, at which point the memory view
+ * is saved.
+ *
+ * A file that is still around once the session is set up was written
+ * while the memory view was in use, so it is removed to avoid loading
+ * it after a crash. We exit with 1 after saving, so that the worker is
+ * restarted if it was terminated while the server is running.
+ */
+void memview_persist_main(Datum main_arg) {
+  pqsignal(SIGHUP, SignalHandlerForConfigReload);
+  pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+  BackgroundWorkerUnblockSignals();
+
+  if (IsBinaryUpgrade)
+    proc_exit(0);
+
+  memview_session_get();
+  memview_file_remove();
+
+  while (!ShutdownRequestPending) {
+    (void)WaitLatch(MyLatch,
+                    WL_LATCH_SET | WL_EXIT_ON_PM_DEATH,
+                    -1L,
+                    PG_WAIT_EXTENSION);
+    ResetLatch(MyLatch);
+
+    if (ConfigReloadPending) {
+      ConfigReloadPending = false;
+      ProcessConfigFile(PGC_SIGHUP);
+    }
+  }
+
+  memview_file_save(true);
+  proc_exit(1);
+}
@@ -17,10 +17,21 @@ select row_id from memview where descr = 'with magic' limit 1 \gset
 select memview_row_update(:row_id, 'wizard'::regrole, 'less magic');
 select owner, descr from memview;
 
--- Test delete function. Note that the row id changes since the table
--- is compacted.
+-- Test delete function. Note that the row id of the remaining row
+-- does not change since rows are never moved.
+select row_id as more_id from memview where descr = 'more magic' \gset
 select memview_row_delete(:row_id);
 select owner, descr from memview;
+select row_id = :more_id as same_row_id from memview where descr = 'more magic';
+
+-- Deleting a row that does not exist is an error.
+\set ON_ERROR_STOP 0
+select memview_row_delete(-1);
+\set ON_ERROR_STOP 1
+
+-- Compaction does not change row ids either.
+call memview_view_compact();
+select row_id = :more_id as same_row_id from memview where descr = 'more magic';
 
 select memview_row_delete(row_id) from memview;
 drop view memview;
@@ -0,0 +1,132 @@
+create role wizard;
+create role unicorn;
+
+create view memview as
+select row_id, owner::regrole, descr, expires_at
+from memview_view_scan() v(row_id, dboid, owner, descr, expires_at)
+where dboid = (select oid from pg_database where datname = current_database());
+
+-- Test array-based functions.
+select memview_row_insert_many(array['wizard'::regrole, 'wizard'::regrole]::oid[],
+                               array['with magic', 'more magic']::name[]);
+select owner, descr from memview order by descr;
+select memview_row_update_many(array_agg(row_id),
+                               array_agg('unicorn'::regrole::oid),
+                               array_agg(descr))
+from memview;
+select owner, descr from memview order by descr;
+select memview_row_delete_many(array_agg(row_id)) from memview;
+select count(*) from memview;
+
+-- Arrays of different lengths are an error.
+\set ON_ERROR_STOP 0
+select memview_row_insert_many(array['wizard'::regrole]::oid[], array[]::name[]);
+\set ON_ERROR_STOP 1
+
+-- The array-based functions take an optional array with the expiry
+-- time of each row, where null means that no expiry time is given.
+select memview_row_insert_many(array['wizard'::regrole, 'wizard'::regrole,
+                                     'wizard'::regrole]::oid[],
+                               array['expired', 'leased', 'forever']::name[],
+                               array[now() - interval '1 hour',
+                                     now() + interval '1 hour', null]);
+select owner, descr, expires_at is not null as expiring
+  from memview order by descr;
+select memview_row_update_many(array_agg(row_id order by descr),
+                               array_agg(owner::oid order by descr),
+                               array_agg(descr order by descr),
+                               array[now() + interval '1 hour', 'infinity'])
+from memview;
+select owner, descr, expires_at is not null as expiring
+  from memview order by descr;
+select memview_expire_now();
+select memview_row_delete_many(array_agg(row_id)) from memview;
+
+-- Test batch triggers. The rows are collected by the row-level
+-- triggers and applied by the statement-level trigger.
+create trigger memview_insert
+   instead of insert on memview
+   for each row
+   execute function memview_insert_row_batch_tgfunc(owner, descr);
+
+create trigger memview_update
+   instead of update on memview
+   for each row
+   execute function memview_update_row_batch_tgfunc(row_id, owner, descr);
+
+create trigger memview_delete
+   instead of delete on memview
+   for each row
+   execute function memview_delete_row_batch_tgfunc(row_id);
+
+create trigger memview_apply
+   after insert or update or delete on memview
+   for each statement
+   execute function memview_apply_batch_tgfunc();
+
+insert into memview(owner, descr)
+select 'wizard'::regrole, 'magic ' || n from generate_series(1,2000) n;
+select count(*) from memview;
+update memview set owner = 'unicorn' where descr like 'magic 1%';
+select owner::text as owner, count(*) from memview group by 1 order by 1;
+delete from memview where owner = 'unicorn';
+select count(*) from memview;
+
+-- Updating the row id should not be possible so check that.
+\set ON_ERROR_STOP 0
+update memview set row_id = row_id + 1;
+\set ON_ERROR_STOP 1
+
+delete from memview;
+select count(*) from memview;
+
+-- A subtransaction that is rolled back while the rows are collected,
+-- here by an exception block, only discards the rows it added itself.
+create function safe_descr(n integer) returns name as $$
+begin
+  perform 1 / (n % 2);
+  return 'safe ' || n;
+exception when division_by_zero then
+  return 'caught ' || n;
+end;
+$$ language plpgsql;
+
+insert into memview(owner, descr)
+select 'wizard'::regrole, safe_descr(n) from generate_series(1,4) n;
+select owner, descr from memview order by descr;
+delete from memview;
+drop function safe_descr(integer);
+
+-- The insert and update triggers take the column name of the expiry
+-- time as an optional last parameter.
+drop trigger memview_insert on memview;
+drop trigger memview_update on memview;
+
+create trigger memview_insert
+   instead of insert on memview
+   for each row
+   execute function memview_insert_row_batch_tgfunc(owner, descr, expires_at);
+
+create trigger memview_update
+   instead of update on memview
+   for each row
+   execute function memview_update_row_batch_tgfunc(row_id, owner, descr,
+                                                    expires_at);
+
+insert into memview(owner, descr, expires_at)
+values ('wizard', 'expired', now() - interval '1 hour'),
+       ('wizard', 'leased', now() + interval '1 hour'),
+       ('wizard', 'forever', null);
+select owner, descr, expires_at is not null as expiring
+  from memview order by descr;
+update memview set expires_at = 'infinity' where descr = 'leased';
+update memview set expires_at = now() + interval '1 hour'
+ where descr = 'forever';
+select owner, descr, expires_at is not null as expiring
+  from memview order by descr;
+select memview_expire_now();
+delete from memview;
+
+drop view memview;
+drop role wizard;
+drop role unicorn;
@@ -0,0 +1,40 @@
+create role wizard;
+create role unicorn;
+
+select memview_change_position() as start \gset
+
+select memview_row_insert_many(array['wizard'::regrole, 'wizard'::regrole]::oid[],
+                               array['with magic', 'more magic']::name[]);
+select row_id as magic_id from memview_changes(:start)
+ where description = 'with magic' \gset
+select memview_row_update(:magic_id, 'unicorn'::regrole, 'less magic');
+select memview_row_delete(:magic_id);
+
+select position - :start as position, operation, owner::regrole, description
+  from memview_changes(:start);
+
+-- There are changes after the start, so this should not wait.
+select memview_changes_wait(:start, 0);
+
+-- There are no changes after the last position, so this should time
+-- out.
+select memview_change_position() as last \gset
+select memview_changes_wait(:last, 10);
+select count(*) from memview_changes(:last);
+
+-- Resetting the memory view is also a change.
+call memview_view_reset();
+select position - :last as position, operation, row_id, owner, description
+  from memview_changes(:last);
+
+-- Positions after the last change are not in the change log. The
+-- positions depend on earlier tests, so only show the error code.
+\set ON_ERROR_STOP 0
+\set VERBOSITY sqlstate
+select * from memview_changes(:last + 2);
+select * from memview_changes(-1);
+\set VERBOSITY default
+\set ON_ERROR_STOP 1
+
+drop role wizard;
+drop role unicorn;
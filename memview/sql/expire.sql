@@ -0,0 +1,60 @@
+create role wizard;
+
+create view memview as
+select row_id, owner::regrole, descr, expires_at
+from memview_view_scan() v(row_id, dboid, owner, descr, expires_at)
+where dboid = (select oid from pg_database where datname = current_database());
+
+-- Rows that have expired are not visible, even if they have not been
+-- removed yet.
+select memview_row_insert('wizard'::regrole, 'forever');
+select memview_row_insert('wizard'::regrole, 'expired', now() - interval '1 hour');
+select memview_row_insert('wizard'::regrole, 'leased', now() + interval '1 hour');
+select owner, descr, expires_at is not null as expiring
+  from memview order by descr;
+
+-- Updating a row without an expiry time keeps the expiry time, and
+-- an infinite expiry time means that the row never expires.
+select row_id from memview where descr = 'leased' \gset
+select memview_row_update(:row_id, 'wizard'::regrole, 'renewed');
+select owner, descr, expires_at is not null as expiring
+  from memview order by descr;
+select memview_row_update(:row_id, 'wizard'::regrole, 'renewed', 'infinity');
+select owner, descr, expires_at is not null as expiring
+  from memview order by descr;
+
+-- Rows that have expired cannot be updated or deleted. The row ids
+-- depend on earlier tests, so only show the error code.
+select memview_row_update(:row_id, 'wizard'::regrole, 'expired', '-infinity');
+select owner, descr, expires_at is not null as expiring
+  from memview order by descr;
+\set ON_ERROR_STOP 0
+\set VERBOSITY sqlstate
+select memview_row_update(:row_id, 'wizard'::regrole, 'revived');
+select memview_row_delete(:row_id);
+\set VERBOSITY default
+\set ON_ERROR_STOP 1
+
+-- The expiry time can also be given to the insert trigger.
+create trigger memview_insert
+   instead of insert on memview
+   for each row
+   execute function memview_insert_row_tgfunc(owner, descr, expires_at);
+
+insert into memview(owner, descr, expires_at)
+values ('wizard'::regrole, 'trigger lease', now() + interval '1 hour'),
+       ('wizard'::regrole, 'trigger expired', now() - interval '1 hour');
+select owner, descr, expires_at is not null as expiring
+  from memview order by descr;
+
+-- Removing the expired rows frees their slots without changing what
+-- is visible.
+select records as before from memview_stats_records() \gset
+select memview_expire_now();
+select owner, descr, expires_at is not null as expiring
+  from memview order by descr;
+select :before - records as removed from memview_stats_records();
+
+call memview_view_reset();
+drop view memview;
+drop role wizard;
@@ -0,0 +1,61 @@
+create role wizard;
+create role unicorn;
+
+create foreign table memview_table (
+  row_id integer,
+  dboid oid,
+  owner regrole,
+  description name
+) server memview_server;
+
+select memview_row_insert_many(
+  array['wizard'::regrole, 'wizard'::regrole, 'unicorn'::regrole]::oid[],
+  array['first', 'second', 'third']::name[]);
+select count(*) from memview_table;
+
+select row_id as first_id from memview_table where description = 'first' \gset
+select row_id as third_id from memview_table where description = 'third' \gset
+
+-- Lookup using row identifiers.
+select owner, description from memview_table where row_id = :first_id;
+select owner, description from memview_table
+ where row_id in (:first_id, :third_id, -1) order by description;
+select count(*) from memview_table
+ where row_id = :first_id and row_id = :third_id;
+
+-- Lookup using owners.
+select owner, description from memview_table
+ where owner = 'wizard'::regrole order by description;
+select owner, description from memview_table
+ where owner in ('wizard'::regrole, 'unicorn'::regrole) order by description;
+
+-- Changing the owner of a row moves it in the owner index.
+select memview_row_update(:first_id, 'unicorn'::regrole, 'first');
+select owner, description from memview_table
+ where owner = 'unicorn'::regrole order by description;
+select memview_row_delete(:third_id);
+select owner, description from memview_table
+ where owner = 'unicorn'::regrole order by description;
+
+-- Lookup using database. Only rows for the current database are
+-- visible.
+select count(*) from memview_table where dboid = 0;
+select count(*) from memview_table
+ where dboid = (select oid from pg_database where datname = current_database());
+
+-- Check that the restrictions are pushed down to the scan.
+explain (costs off) select * from memview_table where row_id = 1;
+
+-- Columns with the wrong type are rejected.
+create foreign table memview_bad (row_id text) server memview_server;
+\set ON_ERROR_STOP 0
+select * from memview_bad;
+\set ON_ERROR_STOP 1
+drop foreign table memview_bad;
+
+select memview_row_delete_many(array_agg(row_id)) from memview_table;
+select count(*) from memview_table;
+
+drop foreign table memview_table;
+drop role wizard;
+drop role unicorn;
@@ -0,0 +1,34 @@
+create role wizard;
+create role unicorn;
+create role apprentice in role wizard;
+
+create view memview as
+select owner::regrole, descr
+from memview_view_scan(true) v(row_id, dboid, owner, descr);
+grant select on memview to public;
+
+select memview_row_insert_many(
+  array['wizard'::regrole, 'unicorn'::regrole, 'apprentice'::regrole]::oid[],
+  array['spell', 'horn', 'broom']::name[]);
+
+-- A superuser is a member of all roles, so all rows are visible.
+select owner, descr from memview order by descr;
+
+-- Other roles only see the rows of the roles they are members of.
+set role apprentice;
+select owner, descr from memview order by descr;
+set role unicorn;
+select owner, descr from memview order by descr;
+reset role;
+
+-- Membership changes are visible in the next scan.
+revoke wizard from apprentice;
+set role apprentice;
+select owner, descr from memview order by descr;
+reset role;
+
+call memview_view_reset();
+drop view memview;
+drop role apprentice;
+drop role wizard;
+drop role unicorn;
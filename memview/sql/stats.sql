@@ -0,0 +1,46 @@
+create role wizard;
+
+call memview_view_reset();
+select memview_stats_reset();
+
+-- Timing is off by default, so only the operations, rows, and lock
+-- waits are counted.
+select memview_row_insert_many(
+  array['wizard'::regrole, 'wizard'::regrole, 'wizard'::regrole]::oid[],
+  array['one', 'two', 'three']::name[]);
+select memview_row_update_many(array_agg(row_id),
+                               array_agg(owner),
+                               array_agg(descr || ' more'))
+from memview_view_scan() v(row_id, dboid, owner, descr)
+where descr <> 'three';
+select memview_row_delete(row_id)
+from memview_view_scan() v(row_id, dboid, owner, descr)
+where descr = 'three';
+
+select operation, calls, rows, total_time,
+       latency = array_fill(0::bigint, array[16]) as untimed
+  from memview_stats();
+select records, max_records, slots from memview_stats_records();
+
+-- Resetting the memory view counts the removed rows, but keeps the
+-- high-water mark.
+call memview_view_reset();
+select operation, calls, rows from memview_stats() where operation = 'reset';
+select records, max_records, slots from memview_stats_records();
+
+-- With timing on, the operations are counted in the histogram.
+set memview.track_timing to on;
+select memview_row_insert('wizard'::regrole, 'timed');
+select operation, calls, total_time > 0 as timed,
+       (select sum(n) from unnest(latency) n) as latency
+  from memview_stats() where operation = 'insert';
+reset memview.track_timing;
+
+-- Resetting the statistics clears the counters and sets the
+-- high-water mark to the current number of records.
+select memview_stats_reset();
+select sum(calls) from memview_stats();
+select records, max_records from memview_stats_records();
+
+call memview_view_reset();
+drop role wizard;
@@ -0,0 +1,37 @@
+create type magic as (wizard text, spell text, power integer);
+
+select memview_create('spells', 'magic');
+
+select memview_insert('spells', row('merlin', 'fireball', 10)::magic) as merlin_id \gset
+select memview_insert('spells', row('gandalf', repeat('you shall not pass ', 100), 100)::magic) as gandalf_id \gset
+select memview_insert('spells', row('morgana', null, 5)::magic) as morgana_id \gset
+
+select (data).wizard, length((data).spell), (data).power
+  from memview_scan('spells', null::magic) order by 1;
+
+select memview_update('spells', :merlin_id, row('merlin', 'lightning', 20)::magic);
+select memview_delete('spells', :morgana_id);
+
+select (data).* from memview_scan('spells', null::magic) where row_id = :merlin_id;
+select count(*) from memview_scan('spells', null::magic);
+
+-- Row identifiers are reused after a delete.
+select memview_insert('spells', row('morgan', 'curse', 3)::magic) = :morgana_id;
+
+-- Errors for missing views, wrong row types, and missing rows.
+\set ON_ERROR_STOP 0
+select memview_create('spells', 'magic');
+select memview_create('numbers', 'integer');
+select memview_insert('nothing', row('merlin', 'fireball', 10)::magic);
+select memview_insert('spells', row(1, 2));
+select * from memview_scan('spells', null::pg_class);
+select memview_delete('spells', 4711);
+\set ON_ERROR_STOP 1
+
+select memview_drop('spells');
+
+\set ON_ERROR_STOP 0
+select * from memview_scan('spells', null::magic);
+\set ON_ERROR_STOP 1
+
+drop type magic;
@@ -0,0 +1,278 @@
+/*
+ * Copyright 2025 Mats Kindahl.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you
+ * may not use this file except in compliance with the License.  You
+ * may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+/*
+ * Statistics for the memory view.
+ *
+ * Each partition has counters for inserts, updates, deletes, expired
+ * rows, scans, and resets, which are shown by memview_stats(). The
+ * lock waits reported by PostgreSQL only show that backends wait for
+ * a lock in the "memview" tranche, so the counters also keep track of
+ * the waits for each kind of operation, which tells what the
+ * contention is caused by.
+ *
+ * Measuring time has a cost, so the times and the latency histograms
+ * are only collected if "memview.track_timing" is on.
+ */
+
+#include "memview.h"
+
+#include <postgres.h>
+#include <fmgr.h>
+
+#include <funcapi.h>
+#include <miscadmin.h>
+
+#include <catalog/pg_type.h>
+#include <port/pg_bitutils.h>
+#include <utils/array.h>
+#include <utils/builtins.h>
+#include <utils/timestamp.h>
+
+PG_FUNCTION_INFO_V1(memview_stats);
+PG_FUNCTION_INFO_V1(memview_stats_records);
+PG_FUNCTION_INFO_V1(memview_stats_reset);
+
+bool memview_track_timing = false;
+
+static const char* const memview_stats_names[] = {
+    [MEMVIEW_STATS_INSERT] = "insert",
+    [MEMVIEW_STATS_UPDATE] = "update",
+    [MEMVIEW_STATS_DELETE] = "delete",
+    [MEMVIEW_STATS_EXPIRE] = "expire",
+    [MEMVIEW_STATS_SCAN] = "scan",
+    [MEMVIEW_STATS_RESET] = "reset",
+};
+
+/*
+ * Clear the counters of a single kind of operation.
+ */
+static void memview_op_stats_clear(MemoryViewOpStats* op) {
+  pg_atomic_write_u64(&op->calls, 0);
+  pg_atomic_write_u64(&op->rows, 0);
+  pg_atomic_write_u64(&op->lock_waits, 0);
+  pg_atomic_write_u64(&op->lock_wait_time, 0);
+  pg_atomic_write_u64(&op->lock_hold_time, 0);
+  pg_atomic_write_u64(&op->total_time, 0);
+  for (int i = 0; i < MEMVIEW_STATS_BUCKETS; ++i)
+    pg_atomic_write_u64(&op->latency[i], 0);
+}
+
+/*
+ * Initialize the statistics of a new partition.
+ */
+void memview_stats_init(MemoryViewStats* stats) {
+  for (int kind = 0; kind < MEMVIEW_STATS_KINDS; ++kind) {
+    MemoryViewOpStats* op = &stats->ops[kind];
+
+    pg_atomic_init_u64(&op->calls, 0);
+    pg_atomic_init_u64(&op->rows, 0);
+    pg_atomic_init_u64(&op->lock_waits, 0);
+    pg_atomic_init_u64(&op->lock_wait_time, 0);
+    pg_atomic_init_u64(&op->lock_hold_time, 0);
+    pg_atomic_init_u64(&op->total_time, 0);
+    for (int i = 0; i < MEMVIEW_STATS_BUCKETS; ++i)
+      pg_atomic_init_u64(&op->latency[i], 0);
+  }
+  pg_atomic_init_u64(&stats->max_records, 0);
+  pg_atomic_init_u64(&stats->reset_time, GetCurrentTimestamp());
+}
+
+/*
+ * Get the start time of an operation.
+ *
+ * The time is only read if timing is enabled, otherwise it is zero.
+ */
+void memview_stats_start(instr_time* start) {
+  if (memview_track_timing)
+    INSTR_TIME_SET_CURRENT(*start);
+  else
+    INSTR_TIME_SET_ZERO(*start);
+}
+
+/*
+ * Count an operation that started at "start".
+ *
+ * The rows are counted by the operation itself since not all
+ * operations affect a row.
+ */
+void memview_stats_count(MemoryViewStatsCounts* counts,
+                         const instr_time* start) {
+  ++counts->calls;
+
+  if (memview_track_timing && !INSTR_TIME_IS_ZERO(*start)) {
+    instr_time duration;
+    uint64 usec;
+    int bucket = 0;
+
+    INSTR_TIME_SET_CURRENT(duration);
+    INSTR_TIME_SUBTRACT(duration, *start);
+    INSTR_TIME_ADD(counts->total_time, duration);
+
+    usec = INSTR_TIME_GET_MICROSEC(duration);
+    if (usec > 1)
+      bucket = Min(pg_leftmost_one_pos64(usec), MEMVIEW_STATS_BUCKETS - 1);
+    ++counts->latency[bucket];
+  }
+}
+
+/*
+ * Add counters collected in backend-local memory to the shared
+ * counters of a partition.
+ */
+void memview_stats_add(MemoryViewStats* stats,
+                       MemoryViewStatsKind kind,
+                       const MemoryViewStatsCounts* counts) {
+  MemoryViewOpStats* op = &stats->ops[kind];
+
+  if (counts->calls == 0)
+    return;
+
+  pg_atomic_fetch_add_u64(&op->calls, counts->calls);
+  if (counts->rows > 0)
+    pg_atomic_fetch_add_u64(&op->rows, counts->rows);
+  if (counts->lock_waits > 0)
+    pg_atomic_fetch_add_u64(&op->lock_waits, counts->lock_waits);
+
+  if (!INSTR_TIME_IS_ZERO(counts->total_time)) {
+    pg_atomic_fetch_add_u64(&op->lock_wait_time,
+                            INSTR_TIME_GET_NANOSEC(counts->lock_wait_time));
+    pg_atomic_fetch_add_u64(&op->lock_hold_time,
+                            INSTR_TIME_GET_NANOSEC(counts->lock_hold_time));
+    pg_atomic_fetch_add_u64(&op->total_time,
+                            INSTR_TIME_GET_NANOSEC(counts->total_time));
+    for (int i = 0; i < MEMVIEW_STATS_BUCKETS; ++i)
+      if (counts->latency[i] > 0)
+        pg_atomic_fetch_add_u64(&op->latency[i], counts->latency[i]);
+  }
+}
+
+/*
+ * Convert a time in nanoseconds to milliseconds.
+ */
+static Datum memview_stats_msec(pg_atomic_uint64* nsec) {
+  return Float8GetDatum(pg_atomic_read_u64(nsec) / 1000000.0);
+}
+
+/*
+ * Get the statistics for the partition of the current database, with
+ * one row for each kind of operation.
+ *
+ * The counters are read one at a time without a lock, so the counters
+ * of a row might not be entirely consistent with each other if
+ * operations are running concurrently.
+ */
+Datum memview_stats(PG_FUNCTION_ARGS) {
+  FuncCallContext* funcctx;
+  MemoryViewStats* stats;
+
+  if (SRF_IS_FIRSTCALL()) {
+    TupleDesc tupdesc;
+
+    funcctx = SRF_FIRSTCALL_INIT();
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+      ereport(ERROR,
+              (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+               errmsg("function returning record called in context "
+                      "that cannot accept type record")));
+
+    funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+    funcctx->max_calls = MEMVIEW_STATS_KINDS;
+    funcctx->user_fctx = &memview_session_get()->header->stats;
+  }
+
+  funcctx = SRF_PERCALL_SETUP();
+  stats = funcctx->user_fctx;
+
+  if (funcctx->call_cntr < funcctx->max_calls) {
+    MemoryViewOpStats* op = &stats->ops[funcctx->call_cntr];
+    Datum latency[MEMVIEW_STATS_BUCKETS];
+    bool nulls[8] = {0};
+    Datum values[8] = {0};
+    HeapTuple tuple;
+
+    for (int i = 0; i < MEMVIEW_STATS_BUCKETS; ++i)
+      latency[i] = Int64GetDatum(pg_atomic_read_u64(&op->latency[i]));
+
+    values[0] = CStringGetTextDatum(memview_stats_names[funcctx->call_cntr]);
+    values[1] = Int64GetDatum(pg_atomic_read_u64(&op->calls));
+    values[2] = Int64GetDatum(pg_atomic_read_u64(&op->rows));
+    values[3] = Int64GetDatum(pg_atomic_read_u64(&op->lock_waits));
+    values[4] = memview_stats_msec(&op->lock_wait_time);
+    values[5] = memview_stats_msec(&op->lock_hold_time);
+    values[6] = memview_stats_msec(&op->total_time);
+    values[7] = PointerGetDatum(
+        construct_array_builtin(latency, MEMVIEW_STATS_BUCKETS, INT8OID));
+
+    tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+  }
+
+  SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * Get the number of records in the partition of the current database
+ * together with the high-water mark since the statistics were reset.
+ */
+Datum memview_stats_records(PG_FUNCTION_ARGS) {
+  MemoryViewHeader* header = memview_session_get()->header;
+  uint64 nrecords = header->nrecords;
+  uint64 max_records = pg_atomic_read_u64(&header->stats.max_records);
+  TupleDesc tupdesc;
+  bool nulls[4] = {0};
+  Datum values[4] = {0};
+
+  if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+    ereport(ERROR,
+            (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+             errmsg("function returning record called in context "
+                    "that cannot accept type record")));
+
+  /* Records loaded from the file are not counted by inserts, so the
+   * number of records can be above the high-water mark. */
+  values[0] = Int64GetDatum(nrecords);
+  values[1] = Int64GetDatum(Max(nrecords, max_records));
+  values[2] = Int64GetDatum(header->nslots);
+  values[3] =
+      TimestampTzGetDatum(pg_atomic_read_u64(&header->stats.reset_time));
+
+  PG_RETURN_DATUM(HeapTupleGetDatum(
+      heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+/*
+ * Reset the statistics for the partition of the current database.
+ *
+ * The high-water mark is set to the current number of records while
+ * holding the allocation lock, which inserts hold while they update
+ * it.
+ */
+Datum memview_stats_reset(PG_FUNCTION_ARGS) {
+  MemoryViewHeader* header = memview_session_get()->header;
+
+  for (int kind = 0; kind < MEMVIEW_STATS_KINDS; ++kind)
+    memview_op_stats_clear(&header->stats.ops[kind]);
+
+  LWLockAcquire(&header->alloc_lock, LW_EXCLUSIVE);
+  pg_atomic_write_u64(&header->stats.max_records, header->nrecords);
+  LWLockRelease(&header->alloc_lock);
+
+  pg_atomic_write_u64(&header->stats.reset_time, GetCurrentTimestamp());
+
+  PG_RETURN_VOID();
+}
@@ -0,0 +1,770 @@
+/*
+ * Copyright 2025 Mats Kindahl.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you
+ * may not use this file except in compliance with the License.  You
+ * may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+/*
+ * Named memory views.
+ *
+ * A named view stores rows of any composite type in the dynamic
+ * shared area. Views are created using memview_create() with a name
+ * and a row type, and are registered in a hash table in the dynamic
+ * shared area so that all backends connected to the same database can
+ * find them.
+ *
+ * Rows are stored as composite datums, which are flat copies of the
+ * tuple including all variable-length columns, so no pointers out of
+ * the dynamic shared area are stored. The row identifier is the slot
+ * number of the row, which remains the same for the lifetime of the
+ * row, and deleted slots are reused through a free list, just like
+ * for the records of the memory view.
+ *
+ * A backend using a view holds the lock on the registry entry in
+ * shared mode, which prevents the view from being dropped while it is
+ * used, and the lock of the view in shared or exclusive mode depending
+ * on whether it reads or modifies the view.
+ */
+
+#include "memview.h"
+
+#include <postgres.h>
+#include <fmgr.h>
+
+#include <funcapi.h>
+#include <miscadmin.h>
+
+#include <access/htup_details.h>
+#include <catalog/pg_type.h>
+#include <nodes/bitmapset.h>
+#include <storage/shmem.h>
+#include <utils/builtins.h>
+#include <utils/lsyscache.h>
+
+PG_FUNCTION_INFO_V1(memview_create);
+PG_FUNCTION_INFO_V1(memview_drop);
+PG_FUNCTION_INFO_V1(memview_insert);
+PG_FUNCTION_INFO_V1(memview_update);
+PG_FUNCTION_INFO_V1(memview_delete);
+PG_FUNCTION_INFO_V1(memview_scan);
+
+/* Number of slots allocated for a view when the first row is added */
+#define MEMVIEW_NAMED_INITIAL_SLOTS 64
+
+/*
+ * Slot of a named view.
+ *
+ * The tuple is an invalid pointer if the slot is not used, in which
+ * case the slot is in the free list.
+ */
+typedef struct MemoryViewNamedSlot {
+  dsa_pointer tuple;
+  int32 next_free;
+} MemoryViewNamedSlot;
+
+/*
+ * Named view header.
+ *
+ * The slots are stored in an array in the dynamic shared area that is
+ * doubled in size when it is full.
+ */
+typedef struct MemoryViewNamed {
+  LWLock lock;
+  size_t nrecords; /* Number of used slots */
+  size_t nslots;   /* High-water mark for slots */
+  size_t capacity; /* Number of allocated slots */
+  int32 free_slot; /* First slot in free list */
+  dsa_pointer slots;
+} MemoryViewNamed;
+
+/*
+ * Scan state for scanning a named view.
+ *
+ * The rows are copied when the scan starts, so the locks are not held
+ * while the rows are returned.
+ */
+typedef struct MemoryViewNamedScanState {
+  size_t nrows;
+  int32* row_ids;
+  Datum* rows;
+  size_t row;
+} MemoryViewNamedScanState;
+
+static void memview_named_key(MemoryViewNamedKey* key, Name name) {
+  memset(key, 0, sizeof(*key));
+  key->dboid = MyDatabaseId;
+  namestrcpy(&key->name, NameStr(*name));
+}
+
+/*
+ * Look up a named view in the registry.
+ *
+ * The registry entry is returned locked, which prevents the view from
+ * being dropped while it is used, so the caller need to release the
+ * lock using dshash_release_lock() when done with the view.
+ */
+static MemoryViewNamedEntry* memview_named_lookup(MemoryViewSession* session,
+                                                  Name name,
+                                                  bool exclusive) {
+  MemoryViewNamedKey key;
+  MemoryViewNamedEntry* entry;
+
+  memview_named_key(&key, name);
+  entry = dshash_find(session->views, &key, exclusive);
+  if (entry == NULL)
+    ereport(ERROR,
+            (errcode(ERRCODE_UNDEFINED_OBJECT),
+             errmsg("memory view \"%s\" does not exist", NameStr(*name))));
+  return entry;
+}
+
+/*
+ * Check that a row has the row type of the view.
+ *
+ * The lock on the registry entry is released if the check fails.
+ */
+static void memview_named_check_type(MemoryViewSession* session,
+                                     MemoryViewNamedEntry* entry,
+                                     Name name,
+                                     Oid typid) {
+  Oid expected = entry->typid;
+
+  if (typid != expected) {
+    dshash_release_lock(session->views, entry);
+    ereport(ERROR,
+            (errcode(ERRCODE_DATATYPE_MISMATCH),
+             errmsg("memory view \"%s\" has row type %s",
+                    NameStr(*name),
+                    format_type_be(expected)),
+             errdetail("Row has type %s.", format_type_be(typid))));
+  }
+}
+
+static MemoryViewNamedSlot* memview_named_slots(dsa_area* area,
+                                                MemoryViewNamed* view) {
+  return dsa_get_address(area, view->slots);
+}
+
+/*
+ * Get a used slot of the view.
+ *
+ * Returns NULL if there is no row with the row identifier. The caller
+ * need to hold the lock of the view.
+ */
+static MemoryViewNamedSlot* memview_named_slot(dsa_area* area,
+                                               MemoryViewNamed* view,
+                                               int32 row_id) {
+  MemoryViewNamedSlot* slot;
+
+  if (row_id < 0 || (size_t)row_id >= view->nslots)
+    return NULL;
+
+  slot = &memview_named_slots(area, view)[row_id];
+  return DsaPointerIsValid(slot->tuple) ? slot : NULL;
+}
+
+/*
+ * Copy a row into the dynamic shared area.
+ *
+ * The composite datum is flat, that is, it does not contain any
+ * pointers to values stored elsewhere, so we can copy it as it is.
+ */
+static dsa_pointer memview_named_store(dsa_area* area, HeapTupleHeader row) {
+  Size len = HeapTupleHeaderGetDatumLength(row);
+  dsa_pointer tuple = dsa_allocate(area, len);
+
+  memcpy(dsa_get_address(area, tuple), row, len);
+  return tuple;
+}
+
+/*
+ * Grow the slot array so that it has room for at least "nslots"
+ * slots. New slots are not used.
+ *
+ * The caller need to hold the lock of the view in exclusive mode.
+ */
+static void memview_named_grow(dsa_area* area,
+                               MemoryViewNamed* view,
+                               size_t nslots) {
+  size_t capacity = Max(2 * view->capacity, MEMVIEW_NAMED_INITIAL_SLOTS);
+  dsa_pointer slots;
+
+  capacity = Min(Max(capacity, nslots), MEMVIEW_MAX_RECORDS);
+  slots = dsa_allocate0(area, capacity * sizeof(MemoryViewNamedSlot));
+  if (DsaPointerIsValid(view->slots)) {
+    memcpy(dsa_get_address(area, slots),
+           memview_named_slots(area, view),
+           view->nslots * sizeof(MemoryViewNamedSlot));
+    dsa_free(area, view->slots);
+  }
+  view->slots = slots;
+  view->capacity = capacity;
+}
+
+/*
+ * Allocate a slot for a new row in the view.
+ *
+ * Slots are taken from the free list if there are any, otherwise a
+ * new slot is taken from the end, growing the slot array if
+ * necessary. Returns MEMVIEW_NO_SLOT if the view is full.
+ *
+ * The caller need to hold the lock of the view in exclusive mode.
+ */
+static int32 memview_named_allocate_slot(dsa_area* area,
+                                         MemoryViewNamed* view) {
+  int32 slot;
+
+  if (view->free_slot != MEMVIEW_NO_SLOT) {
+    slot = view->free_slot;
+    view->free_slot = memview_named_slots(area, view)[slot].next_free;
+  } else {
+    if (view->nslots >= (size_t)memview_max_records)
+      return MEMVIEW_NO_SLOT;
+
+    if (view->nslots == view->capacity)
+      memview_named_grow(area, view, view->nslots + 1);
+
+    slot = view->nslots++;
+  }
+
+  memview_named_slots(area, view)[slot].next_free = MEMVIEW_NO_SLOT;
+  ++view->nrecords;
+  return slot;
+}
+
+/*
+ * Allocate and initialize an empty view in the dynamic shared area.
+ */
+static dsa_pointer memview_named_allocate(dsa_area* area) {
+  dsa_pointer view_ptr = dsa_allocate0(area, sizeof(MemoryViewNamed));
+  MemoryViewNamed* view = dsa_get_address(area, view_ptr);
+
+  LWLockInitialize(&view->lock, memview_tranche_id());
+  view->free_slot = MEMVIEW_NO_SLOT;
+  view->slots = InvalidDsaPointer;
+  return view_ptr;
+}
+
+/*
+ * Create a named memory view.
+ */
+Datum memview_create(PG_FUNCTION_ARGS) {
+  MemoryViewSession* session = memview_session_get();
+  Name name = PG_GETARG_NAME(0);
+  Oid typid = PG_GETARG_OID(1);
+  MemoryViewNamedKey key;
+  MemoryViewNamedEntry* entry;
+  dsa_pointer view_ptr;
+  bool found;
+
+  if (get_typtype(typid) != TYPTYPE_COMPOSITE)
+    ereport(ERROR,
+            (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+             errmsg("type %s is not a composite type", format_type_be(typid))));
+
+  /* Allocate the view before adding the entry so that the entry is not
+   * left half-initialized if the allocation fails. */
+  view_ptr = memview_named_allocate(session->area);
+
+  memview_named_key(&key, name);
+  entry = dshash_find_or_insert(session->views, &key, &found);
+  if (found) {
+    dshash_release_lock(session->views, entry);
+    dsa_free(session->area, view_ptr);
+    ereport(ERROR,
+            (errcode(ERRCODE_DUPLICATE_OBJECT),
+             errmsg("memory view \"%s\" already exists", NameStr(*name))));
+  }
+
+  entry->typid = typid;
+  entry->view = view_ptr;
+  dshash_release_lock(session->views, entry);
+
+  PG_RETURN_VOID();
+}
+
+/*
+ * Drop a named memory view.
+ *
+ * Locking the registry entry in exclusive mode waits for all backends
+ * using the view to finish, except scans, which release the registry
+ * entry once they hold the lock of the view. Taking the lock of the
+ * view waits for them as well, and after that nobody can find the
+ * view, so we can free it directly.
+ */
+Datum memview_drop(PG_FUNCTION_ARGS) {
+  MemoryViewSession* session = memview_session_get();
+  MemoryViewNamedEntry* entry =
+      memview_named_lookup(session, PG_GETARG_NAME(0), true);
+  MemoryViewNamed* view = dsa_get_address(session->area, entry->view);
+
+  LWLockAcquire(&view->lock, LW_EXCLUSIVE);
+  LWLockRelease(&view->lock);
+
+  if (DsaPointerIsValid(view->slots)) {
+    MemoryViewNamedSlot* slots = memview_named_slots(session->area, view);
+    for (size_t slot = 0; slot < view->nslots; ++slot)
+      if (DsaPointerIsValid(slots[slot].tuple))
+        dsa_free(session->area, slots[slot].tuple);
+    dsa_free(session->area, view->slots);
+  }
+
+  dsa_free(session->area, entry->view);
+  dshash_delete_entry(session->views, entry);
+
+  PG_RETURN_VOID();
+}
+
+/*
+ * Insert a row into a named view, returning the row identifier.
+ */
+Datum memview_insert(PG_FUNCTION_ARGS) {
+  MemoryViewSession* session = memview_session_get();
+  Name name;
+  HeapTupleHeader row;
+  MemoryViewNamedEntry* entry;
+  MemoryViewNamed* view;
+  int32 slot;
+
+  if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+    ereport(ERROR,
+            (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+             errmsg("view name and row cannot be null")));
+
+  name = PG_GETARG_NAME(0);
+  row = PG_GETARG_HEAPTUPLEHEADER(1);
+
+  entry = memview_named_lookup(session, name, false);
+  memview_named_check_type(
+      session, entry, name, get_fn_expr_argtype(fcinfo->flinfo, 1));
+  view = dsa_get_address(session->area, entry->view);
+
+  LWLockAcquire(&view->lock, LW_EXCLUSIVE);
+  slot = memview_named_allocate_slot(session->area, view);
+  if (slot == MEMVIEW_NO_SLOT) {
+    size_t nrecords = view->nrecords;
+
+    LWLockRelease(&view->lock);
+    dshash_release_lock(session->views, entry);
+    ereport(ERROR,
+            (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+             errmsg("memory view \"%s\" is full", NameStr(*name)),
+             errdetail("The memory view contains %zu records.", nrecords),
+             errhint("You might need to increase \"memview.max_records\".")));
+  }
+  memview_named_slots(session->area, view)[slot].tuple =
+      memview_named_store(session->area, row);
+  LWLockRelease(&view->lock);
+
+  dshash_release_lock(session->views, entry);
+
+  PG_RETURN_INT32(slot);
+}
+
+/*
+ * Replace a row in a named view.
+ */
+Datum memview_update(PG_FUNCTION_ARGS) {
+  MemoryViewSession* session = memview_session_get();
+  Name name;
+  int32 row_id;
+  HeapTupleHeader row;
+  MemoryViewNamedEntry* entry;
+  MemoryViewNamed* view;
+  MemoryViewNamedSlot* slot;
+  dsa_pointer tuple;
+
+  if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2))
+    ereport(ERROR,
+            (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+             errmsg("view name, row identifier, and row cannot be null")));
+
+  name = PG_GETARG_NAME(0);
+  row_id = PG_GETARG_INT32(1);
+  row = PG_GETARG_HEAPTUPLEHEADER(2);
+
+  entry = memview_named_lookup(session, name, false);
+  memview_named_check_type(
+      session, entry, name, get_fn_expr_argtype(fcinfo->flinfo, 2));
+  view = dsa_get_address(session->area, entry->view);
+
+  /* Copy the row before taking the lock to keep the lock short. */
+  tuple = memview_named_store(session->area, row);
+
+  LWLockAcquire(&view->lock, LW_EXCLUSIVE);
+  slot = memview_named_slot(session->area, view, row_id);
+  if (slot == NULL) {
+    LWLockRelease(&view->lock);
+    dshash_release_lock(session->views, entry);
+    dsa_free(session->area, tuple);
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("row %d does not exist in memory view \"%s\"",
+                    row_id,
+                    NameStr(*name))));
+  }
+  dsa_free(session->area, slot->tuple);
+  slot->tuple = tuple;
+  LWLockRelease(&view->lock);
+
+  dshash_release_lock(session->views, entry);
+
+  PG_RETURN_VOID();
+}
+
+/*
+ * Delete a row from a named view.
+ */
+Datum memview_delete(PG_FUNCTION_ARGS) {
+  MemoryViewSession* session = memview_session_get();
+  Name name = PG_GETARG_NAME(0);
+  int32 row_id = PG_GETARG_INT32(1);
+  MemoryViewNamedEntry* entry = memview_named_lookup(session, name, false);
+  MemoryViewNamed* view = dsa_get_address(session->area, entry->view);
+  MemoryViewNamedSlot* slot;
+
+  LWLockAcquire(&view->lock, LW_EXCLUSIVE);
+  slot = memview_named_slot(session->area, view, row_id);
+  if (slot == NULL) {
+    LWLockRelease(&view->lock);
+    dshash_release_lock(session->views, entry);
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("row %d does not exist in memory view \"%s\"",
+                    row_id,
+                    NameStr(*name))));
+  }
+  dsa_free(session->area, slot->tuple);
+  slot->tuple = InvalidDsaPointer;
+  slot->next_free = view->free_slot;
+  view->free_slot = row_id;
+  --view->nrecords;
+  LWLockRelease(&view->lock);
+
+  dshash_release_lock(session->views, entry);
+
+  PG_RETURN_VOID();
+}
+
+/*
+ * Copy the rows of a named view into the scan state.
+ *
+ * The caller need to hold the lock of the view and the memory for the
+ * rows is allocated in the current memory context. The rows are
+ * copied into a single buffer, so that the lock is held for one
+ * allocation and the copying rather than an allocation for each row.
+ */
+static void memview_named_copy(dsa_area* area,
+                               MemoryViewNamed* view,
+                               MemoryViewNamedScanState* scan) {
+  MemoryViewNamedSlot* slots;
+  Size size = 0;
+  char* data;
+
+  scan->rows = palloc_array(Datum, view->nrecords + 1);
+  scan->row_ids = palloc_array(int32, view->nrecords + 1);
+
+  if (!DsaPointerIsValid(view->slots))
+    return;
+
+  /* Find the rows and the size needed for them. */
+  slots = memview_named_slots(area, view);
+  for (size_t slot = 0; slot < view->nslots; ++slot) {
+    HeapTupleHeader tuple;
+
+    if (!DsaPointerIsValid(slots[slot].tuple))
+      continue;
+
+    tuple = dsa_get_address(area, slots[slot].tuple);
+    size = add_size(size, MAXALIGN(HeapTupleHeaderGetDatumLength(tuple)));
+    scan->rows[scan->nrows] = PointerGetDatum(tuple);
+    scan->row_ids[scan->nrows] = slot;
+    ++scan->nrows;
+  }
+
+  if (scan->nrows == 0)
+    return;
+
+  data = palloc_extended(size, MCXT_ALLOC_HUGE);
+  for (size_t row = 0; row < scan->nrows; ++row) {
+    HeapTupleHeader tuple = (HeapTupleHeader)DatumGetPointer(scan->rows[row]);
+    Size len = HeapTupleHeaderGetDatumLength(tuple);
+
+    scan->rows[row] = PointerGetDatum(memcpy(data, tuple, len));
+    data += MAXALIGN(len);
+  }
+}
+
+/*
+ * Scan a named view.
+ *
+ * The second parameter is only used to give the row type of the
+ * result, which has to match the row type of the view, so it is
+ * normally a null value cast to the row type.
+ */
+Datum memview_scan(PG_FUNCTION_ARGS) {
+  FuncCallContext* funcctx;
+  MemoryViewNamedScanState* scan;
+
+  if (SRF_IS_FIRSTCALL()) {
+    MemoryContext oldcontext;
+    TupleDesc tupdesc;
+    MemoryViewSession* session;
+    MemoryViewNamedEntry* entry;
+    MemoryViewNamed* view;
+    Name name;
+
+    funcctx = SRF_FIRSTCALL_INIT();
+
+    if (PG_ARGISNULL(0))
+      ereport(ERROR,
+              (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+               errmsg("view name cannot be null")));
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+      ereport(ERROR,
+              (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+               errmsg("function returning record called in context "
+                      "that cannot accept type record")));
+
+    funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+    session = memview_session_get();
+    name = PG_GETARG_NAME(0);
+
+    oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+    scan = palloc0(sizeof(MemoryViewNamedScanState));
+
+    entry = memview_named_lookup(session, name, false);
+    memview_named_check_type(
+        session, entry, name, get_fn_expr_argtype(fcinfo->flinfo, 1));
+    view = dsa_get_address(session->area, entry->view);
+
+    /* Lock the view before releasing the registry entry, so that the
+     * view cannot be dropped while we copy it, without blocking other
+     * views in the same partition of the registry. */
+    LWLockAcquire(&view->lock, LW_SHARED);
+    dshash_release_lock(session->views, entry);
+    memview_named_copy(session->area, view, scan);
+    LWLockRelease(&view->lock);
+    MemoryContextSwitchTo(oldcontext);
+
+    funcctx->user_fctx = scan;
+  }
+
+  CHECK_FOR_INTERRUPTS();
+
+  funcctx = SRF_PERCALL_SETUP();
+  scan = funcctx->user_fctx;
+
+  if (scan->row < scan->nrows) {
+    bool nulls[2] = {0};
+    Datum values[2];
+    HeapTuple tuple;
+
+    values[0] = Int32GetDatum(scan->row_ids[scan->row]);
+    values[1] = scan->rows[scan->row];
+
+    tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+    ++scan->row;
+
+    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+  }
+
+  SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * Named view and row in the memory view file.
+ */
+typedef struct MemoryViewFileView {
+  Oid dboid;
+  NameData name;
+  Oid typid;
+  uint32 nrows;
+} MemoryViewFileView;
+
+typedef struct MemoryViewFileRow {
+  int32 slot;
+  uint32 len;
+} MemoryViewFileRow;
+
+/*
+ * Write all named views to a buffer.
+ *
+ * For each view, the name, row type, and number of rows are written,
+ * followed by the rows with their slot number and length.
+ */
+void memview_named_save(MemoryViewSession* session, StringInfo buf) {
+  dshash_seq_status status;
+  MemoryViewNamedEntry* entry;
+  int nviews_offset = buf->len;
+  uint32 nviews = 0;
+
+  /* The number of views is filled in when we know it */
+  appendBinaryStringInfo(buf, &nviews, sizeof(nviews));
+
+  dshash_seq_init(&status, session->views, false);
+  while ((entry = dshash_seq_next(&status)) != NULL) {
+    MemoryViewNamed* view = dsa_get_address(session->area, entry->view);
+    MemoryViewFileView file_view = {
+        .dboid = entry->key.dboid,
+        .name = entry->key.name,
+        .typid = entry->typid,
+    };
+
+    LWLockAcquire(&view->lock, LW_SHARED);
+    file_view.nrows = view->nrecords;
+    appendBinaryStringInfo(buf, &file_view, sizeof(file_view));
+    for (size_t slot = 0; slot < view->nslots; ++slot) {
+      MemoryViewNamedSlot* slots = memview_named_slots(session->area, view);
+      MemoryViewFileRow row = {.slot = slot};
+      HeapTupleHeader tuple;
+
+      if (!DsaPointerIsValid(slots[slot].tuple))
+        continue;
+
+      tuple = dsa_get_address(session->area, slots[slot].tuple);
+      row.len = HeapTupleHeaderGetDatumLength(tuple);
+      appendBinaryStringInfo(buf, &row, sizeof(row));
+      appendBinaryStringInfo(buf, tuple, row.len);
+    }
+    LWLockRelease(&view->lock);
+
+    ++nviews;
+  }
+  dshash_seq_term(&status);
+
+  memcpy(buf->data + nviews_offset, &nviews, sizeof(nviews));
+}
+
+/*
+ * Check the named views in a buffer without loading them.
+ *
+ * This reads the views the same way as memview_named_load(), so that
+ * a file that cannot be loaded is found before anything is put into
+ * shared memory. Returns false if the views are not valid.
+ */
+bool memview_named_check(StringInfo buf) {
+  MemoryViewFileView* views;
+  uint32 nviews;
+  bool valid = true;
+
+  if (!memview_file_try_read(buf, &nviews, sizeof(nviews)) ||
+      nviews > (buf->len - buf->cursor) / sizeof(MemoryViewFileView))
+    return false;
+
+  views = palloc_array(MemoryViewFileView, Max(nviews, 1));
+  for (uint32 i = 0; i < nviews && valid; ++i) {
+    MemoryViewFileView* file_view = &views[i];
+    Bitmapset* slots = NULL;
+
+    if (!memview_file_try_read(buf, file_view, sizeof(*file_view))) {
+      valid = false;
+      break;
+    }
+
+    for (uint32 j = 0; j < i && valid; ++j)
+      valid = views[j].dboid != file_view->dboid ||
+              strncmp(NameStr(views[j].name),
+                      NameStr(file_view->name),
+                      NAMEDATALEN) != 0;
+
+    for (uint32 j = 0; j < file_view->nrows && valid; ++j) {
+      MemoryViewFileRow row;
+
+      valid = memview_file_try_read(buf, &row, sizeof(row)) &&
+              row.slot >= 0 && row.slot < MEMVIEW_MAX_RECORDS &&
+              !bms_is_member(row.slot, slots) &&
+              row.len >= SizeofHeapTupleHeader &&
+              memview_file_try_read(buf, NULL, row.len);
+      if (valid)
+        slots = bms_add_member(slots, row.slot);
+    }
+    bms_free(slots);
+  }
+
+  pfree(views);
+  return valid;
+}
+
+/*
+ * Load all named views from a buffer.
+ *
+ * Rows are put back into the same slots, so row identifiers are the
+ * same as before the restart, and the free list is rebuilt from the
+ * unused slots.
+ */
+void memview_named_load(MemoryViewSession* session, StringInfo buf) {
+  uint32 nviews;
+
+  memview_file_read(buf, &nviews, sizeof(nviews));
+  for (uint32 i = 0; i < nviews; ++i) {
+    dsa_pointer view_ptr = memview_named_allocate(session->area);
+    MemoryViewNamed* view = dsa_get_address(session->area, view_ptr);
+    MemoryViewNamedEntry* entry;
+    MemoryViewFileView file_view;
+    MemoryViewNamedKey key;
+    bool found;
+
+    memview_file_read(buf, &file_view, sizeof(file_view));
+    for (uint32 j = 0; j < file_view.nrows; ++j) {
+      MemoryViewFileRow row;
+      MemoryViewNamedSlot* slot;
+
+      memview_file_read(buf, &row, sizeof(row));
+      if (row.slot < 0 || row.slot >= MEMVIEW_MAX_RECORDS)
+        ereport(ERROR,
+                (errcode(ERRCODE_DATA_CORRUPTED),
+                 errmsg("invalid slot %d in memory view file", row.slot)));
+
+      if ((size_t)row.slot >= view->capacity)
+        memview_named_grow(session->area, view, row.slot + 1);
+
+      slot = &memview_named_slots(session->area, view)[row.slot];
+      if (DsaPointerIsValid(slot->tuple))
+        ereport(ERROR,
+                (errcode(ERRCODE_DATA_CORRUPTED),
+                 errmsg("duplicate slot %d in memory view file", row.slot)));
+
+      slot->tuple = dsa_allocate(session->area, row.len);
+      memview_file_read(
+          buf, dsa_get_address(session->area, slot->tuple), row.len);
+      view->nslots = Max(view->nslots, (size_t)row.slot + 1);
+      ++view->nrecords;
+    }
+
+    for (size_t slot = view->nslots; slot > 0; --slot) {
+      MemoryViewNamedSlot* slots = memview_named_slots(session->area, view);
+      if (!DsaPointerIsValid(slots[slot - 1].tuple)) {
+        slots[slot - 1].next_free = view->free_slot;
+        view->free_slot = slot - 1;
+      }
+    }
+
+    memset(&key, 0, sizeof(key));
+    key.dboid = file_view.dboid;
+    namestrcpy(&key.name, NameStr(file_view.name));
+    entry = dshash_find_or_insert(session->views, &key, &found);
+    if (found) {
+      dshash_release_lock(session->views, entry);
+      ereport(ERROR,
+              (errcode(ERRCODE_DATA_CORRUPTED),
+               errmsg("duplicate memory view \"%s\" in memory view file",
+                      NameStr(file_view.name))));
+    }
+    entry->typid = file_view.typid;
+    entry->view = view_ptr;
+    dshash_release_lock(session->views, entry);
+  }
+}
@@ -0,0 +1,158 @@
+/*
+ * This file and its contents are licensed under the Apache License 2.0.
+ * Please see the included NOTICE for copyright information and
+ * LICENSE-APACHE for a copy of the license.
+ */
+
+/*
+ * Cache of task functions for the task runners.
+ *
+ * Looking up the function of a task by name, checking that the runner
+ * can execute it, and setting up the call information is done once
+ * for each function name and then reused for all tasks that execute
+ * the same function.
+ *
+ * The cache is flushed when a function, schema, or role is changed,
+ * since any of these can change which function a name refers to or
+ * whether the runner can execute it. Invalidation messages for the
+ * task table are used to tell the runner that the task table has
+ * changed.
+ */
+
+#include "tasks.h"
+
+#include <postgres.h>
+#include <fmgr.h>
+
+#include <miscadmin.h>
+
+#include <catalog/namespace.h>
+#include <catalog/pg_inherits.h>
+#include <catalog/pg_proc.h>
+#include <catalog/pg_type.h>
+#include <nodes/makefuncs.h>
+#include <nodes/pg_list.h>
+#include <parser/parse_func.h>
+#include <utils/acl.h>
+#include <utils/hsearch.h>
+#include <utils/inval.h>
+#include <utils/memutils.h>
+#include <utils/regproc.h>
+#include <utils/syscache.h>
+
+bool TaskTableChanged = false;
+
+static HTAB *TaskFunctionCache = NULL;
+static MemoryContext TaskFunctionCacheContext = NULL;
+static bool TaskFunctionCacheValid = true;
+static List *TaskTableRelids = NIL;
+
+/*
+ * Mark the function cache as invalid.
+ *
+ * Invalidation messages can be processed while a task function is
+ * executing, so the cache is only flushed before the next lookup.
+ */
+static void TaskFunctionCacheInvalidate(Datum arg, int cacheid,
+                                        uint32 hashvalue) {
+  TaskFunctionCacheValid = false;
+}
+
+/*
+ * Flush the function cache.
+ *
+ * The call information of the functions can have allocated memory in
+ * the cache memory context, so the context is reset as well.
+ */
+static void TaskFunctionCacheFlush(void) {
+  HASH_SEQ_STATUS status;
+  TaskFunctionCacheEntry *entry;
+
+  hash_seq_init(&status, TaskFunctionCache);
+  while ((entry = hash_seq_search(&status)) != NULL)
+    hash_search(TaskFunctionCache, &entry->name, HASH_REMOVE, NULL);
+
+  MemoryContextReset(TaskFunctionCacheContext);
+  TaskFunctionCacheValid = true;
+}
+
+/*
+ * Note that the task table, or one of its partitions, has changed.
+ */
+static void TaskTableInvalidate(Datum arg, Oid relid) {
+  if (!OidIsValid(relid) || list_member_oid(TaskTableRelids, relid))
+    TaskTableChanged = true;
+}
+
+/*
+ * Set up the function cache and the invalidation callbacks.
+ *
+ * This has to be called in a transaction, since it looks up the task
+ * table and its partitions.
+ */
+void TaskCacheInit(void) {
+  HASHCTL ctl;
+  MemoryContext oldcontext;
+  Oid relid;
+
+  Assert(TaskFunctionCache == NULL);
+
+  TaskFunctionCacheContext = AllocSetContextCreate(
+      TopMemoryContext, "TaskFunctionCache", ALLOCSET_DEFAULT_SIZES);
+
+  ctl.keysize = sizeof(NameData);
+  ctl.entrysize = sizeof(TaskFunctionCacheEntry);
+  TaskFunctionCache = hash_create(
+      "task function cache", 32, &ctl, HASH_ELEM | HASH_STRINGS);
+
+  relid = RangeVarGetRelid(
+      makeRangeVar("tasks", "task", -1), AccessShareLock, false);
+  oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+  TaskTableRelids = find_all_inheritors(relid, AccessShareLock, NULL);
+  MemoryContextSwitchTo(oldcontext);
+
+  CacheRegisterSyscacheCallback(PROCOID, TaskFunctionCacheInvalidate, 0);
+  CacheRegisterSyscacheCallback(
+      NAMESPACEOID, TaskFunctionCacheInvalidate, 0);
+  CacheRegisterSyscacheCallback(AUTHOID, TaskFunctionCacheInvalidate, 0);
+  CacheRegisterSyscacheCallback(
+      AUTHMEMROLEMEM, TaskFunctionCacheInvalidate, 0);
+  CacheRegisterRelcacheCallback(TaskTableInvalidate, 0);
+}
+
+/*
+ * Look up the function of a task.
+ *
+ * Errors are not cached, so a task with a function that does not exist
+ * looks it up again each time. The result of the permission check is
+ * cached, but the error is raised for each task.
+ */
+TaskFunctionCacheEntry *TaskFunctionLookup(Name task_exec) {
+  TaskFunctionCacheEntry *entry;
+  bool found;
+
+  if (!TaskFunctionCacheValid)
+    TaskFunctionCacheFlush();
+
+  entry = hash_search(TaskFunctionCache, task_exec, HASH_FIND, &found);
+  if (!found) {
+    Oid argtypes[] = {TIMESTAMPTZOID, JSONBOID};
+    List *namelist = stringToQualifiedNameList(NameStr(*task_exec), NULL);
+    Oid proc_oid = LookupFuncName(namelist, 2, argtypes, false);
+    AclResult aclresult = object_aclcheck(
+        ProcedureRelationId, proc_oid, GetUserId(), ACL_EXECUTE);
+    FmgrInfo finfo;
+
+    fmgr_info_cxt(proc_oid, &finfo, TaskFunctionCacheContext);
+
+    entry = hash_search(TaskFunctionCache, task_exec, HASH_ENTER, NULL);
+    entry->proc_oid = proc_oid;
+    entry->aclresult = aclresult;
+    entry->finfo = finfo;
+  }
+
+  if (entry->aclresult != ACLCHECK_OK)
+    aclcheck_error(entry->aclresult, OBJECT_FUNCTION, NameStr(*task_exec));
+
+  return entry;
+}
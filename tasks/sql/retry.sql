@@ -0,0 +1,68 @@
+create role wizard;
+
+-- New tasks have not been attempted and are not leased.
+insert into tasks.task(task_sched, task_priority, task_owner, task_exec,
+                       task_config, task_shard_key)
+values (now(), 5, 'wizard', 'flaky', '{"foo": 1}', 17);
+select task_priority, task_attempts, task_lease is null as unleased,
+       task_part = tasks.queue_partition() as current
+  from tasks.task;
+
+-- A runner claims the task by leasing it, and a failed attempt puts
+-- the task back into the current partition without a lease and
+-- counts the attempt.
+update tasks.task set task_lease = now() + interval '5 minutes'
+ where task_exec = 'flaky';
+select task_id, task_lease, task_part from tasks.task
+ where task_exec = 'flaky' \gset
+update tasks.task set task_sched = now() + interval '10 seconds',
+       task_lease = null, task_attempts = task_attempts + 1,
+       task_part = tasks.queue_partition()
+ where task_id = :task_id and task_part = :task_part
+   and task_lease = :'task_lease'
+returning task_attempts, task_lease is null as unleased,
+          task_sched > now() as delayed;
+
+-- The lease is not held any more, so doing it again does nothing.
+update tasks.task set task_sched = now() + interval '10 seconds',
+       task_lease = null, task_attempts = task_attempts + 1,
+       task_part = tasks.queue_partition()
+ where task_id = :task_id and task_part = :task_part
+   and task_lease = :'task_lease'
+returning task_attempts;
+
+-- The last failed attempt moves the task to the failed tasks together
+-- with the error.
+update tasks.task set task_lease = now() + interval '5 minutes'
+ where task_id = :task_id;
+select task_lease, task_part from tasks.task where task_id = :task_id \gset
+with failed as (delete from tasks.task
+                 where task_id = :task_id and task_part = :task_part
+                   and task_lease = :'task_lease'
+             returning *)
+insert into tasks.failed_task (task_id, task_sched, task_priority,
+                               task_owner, task_exec, task_config,
+                               task_shard_key, task_attempts, task_error)
+select task_id, task_sched, task_priority, task_owner, task_exec,
+       task_config, task_shard_key, task_attempts + 1, 'division by zero'
+  from failed;
+select count(*) from tasks.task;
+select task_id = :task_id as same_id, task_priority, task_owner, task_exec,
+       task_config, task_shard_key, task_attempts, task_error
+  from tasks.failed_task;
+
+-- A failed task can be put back into the queue, where it gets a new
+-- identifier and starts over with no failed attempts.
+with t as (delete from tasks.failed_task where task_id = :task_id returning *)
+insert into tasks.task(task_sched, task_priority, task_owner, task_exec,
+                       task_config, task_shard_key)
+select now(), task_priority, task_owner, task_exec, task_config,
+       task_shard_key
+from t;
+select count(*) from tasks.failed_task;
+select task_id = :task_id as same_id, task_priority, task_owner, task_exec,
+       task_config, task_shard_key, task_attempts
+  from tasks.task;
+
+delete from tasks.task;
+drop role wizard;
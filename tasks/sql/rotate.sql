@@ -0,0 +1,59 @@
+create role wizard;
+
+create view queue as
+select tableoid::regclass as part, task_exec, task_attempts,
+       task_lease is not null as leased
+  from tasks.task;
+
+-- Tasks are added to the current partition.
+select current_part from tasks.queue_state;
+insert into tasks.task(task_sched, task_owner, task_exec, task_config)
+values (now(), 'wizard', 'due', '{}'),
+       (now() + interval '1 year', 'wizard', 'ahead', '{}');
+select * from queue order by task_exec;
+
+-- The queue is only rotated if it was last rotated at least "min_age"
+-- ago.
+update tasks.queue_state set rotated_at = now() - interval '1 hour';
+select tasks.rotate_queue('2 hours');
+select tasks.rotate_queue('30 minutes');
+select tasks.rotate_queue('30 minutes');
+select current_part from tasks.queue_state;
+
+-- Leased and retried tasks are moved like any other task once the
+-- queue has gone around.
+insert into tasks.task(task_sched, task_owner, task_exec, task_config,
+                       task_attempts, task_lease)
+values (now(), 'wizard', 'leased', '{}', 2, now() + interval '5 minutes');
+select * from queue order by task_exec;
+select array_agg(task_id order by task_id) as task_ids from tasks.task \gset
+select tasks.rotate_queue();
+select tasks.rotate_queue();
+select tasks.rotate_queue();
+select current_part from tasks.queue_state;
+select * from queue order by task_exec;
+select tasks.rotate_queue();
+select current_part from tasks.queue_state;
+select * from queue order by task_exec;
+select array_agg(task_id order by task_id) = :'task_ids' as same_ids
+  from tasks.task;
+
+-- The rotation is skipped if the next partition is in use.
+create extension dblink;
+select dblink_connect('locker',
+                      format('dbname=%s user=%s port=%s',
+                             current_database(), current_user,
+                             current_setting('port')));
+select dblink_exec('locker', 'begin');
+select dblink_exec('locker', 'lock table tasks.task_2 in access share mode');
+select tasks.rotate_queue();
+select current_part from tasks.queue_state;
+select dblink_exec('locker', 'commit');
+select tasks.rotate_queue();
+select current_part from tasks.queue_state;
+select dblink_disconnect('locker');
+drop extension dblink;
+
+delete from tasks.task;
+drop view queue;
+drop role wizard;
@@ -0,0 +1,207 @@
+/*
+ * This file and its contents are licensed under the Apache License 2.0.
+ * Please see the included NOTICE for copyright information and
+ * LICENSE-APACHE for a copy of the license.
+ */
+
+/*
+ * Supervisor that scales the pool of task runners with the load.
+ *
+ * The "tasks.workers" runners started for a database are always
+ * running. If "tasks.max_workers" is larger, a supervisor is started
+ * as well, which checks the queue every "tasks.scale_interval" and
+ * starts dynamic runners when there is more work than the runners can
+ * handle, that is, when no runner is idle and the oldest due task that
+ * has not been claimed has waited for longer than "tasks.scale_up_lag".
+ * It then starts one runner for each batch of unclaimed due tasks.
+ *
+ * Dynamic runners exit by themselves when they have been idle for
+ * "tasks.idle_timeout", so they only hold background worker slots
+ * while there is a backlog.
+ */
+
+#include "tasks.h"
+
+#include <postgres.h>
+#include <fmgr.h>
+
+#include <miscadmin.h>
+#include <pgstat.h>
+
+#include <access/xact.h>
+#include <catalog/pg_type.h>
+#include <executor/spi.h>
+#include <postmaster/bgworker.h>
+#include <postmaster/interrupt.h>
+#include <storage/ipc.h>
+#include <storage/latch.h>
+#include <tcop/tcopprot.h>
+#include <utils/guc.h>
+#include <utils/memutils.h>
+#include <utils/resowner.h>
+#include <utils/snapmgr.h>
+
+int TaskSupervisorInterval = 1000;
+int TaskSupervisorScaleUpLag = 1000;
+
+/*
+ * Number of due tasks that have not been claimed and the lag of the
+ * oldest one, in milliseconds.
+ *
+ * Only as many tasks as the maximum number of runners can claim are
+ * counted, so the query reads a bounded part of the scheduling index
+ * even if the backlog is large. Tasks with an expired lease that are
+ * locked are still executing, so they are not counted.
+ */
+static TaskRunnerQuery getbacklog = {
+    .query = "select count(*), "
+             "extract(epoch from now() - min(task_sched))::float8 * 1000 "
+             "from (select task_sched from tasks.task "
+             "where task_sched <= now() and task_lease is null "
+             "union all select task_sched from (select task_sched "
+             "from tasks.task where task_lease <= now() "
+             "for share skip locked) expired "
+             "order by task_sched limit $1) t",
+    .ok = SPI_OK_SELECT,
+    .nargs = 1,
+    .argtypes = {INT4OID},
+};
+
+/*
+ * Read the number of due tasks and the lag of the oldest due task.
+ */
+static void TaskSupervisorGetBacklog(int64 *depth, double *lag) {
+  bool isnull;
+  HeapTuple tup;
+  Datum value;
+  int limit = Max(TaskMaxRunners, TaskTotalRunners) * TaskRunnerBatchSize;
+
+  SetCurrentStatementStartTimestamp();
+  StartTransactionCommand();
+
+  if (SPI_connect() != SPI_OK_CONNECT)
+    elog(ERROR, "%s: SPI_connect failed", __func__);
+
+  PushActiveSnapshot(GetTransactionSnapshot());
+
+  TaskRunnerExecuteQuery(&getbacklog,
+                         (Datum[]){Int32GetDatum(limit)},
+                         (char[]){' '},
+                         false,
+                         1);
+
+  tup = SPI_tuptable->vals[0];
+  value = SPI_getbinval(tup, SPI_tuptable->tupdesc, 1, &isnull);
+  *depth = DatumGetInt64(value);
+  value = SPI_getbinval(tup, SPI_tuptable->tupdesc, 2, &isnull);
+  *lag = isnull ? 0.0 : DatumGetFloat8(value);
+
+  if (SPI_finish() != SPI_OK_FINISH)
+    elog(ERROR, "%s: SPI_finish() failed", __func__);
+
+  PopActiveSnapshot();
+  CommitTransactionCommand();
+  pgstat_report_stat(true);
+}
+
+/*
+ * Start dynamic runners if the runners cannot keep up with the queue.
+ *
+ * Idle runners will pick up due tasks when they are woken up, and
+ * busy runners claim new tasks when they are done with their current
+ * batch, so we only start new runners when all runners are busy and
+ * the oldest unclaimed task has waited for too long. We then start
+ * one runner for each batch of unclaimed tasks.
+ */
+static void TaskSupervisorScale(TaskRunnerArgs *args, int64 depth,
+                                double lag) {
+  int nrunners, nidle;
+  int64 wanted;
+
+  TaskRunnerCount(MyDatabaseId, &nrunners, &nidle);
+  if (nidle > 0 || depth == 0 || lag <= TaskSupervisorScaleUpLag)
+    return;
+
+  wanted = nrunners + (depth + TaskRunnerBatchSize - 1) / TaskRunnerBatchSize;
+  wanted = Min(wanted, TaskMaxRunners);
+
+  for (int i = nrunners; i < wanted; i++) {
+    if (!TaskWorkerStart("TaskRunnerMain",
+                         "Task Runner",
+                         "Task Runner (dynamic)",
+                         args,
+                         BGW_NEVER_RESTART)) {
+      ereport(LOG,
+              (errmsg("could not start dynamic task runner"),
+               errhint("You may need to increase \"max_worker_processes\".")));
+      break;
+    }
+
+    ereport(DEBUG1,
+            (errmsg("started dynamic task runner: %lld due tasks, "
+                    "lag %.0f ms, %d runners",
+                    (long long)depth,
+                    lag,
+                    i + 1)));
+  }
+}
+
+/*
+ * Main entrypoint for the supervisor.
+ */
+void TaskSupervisorMain(Datum main_arg) {
+  ResourceOwner resowner;
+  TaskRunnerArgs args;
+
+  pqsignal(SIGHUP, SignalHandlerForConfigReload);
+  pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+  BackgroundWorkerUnblockSignals();
+
+  if (IsBinaryUpgrade)
+    proc_exit(0);
+
+  memcpy(&args, MyBgworkerEntry->bgw_extra, sizeof(args));
+
+  Assert(CurrentResourceOwner == NULL);
+  resowner = ResourceOwnerCreate(NULL, "TaskSupervisorMain");
+  CurrentResourceOwner = resowner;
+  CurrentMemoryContext = AllocSetContextCreate(
+      TopMemoryContext, "TaskSupervisor", ALLOCSET_DEFAULT_SIZES);
+
+  if (OidIsValid(args.roleoid))
+    BackgroundWorkerInitializeConnectionByOid(args.dboid, args.roleoid, 0);
+  else
+    BackgroundWorkerInitializeConnection(args.dbname, NULL, 0);
+
+  CurrentResourceOwner = resowner;
+
+  pgstat_report_appname(MyBgworkerEntry->bgw_name);
+
+  /* The runners started by the supervisor connect the same way as
+   * the supervisor itself. */
+  args.dynamic = true;
+
+  for (;;) {
+    int64 depth;
+    double lag;
+
+    if (ShutdownRequestPending)
+      proc_exit(0);
+
+    CHECK_FOR_INTERRUPTS();
+
+    if (ConfigReloadPending) {
+      ConfigReloadPending = false;
+      ProcessConfigFile(PGC_SIGHUP);
+    }
+
+    TaskSupervisorGetBacklog(&depth, &lag);
+    TaskSupervisorScale(&args, depth, lag);
+
+    (void)WaitLatch(MyLatch,
+                    WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                    TaskSupervisorInterval,
+                    PG_WAIT_EXTENSION);
+    ResetLatch(MyLatch);
+  }
+}
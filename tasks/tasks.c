@@ -18,11 +18,9 @@
 
 #include <access/xact.h>
 #include <catalog/objectaccess.h>
-#include <catalog/pg_proc.h>
 #include <catalog/pg_type.h>
 #include <executor/spi.h>
 #include <nodes/pg_list.h>
-#include <parser/parse_func.h>
 #include <postmaster/bgworker.h>
 #include <postmaster/interrupt.h>
 #include <storage/dsm.h>
@@ -32,12 +30,13 @@
 #include <storage/shm_toc.h>
 #include <tcop/tcopprot.h>
 #include <utils/acl.h>
+#include <utils/array.h>
 #include <utils/backend_status.h>
+#include <utils/builtins.h>
 #include <utils/inval.h>
 #include <utils/lsyscache.h>
 #include <utils/memutils.h>
 #include <utils/palloc.h>
-#include <utils/regproc.h>
 #include <utils/resowner.h>
 #include <utils/snapmgr.h>
 #include <utils/timestamp.h>
@@ -52,36 +51,173 @@ PG_FUNCTION_INFO_V1(tasks_start);
  */
 static void TaskRunnerShutdown(void);
 static void TaskRunnerReloadConfig(void);
-static void TaskRunnerUpdateState(TaskRunnerState *state);
-static void TaskRunnerExecuteNext(TaskRunnerState *state);
-
-static bool TaskTableChanged = false;
-static int TaskTotalRunners = 4;
-static int TaskRunnerRestartTime = 30;
-static int TaskRunnerNapTime = 1;
+static void TaskRunnerUpdateState(TaskRunnerState *state, bool force);
+static void TaskRunnerBeginTransaction(void);
+static void TaskRunnerCommitTransaction(void);
+static TaskRunnerBatch *TaskRunnerClaimNext(MemoryContext batchcxt);
+static void TaskRunnerExecuteBatch(TaskRunnerState *state,
+                                   TaskRunnerBatch *batch);
+
+int TaskTotalRunners = 4;
+int TaskMaxRunners = 0;
+int TaskRunnerRestartTime = 30;
+int TaskRunnerBatchSize = 10;
+static int TaskRunnerNapTime = 60;
+static int TaskRunnerIdleTimeout = 60;
+static int TaskRunnerMaxAttempts = 5;
+static int TaskRunnerRetryDelayMs = 10000;
+static int TaskRunnerMaxRetryDelayMs = 3600000;
+static int TaskRunnerLeaseTime = 300;
+static int TaskRunnerRotateInterval = 0;
 static char *TaskRunnerDatabases = NULL;
 
+/*
+ * Leased tasks are due when the lease expires, so the next wakeup is
+ * the earliest of the scheduled time of the tasks that are not leased
+ * and the lease time of the tasks that are.
+ *
+ * A task that is executing is locked by the runner executing it, so
+ * it cannot be claimed even if it runs for longer than the lease. Such
+ * tasks are skipped here, or the runners would keep waking up to claim
+ * a task that they cannot claim. There are never more leased tasks
+ * than the runners have claimed, so locking them is cheap.
+ */
 static TaskRunnerQuery getnextwakeup = {
-    /* Do we need to skip locked rows in some way? */
-    .query =
-        "select coalesce(min(task_sched), clock_timestamp() + $1 * '1 "
-        "second'::interval) from tasks.task",
+    .query = "select least((select min(task_sched) from tasks.task "
+             "where task_lease is null), "
+             "(select min(task_lease) from (select task_lease "
+             "from tasks.task where task_lease is not null "
+             "for share skip locked) leased))",
     .ok = SPI_OK_SELECT,
-    .nargs = 1,
-    .argtypes = {INT2OID},
+    .nargs = 0,
 };
 
+/*
+ * Claim the due tasks with the highest priority, oldest first, by
+ * leasing them for "tasks.lease_time" seconds. This is an index scan
+ * on (task_priority, task_sched) that stops after the limit, so it
+ * does not need to sort all due tasks. Leased tasks are skipped until
+ * the lease expires, but there are never more of them than the
+ * runners have claimed.
+ */
 static TaskRunnerQuery getnexttask = {
-    .query =
-        "select * from tasks.task where task_sched <= now() order by "
-        "task_sched desc for no key update skip locked",
+    .query = "with claimed as (update tasks.task "
+             "set task_lease = now() + $2 * interval '1 second' "
+             "where task_id = any(array(select task_id from tasks.task "
+             "where task_sched <= now() "
+             "and (task_lease is null or task_lease <= now()) "
+             "order by task_priority, task_sched limit $1 "
+             "for update skip locked)) returning *) "
+             "select * from claimed order by task_priority, task_sched",
     .ok = SPI_OK_SELECT,
-    .nargs = 0,
+    .nargs = 2,
+    .argtypes = {INT4OID, INT4OID},
+};
+
+/*
+ * Claim the due tasks of a set of shards in the same way. The index on
+ * (task_shard, task_priority, task_sched) can only give the order for
+ * a single shard, so each shard is read with an index scan that stops
+ * after the limit, and the few rows found are then sorted. This can
+ * lock up to the limit in each shard, but only for the short claiming
+ * transaction.
+ */
+static TaskRunnerQuery getnextshardtask = {
+    .query = "with claimed as (update tasks.task "
+             "set task_lease = now() + $2 * interval '1 second' "
+             "where task_id = any(array(select t.task_id "
+             "from unnest($3) s(shard), lateral (select task_id, "
+             "task_priority, task_sched from tasks.task "
+             "where task_shard = s.shard and task_sched <= now() "
+             "and (task_lease is null or task_lease <= now()) "
+             "order by task_priority, task_sched limit $1 "
+             "for update skip locked) t "
+             "order by t.task_priority, t.task_sched limit $1)) "
+             "returning *) "
+             "select * from claimed order by task_priority, task_sched",
+    .ok = SPI_OK_SELECT,
+    .nargs = 3,
+    .argtypes = {INT4OID, INT4OID, INT2ARRAYOID},
+};
+
+/*
+ * Renew the lease of a claimed task before executing it and lock the
+ * task until the end of the transaction. If the lease has expired and
+ * another runner has claimed the task, the lease is not ours anymore
+ * and nothing is returned.
+ *
+ * The statements for a single claimed task include the partition of
+ * the task, so that they only look in that partition. If the queue is
+ * rotated and moves the task to another partition before we execute
+ * it, the lease is not renewed and the task is claimed again when the
+ * lease expires.
+ */
+static TaskRunnerQuery renewtask = {
+    .query = "update tasks.task "
+             "set task_lease = now() + $2 * interval '1 second' "
+             "where task_part = $4 and task_id = any(array(select task_id "
+             "from tasks.task where task_id = $1 and task_part = $4 "
+             "and task_lease = $3 for update skip locked)) "
+             "returning task_lease",
+    .ok = SPI_OK_UPDATE_RETURNING,
+    .nargs = 4,
+    .argtypes = {INT4OID, INT4OID, TIMESTAMPTZOID, INT2OID},
 };
 
 static TaskRunnerQuery deletetask = {
-    .query = "delete from tasks.task where task_id = $1",
+    .query = "delete from tasks.task "
+             "where task_id = $1 and task_part = $3 and task_lease = $2",
     .ok = SPI_OK_DELETE,
+    .nargs = 3,
+    .argtypes = {INT4OID, TIMESTAMPTZOID, INT2OID},
+};
+
+/*
+ * Release the leases of claimed tasks. The tasks of a batch are claimed
+ * with the same lease, so tasks that have been claimed again by another
+ * runner after our lease expired are left alone.
+ */
+static TaskRunnerQuery releasetasks = {
+    .query = "update tasks.task set task_lease = null "
+             "where task_id = any($1) and task_lease = $2",
+    .ok = SPI_OK_UPDATE,
+    .nargs = 2,
+    .argtypes = {INT4ARRAYOID, TIMESTAMPTZOID},
+};
+
+static TaskRunnerQuery retrytask = {
+    .query = "update tasks.task set task_sched = $2, task_lease = null, "
+             "task_attempts = task_attempts + 1, "
+             "task_part = tasks.queue_partition() "
+             "where task_id = $1 and task_part = $4 and task_lease = $3",
+    .ok = SPI_OK_UPDATE,
+    .nargs = 4,
+    .argtypes = {INT4OID, TIMESTAMPTZOID, TIMESTAMPTZOID, INT2OID},
+};
+
+static TaskRunnerQuery failtask = {
+    .query = "with failed as (delete from tasks.task "
+             "where task_id = $1 and task_part = $4 and task_lease = $3 "
+             "returning *) "
+             "insert into tasks.failed_task (task_id, task_sched, "
+             "task_priority, task_owner, task_exec, task_config, "
+             "task_shard_key, task_attempts, task_error) "
+             "select task_id, task_sched, task_priority, task_owner, "
+             "task_exec, task_config, task_shard_key, task_attempts + 1, "
+             "$2 from failed",
+    .ok = SPI_OK_INSERT,
+    .nargs = 4,
+    .argtypes = {INT4OID, TEXTOID, TIMESTAMPTZOID, INT2OID},
+};
+
+/*
+ * Rotate the task table to the next partition. All runners call this,
+ * but the function only rotates if nobody has done it within the
+ * interval.
+ */
+static TaskRunnerQuery rotatequeue = {
+    .query = "select tasks.rotate_queue($1 * interval '1 second')",
+    .ok = SPI_OK_SELECT,
     .nargs = 1,
     .argtypes = {INT4OID},
 };
@@ -97,8 +233,13 @@ static TaskRunnerQuery deletetask = {
  * centralized scheduler.
  */
 void TaskRunnerMain(Datum main_arg) {
-  TaskRunnerState state = {.next_wakeup = GetCurrentTimestamp()};
+  TaskRunnerState state = {
+      .next_wakeup = GetCurrentTimestamp(),
+      .last_active = GetCurrentTimestamp(),
+      .next_rotate = GetCurrentTimestamp(),
+  };
   ResourceOwner resowner;
+  MemoryContext batchcxt;
   TaskRunnerArgs args;
 
   pqsignal(SIGHUP, SignalHandlerForConfigReload);
@@ -116,6 +257,8 @@ void TaskRunnerMain(Datum main_arg) {
   CurrentResourceOwner = resowner;
   CurrentMemoryContext = AllocSetContextCreate(
       TopMemoryContext, "TaskRunner", ALLOCSET_DEFAULT_SIZES);
+  batchcxt = AllocSetContextCreate(
+      TopMemoryContext, "TaskRunnerBatch", ALLOCSET_DEFAULT_SIZES);
 
   /*
    * Initializing the connection clears the resource owner, so we
@@ -134,7 +277,22 @@ void TaskRunnerMain(Datum main_arg) {
    */
   pgstat_report_appname(MyBgworkerEntry->bgw_name);
 
+  /*
+   * Register the runner so that it is woken up when tasks are added.
+   */
+  TaskRunnerRegister();
+
+  /*
+   * Set up the cache of task functions, which needs to look up the
+   * task table.
+   */
+  StartTransactionCommand();
+  TaskCacheInit();
+  CommitTransactionCommand();
+
   for (;;) {
+    TaskRunnerBatch *batch = NULL;
+    bool refresh = false;
     long timeout = 0;
 
     if (ShutdownRequestPending)
@@ -145,46 +303,123 @@ void TaskRunnerMain(Datum main_arg) {
     if (ConfigReloadPending)
       TaskRunnerReloadConfig();
 
-    SetCurrentStatementStartTimestamp();
+    /*
+     * Reset the latch before looking at the task table. If tasks are
+     * added after we have looked, the latch will be set and we will
+     * not go to sleep below.
+     */
+    ResetLatch(MyLatch);
+
     AbortOutOfAnyTransaction();
-    StartTransactionCommand();
+    TaskRunnerBeginTransaction();
 
-    if (SPI_connect_ext(SPI_OPT_NONATOMIC) != SPI_OK_CONNECT)
-      elog(ERROR, "%s: SPI_connect_ext failed", __func__);
+    /*
+     * If the task table has been changed, for example truncated, the
+     * shared wakeup time might be wrong, so we read it from the table.
+     */
+    if (TaskTableChanged) {
+      TaskTableChanged = false;
+      TaskRunnerUpdateState(&state, true);
+    }
 
-    PushActiveSnapshot(GetTransactionSnapshot());
+    /*
+     * If next wakeup is in the past, we claim the next batch of
+     * tasks. If we could not claim a full batch, there are no more
+     * due tasks and the next wakeup time has to be read from the
+     * task table.
+     */
+    if (state.next_wakeup < GetCurrentTimestamp()) {
+      batch = TaskRunnerClaimNext(batchcxt);
+      refresh = batch == NULL || batch->ntasks < TaskRunnerBatchSize;
+    }
 
-    if (TaskTableChanged)
-      TaskRunnerUpdateState(&state);
+    /*
+     * Look for the next wakeup time.
+     */
+    TaskRunnerUpdateState(&state, refresh);
+
+    TaskRunnerCommitTransaction();
 
     /*
-     * If next wakeup is in the past, we fetch and execute the next
-     * task.
+     * If we claimed a full batch, there might be more due tasks than
+     * we can execute, for example tasks that were scheduled ahead and
+     * became due at the same time, so we wake up another idle runner
+     * to help out. It does the same if it also claims a full batch.
      */
-    if (state.next_wakeup < GetCurrentTimestamp())
-      TaskRunnerExecuteNext(&state);
+    if (batch != NULL && batch->ntasks == TaskRunnerBatchSize)
+      TaskRunnerWakeup(MyDatabaseId, 1);
 
     /*
-     * Look for the next wakeup time.
+     * Execute the claimed tasks after the claim has been committed,
+     * so no locks or snapshots are held while other tasks execute.
      */
-    TaskRunnerUpdateState(&state);
+    if (batch != NULL)
+      TaskRunnerExecuteBatch(&state, batch);
+    MemoryContextReset(batchcxt);
 
-    if (SPI_finish() != SPI_OK_FINISH)
-      elog(ERROR, "%s: SPI_finish() failed", __func__);
+    /*
+     * Rotate the queue in a transaction of its own, since truncating
+     * the drained partition takes a lock that conflicts with all
+     * other queries on it.
+     */
+    if (TaskRunnerRotateInterval > 0 &&
+        state.next_rotate <= GetCurrentTimestamp()) {
+      TaskRunnerBeginTransaction();
+      TaskRunnerExecuteQuery(&rotatequeue,
+                             (Datum[]){Int32GetDatum(TaskRunnerRotateInterval)},
+                             (char[]){' '},
+                             false,
+                             1);
+      TaskRunnerCommitTransaction();
+      state.next_rotate = TimestampTzPlusMilliseconds(
+          GetCurrentTimestamp(), TaskRunnerRotateInterval * 1000L);
+    }
 
-    PopActiveSnapshot();
-    CommitTransactionCommand();
     pgstat_report_stat(true);
 
-    /* Timestamp is in microseconds, timeout is in milliseconds. */
-    timeout = (state.next_wakeup - GetCurrentTimestamp()) / 1000;
+    /* Wake up in time to rotate the queue even if it is idle. */
+    if (TaskRunnerRotateInterval > 0 && state.next_wakeup > state.next_rotate)
+      state.next_wakeup = state.next_rotate;
 
-    if (timeout > 0) {
-      int rc = WaitLatch(
-          MyLatch, WL_LATCH_SET | WL_EXIT_ON_PM_DEATH | WL_TIMEOUT, timeout, 0);
+    /*
+     * Dynamic runners exit when they have not executed any tasks for
+     * the idle timeout, and otherwise wake up in time to check it.
+     */
+    if (args.dynamic) {
+      TimestampTz retire_at = TimestampTzPlusMilliseconds(
+          state.last_active, TaskRunnerIdleTimeout * 1000L);
+
+      if (retire_at <= GetCurrentTimestamp()) {
+        ereport(DEBUG1, (errmsg("dynamic task runner exiting after being "
+                                "idle for %d seconds",
+                                TaskRunnerIdleTimeout)));
+        proc_exit(0);
+      }
+
+      if (state.next_wakeup > retire_at)
+        state.next_wakeup = retire_at;
+    }
 
-      if (rc & WL_LATCH_SET)
-        ResetLatch(MyLatch);
+    /*
+     * If there are no tasks in the queue, we sleep until we are woken
+     * up, otherwise until the next task is scheduled.
+     *
+     * Timestamp is in microseconds, timeout is in milliseconds.
+     */
+    if (state.next_wakeup == DT_NOEND) {
+      TaskRunnerSetIdle(true);
+      (void)WaitLatch(MyLatch, WL_LATCH_SET | WL_EXIT_ON_PM_DEATH, -1, 0);
+      TaskRunnerSetIdle(false);
+    } else {
+      timeout = (state.next_wakeup - GetCurrentTimestamp()) / 1000;
+      if (timeout > 0) {
+        TaskRunnerSetIdle(true);
+        (void)WaitLatch(MyLatch,
+                        WL_LATCH_SET | WL_EXIT_ON_PM_DEATH | WL_TIMEOUT,
+                        timeout,
+                        0);
+        TaskRunnerSetIdle(false);
+      }
     }
   }
 
@@ -204,50 +439,61 @@ static void TaskRunnerReloadConfig(void) {
 
 /* Update execution state to contain information to schedule next wakeup
  * time. Note that the next wakeup time can be in the past.
+ *
+ * The time of the next task is shared between the runners of the
+ * database, so we only query the task table if the shared time was
+ * checked more than the nap time ago, or if "force" is set. A shared
+ * time in the past means that there are due tasks, so it is used as it
+ * is and the runner claims tasks again right away. If the queue is
+ * empty, the runner is woken up when tasks are added, so we only need
+ * to check the queue again after the nap time, or never if the nap
+ * time is zero.
  */
-static void TaskRunnerUpdateState(TaskRunnerState *state) {
-  bool isnull;
-  HeapTuple tup;
-  Datum value;
-
-  TaskRunnerExecuteQuery(&getnextwakeup,
-                         (Datum[]){Int16GetDatum(TaskRunnerNapTime)},
-                         (char[]){' '},
-                         true,
-                         1);
-
-  tup = SPI_tuptable->vals[0];
-  value = SPI_getbinval(tup, SPI_tuptable->tupdesc, 1, &isnull);
-
-  if (isnull)
-    elog(LOG, "next start time was null");
+static void TaskRunnerUpdateState(TaskRunnerState *state, bool force) {
+  TimestampTz next_wakeup;
+  uint64 generation;
+
+  if (!TaskWakeupTimeGet(
+          MyDatabaseId, TaskRunnerNapTime, &next_wakeup, &generation) ||
+      force) {
+    bool isnull;
+    HeapTuple tup;
+    Datum value;
+
+    /* Not read-only, so that the query gets a new snapshot that sees
+     * all tasks added before we got the generation. */
+    TaskRunnerExecuteQuery(&getnextwakeup, NULL, NULL, false, 1);
+
+    tup = SPI_tuptable->vals[0];
+    value = SPI_getbinval(tup, SPI_tuptable->tupdesc, 1, &isnull);
+    next_wakeup = TaskWakeupTimeSet(MyDatabaseId,
+                                    isnull ? DT_NOEND
+                                           : DatumGetTimestampTz(value),
+                                    generation);
+  }
 
-  state->next_wakeup = DatumGetTimestampTz(value);
+  if (next_wakeup != DT_NOEND)
+    state->next_wakeup = next_wakeup;
+  else if (TaskRunnerNapTime > 0)
+    state->next_wakeup = TimestampTzPlusMilliseconds(
+        GetCurrentTimestamp(), TaskRunnerNapTime * 1000L);
+  else
+    state->next_wakeup = DT_NOEND;
 }
 
-static void TaskRunnerExecuteNext(TaskRunnerState *state) {
+/*
+ * Execute a task.
+ *
+ * This only looks up the task function and calls it with the
+ * scheduled time and the configuration of the task. The caller
+ * deletes the task if it succeeds.
+ */
+static void TaskRunnerExecuteTask(HeapTuple tup, TupleDesc tupdesc) {
   bool owner_isnull, exec_isnull;
-  int task_id_attno, task_owner_attno, task_exec_attno;
-  int32 task_id;
+  int task_owner_attno, task_exec_attno;
   Oid task_owner;
-  HeapTuple tup;
-  TupleDesc tupdesc;
   Name task_exec;
 
-  TaskRunnerExecuteQuery(&getnexttask, NULL, NULL, false, 1);
-
-  /*
-   * We either have one or zero rows. If we have zero rows, tasks that are
-   * ready to run have been picked up by other runners, so we just exit and
-   * let the caller figure out when to wake up again.
-   */
-  Assert(SPI_processed <= 1);
-  if (SPI_processed == 0)
-    return;
-
-  tup = SPI_tuptable->vals[0];
-  tupdesc = SPI_tuptable->tupdesc;
-  task_id_attno = SPI_fnumber(tupdesc, "task_id");
   task_owner_attno = SPI_fnumber(tupdesc, "task_owner");
   task_exec_attno = SPI_fnumber(tupdesc, "task_exec");
 
@@ -262,40 +508,18 @@ static void TaskRunnerExecuteNext(TaskRunnerState *state) {
 
   if (!exec_isnull) {
     LOCAL_FCINFO(fcinfo, 2);
-    Oid argtypes[] = {TIMESTAMPTZOID, JSONBOID};
     char *activity;
-    AclResult aclresult;
     PgStat_FunctionCallUsage fcusage;
-    FmgrInfo finfo;
-    bool sched_isnull, config_isnull, task_id_isnull;
-    List *namelist;
-    Oid proc_oid;
+    TaskFunctionCacheEntry *func;
+    bool sched_isnull, config_isnull;
 
     int config_attno = SPI_fnumber(tupdesc, "task_config");
     int sched_attno = SPI_fnumber(tupdesc, "task_sched");
 
-    /* Delete the task before executing. This will be part of the
-     * transaction that reads and locks the row task row, so will not
-     * be committed until we've executed. */
-    task_id = DatumGetObjectId(
-        SPI_getbinval(tup, tupdesc, task_id_attno, &task_id_isnull));
+    func = TaskFunctionLookup(task_exec);
 
-    TaskRunnerExecuteQuery(&deletetask,
-                           (Datum[]){Int32GetDatum(task_id)},
-                           (char[]){' '},
-                           false,
-                           0);
-
-    namelist = stringToQualifiedNameList(NameStr(*task_exec), NULL);
-    proc_oid = LookupFuncName(namelist, 2, argtypes, false);
-    aclresult = object_aclcheck(
-        ProcedureRelationId, proc_oid, GetUserId(), ACL_EXECUTE);
-    if (aclresult != ACLCHECK_OK)
-      aclcheck_error(aclresult, OBJECT_FUNCTION, NameStr(*task_exec));
-
-    InvokeFunctionExecuteHook(proc_oid);
-    fmgr_info(proc_oid, &finfo);
-    InitFunctionCallInfoData(*fcinfo, &finfo, 0, InvalidOid, NULL, NULL);
+    InvokeFunctionExecuteHook(func->proc_oid);
+    InitFunctionCallInfoData(*fcinfo, &func->finfo, 2, InvalidOid, NULL, NULL);
 
     fcinfo->args[0].value =
         SPI_getbinval(tup, tupdesc, sched_attno, &sched_isnull);
@@ -316,6 +540,352 @@ static void TaskRunnerExecuteNext(TaskRunnerState *state) {
   }
 }
 
+/*
+ * Execute a task in a subtransaction.
+ *
+ * If the task fails, only the subtransaction is rolled back, so the
+ * failure can be recorded in the same transaction and the runner
+ * keeps running. Returns NULL if the task succeeded and the error
+ * otherwise.
+ */
+static ErrorData *TaskRunnerExecuteTaskIsolated(HeapTuple tup,
+                                                TupleDesc tupdesc) {
+  MemoryContext oldcontext = CurrentMemoryContext;
+  ResourceOwner oldowner = CurrentResourceOwner;
+  ErrorData *edata = NULL;
+
+  BeginInternalSubTransaction(NULL);
+  MemoryContextSwitchTo(oldcontext);
+
+  PG_TRY();
+  {
+    TaskRunnerExecuteTask(tup, tupdesc);
+
+    ReleaseCurrentSubTransaction();
+    MemoryContextSwitchTo(oldcontext);
+    CurrentResourceOwner = oldowner;
+  }
+  PG_CATCH();
+  {
+    MemoryContextSwitchTo(oldcontext);
+    edata = CopyErrorData();
+    FlushErrorState();
+
+    RollbackAndReleaseCurrentSubTransaction();
+    MemoryContextSwitchTo(oldcontext);
+    CurrentResourceOwner = oldowner;
+
+    pgstat_report_activity(STATE_IDLE, NULL);
+  }
+  PG_END_TRY();
+
+  return edata;
+}
+
+/*
+ * Get the delay before the next attempt of a task that has failed
+ * "attempts" times, in milliseconds.
+ *
+ * The delay is doubled for each failed attempt, starting at
+ * "tasks.retry_delay" and capped at "tasks.max_retry_delay".
+ */
+static int64 TaskRunnerRetryDelay(int32 attempts) {
+  int64 delay = TaskRunnerRetryDelayMs;
+  int64 max_delay = TaskRunnerMaxRetryDelayMs;
+
+  for (int32 i = 1; i < attempts && delay < max_delay; i++)
+    delay *= 2;
+
+  return Min(delay, max_delay);
+}
+
+/*
+ * Handle a failed task.
+ *
+ * The task is still leased by us with the lease "task_lease" and is in
+ * the partition "task_part". If the task has attempts left, it is
+ * rescheduled with exponential backoff and the lease is released,
+ * otherwise it is moved to the failed task table together with the
+ * error.
+ */
+static void TaskRunnerTaskFailed(int32 task_id, int32 attempts,
+                                 Datum task_lease, Datum task_part,
+                                 ErrorData *edata) {
+  if (attempts < TaskRunnerMaxAttempts) {
+    TimestampTz retry_at = TimestampTzPlusMilliseconds(
+        GetCurrentTimestamp(), TaskRunnerRetryDelay(attempts));
+
+    ereport(WARNING,
+            (errcode(edata->sqlerrcode),
+             errmsg("task %d failed in attempt %d of %d, retrying at %s: %s",
+                    task_id,
+                    attempts,
+                    TaskRunnerMaxAttempts,
+                    timestamptz_to_str(retry_at),
+                    edata->message),
+             edata->detail ? errdetail_internal("%s", edata->detail) : 0,
+             edata->hint ? errhint("%s", edata->hint) : 0));
+
+    TaskRunnerExecuteQuery(&retrytask,
+                           (Datum[]){Int32GetDatum(task_id),
+                                     TimestampTzGetDatum(retry_at),
+                                     task_lease,
+                                     task_part},
+                           (char[]){' ', ' ', ' ', ' '},
+                           false,
+                           0);
+  } else {
+    ereport(WARNING,
+            (errcode(edata->sqlerrcode),
+             errmsg("task %d failed in attempt %d of %d, giving up: %s",
+                    task_id,
+                    attempts,
+                    TaskRunnerMaxAttempts,
+                    edata->message),
+             edata->detail ? errdetail_internal("%s", edata->detail) : 0,
+             edata->hint ? errhint("%s", edata->hint) : 0));
+
+    TaskRunnerExecuteQuery(&failtask,
+                           (Datum[]){Int32GetDatum(task_id),
+                                     CStringGetTextDatum(edata->message),
+                                     task_lease,
+                                     task_part},
+                           (char[]){' ', ' ', ' ', ' '},
+                           false,
+                           0);
+  }
+}
+
+/*
+ * Start a transaction with an SPI connection and a snapshot.
+ */
+static void TaskRunnerBeginTransaction(void) {
+  SetCurrentStatementStartTimestamp();
+  StartTransactionCommand();
+
+  if (SPI_connect_ext(SPI_OPT_NONATOMIC) != SPI_OK_CONNECT)
+    elog(ERROR, "%s: SPI_connect_ext failed", __func__);
+
+  PushActiveSnapshot(GetTransactionSnapshot());
+}
+
+/*
+ * Commit a transaction started with TaskRunnerBeginTransaction().
+ */
+static void TaskRunnerCommitTransaction(void) {
+  if (SPI_finish() != SPI_OK_FINISH)
+    elog(ERROR, "%s: SPI_finish() failed", __func__);
+
+  PopActiveSnapshot();
+  CommitTransactionCommand();
+  pgstat_report_stat(false);
+}
+
+/*
+ * Add the tasks claimed by the last query to a batch.
+ */
+static void TaskRunnerBatchAdd(TaskRunnerBatch *batch,
+                               MemoryContext batchcxt) {
+  MemoryContext oldcontext = MemoryContextSwitchTo(batchcxt);
+
+  if (batch->tupdesc == NULL && SPI_processed > 0)
+    batch->tupdesc = CreateTupleDescCopy(SPI_tuptable->tupdesc);
+  for (uint64 i = 0; i < SPI_processed; i++)
+    batch->tasks[batch->ntasks++] = heap_copytuple(SPI_tuptable->vals[i]);
+  MemoryContextSwitchTo(oldcontext);
+
+  SPI_freetuptable(SPI_tuptable);
+}
+
+/*
+ * Claim a batch of tasks that are due.
+ *
+ * Up to "tasks.batch_size" tasks are leased with one or two statements
+ * and copied into the batch memory context, so that they can be
+ * executed after the claiming transaction has committed. Other
+ * runners skip the tasks until the lease expires, so if the runner
+ * dies before it has executed the tasks, they are picked up again
+ * when the lease expires.
+ *
+ * The task table is split into TASK_SHARDS shards by the hash of
+ * task_shard_key, or task_id if it is not set, and each runner owns
+ * the shards whose number modulo the number of runners is its rank
+ * among the runners of the database. Runners only compete for the
+ * same tasks when they steal tasks from other shards, which they only
+ * do when their own shards do not have enough due tasks. This means
+ * that the priority order is only followed within the shards of each
+ * runner.
+ *
+ * Returns NULL if there were no tasks to claim.
+ */
+static TaskRunnerBatch *TaskRunnerClaimNext(MemoryContext batchcxt) {
+  MemoryContext oldcontext = MemoryContextSwitchTo(batchcxt);
+  TaskRunnerBatch *batch;
+  int rank, nrunners;
+
+  batch = palloc(offsetof(TaskRunnerBatch, tasks) +
+                 TaskRunnerBatchSize * sizeof(HeapTuple));
+  batch->tupdesc = NULL;
+  batch->ntasks = 0;
+  MemoryContextSwitchTo(oldcontext);
+
+  /*
+   * Claim tasks from the shards we own first. If they do not have
+   * enough due tasks, steal the rest from any shard.
+   */
+  TaskRunnerRank(&rank, &nrunners);
+  if (rank < TASK_SHARDS) {
+    Datum shards[TASK_SHARDS];
+    int nowned = 0;
+
+    for (int shard = rank; shard < TASK_SHARDS; shard += nrunners)
+      shards[nowned++] = Int16GetDatum(shard);
+
+    TaskRunnerExecuteQuery(
+        &getnextshardtask,
+        (Datum[]){Int32GetDatum(TaskRunnerBatchSize),
+                  Int32GetDatum(TaskRunnerLeaseTime),
+                  PointerGetDatum(
+                      construct_array_builtin(shards, nowned, INT2OID))},
+        (char[]){' ', ' ', ' '},
+        false,
+        0);
+    TaskRunnerBatchAdd(batch, batchcxt);
+  }
+
+  if (batch->ntasks < TaskRunnerBatchSize) {
+    TaskRunnerExecuteQuery(
+        &getnexttask,
+        (Datum[]){Int32GetDatum(TaskRunnerBatchSize - batch->ntasks),
+                  Int32GetDatum(TaskRunnerLeaseTime)},
+        (char[]){' ', ' '},
+        false,
+        0);
+    TaskRunnerBatchAdd(batch, batchcxt);
+  }
+
+  /*
+   * If we have zero rows, tasks that are ready to run have been
+   * picked up by other runners, so we just exit and let the caller
+   * figure out when to wake up again.
+   */
+  if (batch->ntasks == 0)
+    return NULL;
+
+  return batch;
+}
+
+/*
+ * Release the leases of claimed tasks that we will not execute, so
+ * that other runners can pick them up without waiting for the leases
+ * to expire.
+ */
+static void TaskRunnerReleaseTasks(TaskRunnerBatch *batch, int first) {
+  int task_id_attno = SPI_fnumber(batch->tupdesc, "task_id");
+  int lease_attno = SPI_fnumber(batch->tupdesc, "task_lease");
+  Datum *task_ids = palloc_array(Datum, batch->ntasks - first);
+  Datum task_lease;
+  bool isnull;
+
+  for (int i = first; i < batch->ntasks; i++)
+    task_ids[i - first] = SPI_getbinval(
+        batch->tasks[i], batch->tupdesc, task_id_attno, &isnull);
+  task_lease = SPI_getbinval(
+      batch->tasks[first], batch->tupdesc, lease_attno, &isnull);
+
+  TaskRunnerBeginTransaction();
+  TaskRunnerExecuteQuery(
+      &releasetasks,
+      (Datum[]){PointerGetDatum(construct_array_builtin(
+                    task_ids, batch->ntasks - first, INT4OID)),
+                task_lease},
+      (char[]){' ', ' '},
+      false,
+      0);
+  TaskRunnerCommitTransaction();
+}
+
+/*
+ * Execute a batch of claimed tasks.
+ *
+ * Each task is executed in a transaction of its own, which deletes the
+ * task if it succeeds and reschedules or moves it to the failed task
+ * table if it fails. This means that a long-running task does not keep
+ * a snapshot or locks on other tasks, and that the task is deleted if
+ * and only if its changes are committed.
+ *
+ * The tasks are executed one after the other, so the lease of a task
+ * late in the batch can expire before we get to it and another runner
+ * can have claimed it. The transaction therefore starts by renewing
+ * the lease, which also locks the task so that it cannot be claimed
+ * while it executes, and skips the task if the lease is not ours.
+ */
+static void TaskRunnerExecuteBatch(TaskRunnerState *state,
+                                   TaskRunnerBatch *batch) {
+  int task_id_attno = SPI_fnumber(batch->tupdesc, "task_id");
+  int attempts_attno = SPI_fnumber(batch->tupdesc, "task_attempts");
+  int lease_attno = SPI_fnumber(batch->tupdesc, "task_lease");
+  int part_attno = SPI_fnumber(batch->tupdesc, "task_part");
+
+  for (int i = 0; i < batch->ntasks; i++) {
+    HeapTuple tup = batch->tasks[i];
+    bool isnull;
+    Datum task_id, task_lease, task_part;
+    ErrorData *edata;
+
+    if (ShutdownRequestPending) {
+      TaskRunnerReleaseTasks(batch, i);
+      break;
+    }
+
+    TaskRunnerBeginTransaction();
+
+    task_id = SPI_getbinval(tup, batch->tupdesc, task_id_attno, &isnull);
+    task_lease = SPI_getbinval(tup, batch->tupdesc, lease_attno, &isnull);
+    task_part = SPI_getbinval(tup, batch->tupdesc, part_attno, &isnull);
+    TaskRunnerExecuteQuery(&renewtask,
+                           (Datum[]){task_id,
+                                     Int32GetDatum(TaskRunnerLeaseTime),
+                                     task_lease,
+                                     task_part},
+                           (char[]){' ', ' ', ' ', ' '},
+                           false,
+                           0);
+    if (SPI_processed == 0) {
+      ereport(DEBUG1,
+              (errmsg("skipping task %d since its lease has expired",
+                      DatumGetInt32(task_id))));
+      TaskRunnerCommitTransaction();
+      continue;
+    }
+    task_lease = SPI_getbinval(
+        SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+
+    edata = TaskRunnerExecuteTaskIsolated(tup, batch->tupdesc);
+
+    if (edata == NULL) {
+      TaskRunnerExecuteQuery(&deletetask,
+                             (Datum[]){task_id, task_lease, task_part},
+                             (char[]){' ', ' ', ' '},
+                             false,
+                             0);
+    } else {
+      int32 attempts = DatumGetInt32(
+          SPI_getbinval(tup, batch->tupdesc, attempts_attno, &isnull));
+      TaskRunnerTaskFailed(DatumGetInt32(task_id),
+                           attempts + 1,
+                           task_lease,
+                           task_part,
+                           edata);
+      FreeErrorData(edata);
+    }
+
+    TaskRunnerCommitTransaction();
+  }
+
+  state->last_active = GetCurrentTimestamp();
+}
+
 /*
  * Prepare and execute a query.
  *
@@ -348,45 +918,85 @@ void TaskRunnerExecuteQuery(TaskRunnerQuery *query, Datum values[],
   pgstat_report_activity(STATE_IDLE, NULL);
 }
 
-Datum tasks_start(PG_FUNCTION_ARGS) {
+/*
+ * Start a dynamic background worker connected to the database in the
+ * arguments and wait for it to start.
+ *
+ * Returns false if there was no free background worker slot.
+ */
+bool TaskWorkerStart(const char *function, const char *type,
+                     const char *name, TaskRunnerArgs *args,
+                     int restart_time) {
   BackgroundWorker worker;
-  TaskRunnerArgs args = {
-      .roleoid = GetUserId(),
-      .dboid = MyDatabaseId,
-  };
+  BackgroundWorkerHandle *handle;
+  BgwHandleStatus status;
+  pid_t pid;
 
   memset(&worker, 0, sizeof(worker));
   worker.bgw_flags =
       BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
   worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
-  worker.bgw_restart_time = TaskRunnerRestartTime;
+  worker.bgw_restart_time = restart_time;
   sprintf(worker.bgw_library_name, "tasks");
-  sprintf(worker.bgw_function_name, "TaskRunnerMain");
-  snprintf(worker.bgw_type, BGW_MAXLEN, "Task Runner");
+  snprintf(worker.bgw_function_name, BGW_MAXLEN, "%s", function);
+  snprintf(worker.bgw_name, BGW_MAXLEN, "%s", name);
+  snprintf(worker.bgw_type, BGW_MAXLEN, "%s", type);
   worker.bgw_notify_pid = MyProcPid;
   worker.bgw_main_arg = 0; /* This should be the DSM segment handle */
-  memcpy(worker.bgw_extra, &args, sizeof(args));
+  memcpy(worker.bgw_extra, args, sizeof(*args));
 
-  for (int i = 1; i <= TaskTotalRunners; i++) {
-    BackgroundWorkerHandle *handle;
-    BgwHandleStatus status;
-    pid_t pid;
+  if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+    return false;
 
-    snprintf(worker.bgw_name, BGW_MAXLEN, "%s %d", worker.bgw_type, i);
+  status = WaitForBackgroundWorkerStartup(handle, &pid);
+  if (status != BGWH_STARTED)
+    ereport(ERROR,
+            (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+             errmsg("could not start background process"),
+             errhint("More details may be available in the server log.")));
+  return true;
+}
 
-    if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+/*
+ * Start the task runners for the current database.
+ *
+ * If "tasks.max_workers" is larger than "tasks.workers", a supervisor
+ * is started as well, which starts dynamic runners when the queue
+ * grows.
+ */
+Datum tasks_start(PG_FUNCTION_ARGS) {
+  TaskRunnerArgs args = {
+      .roleoid = GetUserId(),
+      .dynamic = false,
+      .dboid = MyDatabaseId,
+  };
+
+  for (int i = 1; i <= TaskTotalRunners; i++) {
+    char name[BGW_MAXLEN];
+
+    snprintf(name, sizeof(name), "Task Runner %d", i);
+    if (!TaskWorkerStart("TaskRunnerMain",
+                         "Task Runner",
+                         name,
+                         &args,
+                         TaskRunnerRestartTime))
       ereport(ERROR,
               (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
                errmsg("could not register background process"),
                errhint("You may need to increase \"max_worker_processes\".")));
-    status = WaitForBackgroundWorkerStartup(handle, &pid);
-    if (status != BGWH_STARTED)
-      ereport(ERROR,
-              (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
-               errmsg("could not start background process"),
-               errhint("More details may be available in the server log.")));
   }
 
+  if (TaskMaxRunners > TaskTotalRunners &&
+      !TaskWorkerStart("TaskSupervisorMain",
+                       "Task Supervisor",
+                       "Task Supervisor",
+                       &args,
+                       TaskRunnerRestartTime))
+    ereport(ERROR,
+            (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+             errmsg("could not register background process"),
+             errhint("You may need to increase \"max_worker_processes\".")));
+
   PG_RETURN_VOID();
 }
 
@@ -399,6 +1009,7 @@ void _PG_init(void) {
   TaskRunnerArgs args = {
       .dboid = InvalidOid,
       .roleoid = InvalidOid,
+      .dynamic = false,
   };
 
   if (!process_shared_preload_libraries_in_progress)
@@ -417,6 +1028,64 @@ void _PG_init(void) {
                           NULL,
                           NULL);
 
+  DefineCustomIntVariable("tasks.max_workers",
+                          "Maximum number of workers, including dynamic "
+                          "workers.",
+                          "If larger than \"tasks.workers\", a supervisor "
+                          "starts dynamic workers when the task queue grows "
+                          "and they exit when they have been idle for "
+                          "\"tasks.idle_timeout\".",
+                          &TaskMaxRunners,
+                          0,
+                          0,
+                          1000,
+                          PGC_POSTMASTER,
+                          0,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("tasks.idle_timeout",
+                          "Time before an idle dynamic worker exits.",
+                          NULL,
+                          &TaskRunnerIdleTimeout,
+                          60,
+                          1,
+                          INT_MAX / 1000,
+                          PGC_SIGHUP,
+                          GUC_UNIT_S,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("tasks.scale_interval",
+                          "Time between checks of the task queue by the "
+                          "supervisor.",
+                          NULL,
+                          &TaskSupervisorInterval,
+                          1000,
+                          10,
+                          INT_MAX,
+                          PGC_SIGHUP,
+                          GUC_UNIT_MS,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("tasks.scale_up_lag",
+                          "Lag of the oldest due task that makes the "
+                          "supervisor start another worker.",
+                          NULL,
+                          &TaskSupervisorScaleUpLag,
+                          1000,
+                          0,
+                          INT_MAX,
+                          PGC_SIGHUP,
+                          GUC_UNIT_MS,
+                          NULL,
+                          NULL,
+                          NULL);
+
   DefineCustomIntVariable("tasks.restart_time",
                           "Restart time for workers, in seconds.",
                           NULL,
@@ -432,10 +1101,13 @@ void _PG_init(void) {
 
   DefineCustomIntVariable("tasks.nap_time",
                           "Nap time for workers, in seconds.",
-                          NULL,
+                          "Workers are woken up when tasks are added, so "
+                          "this is only used to check an empty queue for "
+                          "tasks added without firing triggers. Zero means "
+                          "that workers only check when woken up.",
                           &TaskRunnerNapTime,
-                          1,
-                          1,
+                          60,
+                          0,
                           3600,
                           PGC_POSTMASTER,
                           GUC_UNIT_S,
@@ -443,6 +1115,92 @@ void _PG_init(void) {
                           NULL,
                           NULL);
 
+  DefineCustomIntVariable("tasks.batch_size",
+                          "Maximum number of tasks claimed at a time.",
+                          "Due tasks are claimed in batches to share the cost "
+                          "of claiming them between the tasks. Each task is "
+                          "executed in a transaction of its own.",
+                          &TaskRunnerBatchSize,
+                          10,
+                          1,
+                          1000,
+                          PGC_SIGHUP,
+                          0,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("tasks.lease_time",
+                          "Time a claimed task is leased to a worker.",
+                          "Other workers do not execute the task until the "
+                          "lease expires, so it has to be long enough for a "
+                          "worker to execute a whole batch of tasks.",
+                          &TaskRunnerLeaseTime,
+                          300,
+                          1,
+                          INT_MAX / 1000,
+                          PGC_SIGHUP,
+                          GUC_UNIT_S,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("tasks.rotate_interval",
+                          "Time between rotations of the task table "
+                          "partitions.",
+                          "Drained partitions are truncated when the queue "
+                          "is rotated. Zero means that the queue is not "
+                          "rotated.",
+                          &TaskRunnerRotateInterval,
+                          0,
+                          0,
+                          INT_MAX / 1000,
+                          PGC_SIGHUP,
+                          GUC_UNIT_S,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("tasks.max_attempts",
+                          "Maximum number of attempts to execute a task.",
+                          "Tasks that fail this many times are moved to "
+                          "the failed task table.",
+                          &TaskRunnerMaxAttempts,
+                          5,
+                          1,
+                          INT_MAX,
+                          PGC_SIGHUP,
+                          0,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("tasks.retry_delay",
+                          "Delay before retrying a failed task.",
+                          "The delay is doubled for each failed attempt.",
+                          &TaskRunnerRetryDelayMs,
+                          10000,
+                          0,
+                          INT_MAX,
+                          PGC_SIGHUP,
+                          GUC_UNIT_MS,
+                          NULL,
+                          NULL,
+                          NULL);
+
+  DefineCustomIntVariable("tasks.max_retry_delay",
+                          "Maximum delay before retrying a failed task.",
+                          NULL,
+                          &TaskRunnerMaxRetryDelayMs,
+                          3600000,
+                          0,
+                          INT_MAX,
+                          PGC_SIGHUP,
+                          GUC_UNIT_MS,
+                          NULL,
+                          NULL,
+                          NULL);
+
   DefineCustomStringVariable(
       "tasks.databases",
       "Databases to start workers for.",
@@ -487,5 +1245,14 @@ void _PG_init(void) {
       memcpy(worker.bgw_extra, &args, sizeof(args));
       RegisterBackgroundWorker(&worker);
     }
+
+    if (TaskMaxRunners > TaskTotalRunners) {
+      snprintf(worker.bgw_function_name, BGW_MAXLEN, "TaskSupervisorMain");
+      snprintf(worker.bgw_type, BGW_MAXLEN, "Task Supervisor");
+      snprintf(worker.bgw_name, BGW_MAXLEN, "Task Supervisor");
+      RegisterBackgroundWorker(&worker);
+      snprintf(worker.bgw_function_name, BGW_MAXLEN, "TaskRunnerMain");
+      snprintf(worker.bgw_type, BGW_MAXLEN, "Task Runner");
+    }
   }
 }
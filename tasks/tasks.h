@@ -11,6 +11,9 @@
 #include <datatype/timestamp.h>
 #include <executor/spi.h>
 #include <postmaster/bgworker.h>
+#include <storage/latch.h>
+#include <storage/lwlock.h>
+#include <utils/acl.h>
 
 #if PG_VERSION_NUM < 180000
 #if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
@@ -26,25 +29,93 @@
 
 #define TASK_RUNNER_MAGIC 0xdeadbeef /* Temporary magic number */
 
+/* Number of shards of the task table, which has to match task_shard */
+#define TASK_SHARDS 16
+
 /*
  * Task runner arguments passed down through bgw_extra.
  *
  * Depending on the value of roleoid, use either the database name or
  * database OID for worker. If roleoid is InvalidOid, use the dbname,
  * otherwise, use dboid.
+ *
+ * Dynamic runners are started by the supervisor when the queue grows
+ * and exit when they have been idle for a while.
  */
 typedef struct TaskRunnerArgs {
   Oid roleoid;
+  bool dynamic;
   union {
-    char dbname[BGW_EXTRALEN - sizeof(Oid) - 1];
+    char dbname[BGW_EXTRALEN - 2 * sizeof(Oid)];
     Oid dboid;
   };
 } TaskRunnerArgs;
 
+StaticAssertDecl(sizeof(TaskRunnerArgs) <= BGW_EXTRALEN,
+                 "task runner arguments do not fit in bgw_extra");
+
 typedef struct TaskRunnerState {
   TimestampTz next_wakeup;
+  TimestampTz last_active;
+  TimestampTz next_rotate;
 } TaskRunnerState;
 
+/*
+ * Tasks claimed by a task runner, which are copied out of the SPI
+ * tuple table so that they survive the claiming transaction.
+ */
+typedef struct TaskRunnerBatch {
+  TupleDesc tupdesc;
+  int ntasks;
+  HeapTuple tasks[FLEXIBLE_ARRAY_MEMBER];
+} TaskRunnerBatch;
+
+/*
+ * Registry of task runners in shared memory.
+ *
+ * Each task runner has a slot with the database it is connected to
+ * and its latch, which is used to wake it up when tasks are added to
+ * the task table. Free slots have an invalid database OID. The slots
+ * are protected by the lock.
+ */
+typedef struct TaskRunnerSlot {
+  Oid dboid;
+  bool idle;
+  Latch *latch;
+} TaskRunnerSlot;
+
+/*
+ * Time of the next scheduled task in a database, which is a lower
+ * bound of the earliest task_sched in the task table. The generation
+ * is increased each time tasks are added, and the time is read from
+ * the task table again if it was checked more than the nap time ago.
+ */
+typedef struct TaskWakeupTime {
+  Oid dboid;
+  uint64 generation;
+  TimestampTz next_wakeup;
+  TimestampTz checked_at;
+} TaskWakeupTime;
+
+typedef struct TaskRunnerRegistry {
+  int tranche_id;
+  LWLock lock;
+  int nslots;
+  TaskWakeupTime *wakeups; /* nslots entries after the slots */
+  TaskRunnerSlot slots[FLEXIBLE_ARRAY_MEMBER];
+} TaskRunnerRegistry;
+
+/*
+ * Cached lookup of a task function by the name in task_exec, together
+ * with the result of checking that the runner can execute it.
+ */
+typedef struct TaskFunctionCacheEntry {
+  NameData name; /* Hash key */
+  Oid proc_oid;
+  AclResult aclresult;
+  FmgrInfo finfo;
+} TaskFunctionCacheEntry;
+
 /*
  * Structure for query and query plan. These are used to prepare the
  * query and save away the query plan.
@@ -61,8 +132,35 @@ typedef struct TaskRunnerQuery {
 
 extern PGDLLEXPORT Datum tasks_start(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum tasks_stop(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum tasks_wakeup(PG_FUNCTION_ARGS);
 
 extern PGDLLEXPORT pg_noreturn void TaskRunnerMain(Datum main_arg);
+extern PGDLLEXPORT pg_noreturn void TaskSupervisorMain(Datum main_arg);
 extern PGDLLEXPORT void TaskRunnerExecuteQuery(TaskRunnerQuery *trq,
                                                Datum values[], char nulls[],
                                                bool read_only, int tcount);
+
+extern bool TaskWorkerStart(const char *function, const char *type,
+                            const char *name, TaskRunnerArgs *args,
+                            int restart_time);
+
+extern void TaskRunnerRegister(void);
+extern void TaskRunnerSetIdle(bool idle);
+extern void TaskRunnerWakeup(Oid dboid, int count);
+extern void TaskRunnerCount(Oid dboid, int *nrunners, int *nidle);
+extern void TaskRunnerRank(int *rank, int *nrunners);
+extern bool TaskWakeupTimeGet(Oid dboid, int nap_time,
+                              TimestampTz *next_wakeup, uint64 *generation);
+extern TimestampTz TaskWakeupTimeSet(Oid dboid, TimestampTz next_wakeup,
+                                     uint64 generation);
+
+extern void TaskCacheInit(void);
+extern TaskFunctionCacheEntry *TaskFunctionLookup(Name task_exec);
+
+extern bool TaskTableChanged;
+extern int TaskTotalRunners;
+extern int TaskMaxRunners;
+extern int TaskRunnerRestartTime;
+extern int TaskRunnerBatchSize;
+extern int TaskSupervisorInterval;
+extern int TaskSupervisorScaleUpLag;
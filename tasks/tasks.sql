@@ -1,18 +1,142 @@
 \echo Use "CREATE EXTENSION tasks" to load this file. \quit
 
-create sequence @extschema@.task_id_seq as integer minvalue 1 cycle;
+-- The primary key of the partitioned task table has to include the
+-- partition key, so it does not make task_id unique on its own. The
+-- sequence does not cycle, so that task identifiers are never reused.
+create sequence @extschema@.task_id_seq as integer minvalue 1;
+
+-- The task table is partitioned into a ring of partitions. Tasks are
+-- added to the current partition, and rotate_queue() moves on to the
+-- next partition, which is truncated when it has been drained, so
+-- executed tasks do not leave dead rows behind for vacuum.
+create table @extschema@.queue_state (
+    current_part smallint not null,
+    rotated_at timestamptz not null default now()
+);
+
+insert into @extschema@.queue_state(current_part) values (0);
+
+create function @extschema@.queue_partition() returns smallint
+    as $$ select current_part from @extschema@.queue_state $$
+    language sql stable;
 
 create table @extschema@.task (
     task_id integer not null default nextval('@extschema@.task_id_seq'::regclass),
     task_sched timestamptz,
+    task_priority integer not null default 0,
     task_owner regrole,
     task_exec name,
     task_config jsonb,
-    primary key (task_id)
-);
+    task_attempts integer not null default 0,
+    task_lease timestamptz,
+    task_part smallint not null default @extschema@.queue_partition(),
+    task_shard_key integer,
+    task_shard smallint generated always as
+        (hashint4(coalesce(task_shard_key, task_id)) & 15) stored,
+    primary key (task_id, task_part)
+) partition by list (task_part);
+
+create table @extschema@.task_0 partition of @extschema@.task for values in (0);
+create table @extschema@.task_1 partition of @extschema@.task for values in (1);
+create table @extschema@.task_2 partition of @extschema@.task for values in (2);
+create table @extschema@.task_3 partition of @extschema@.task for values in (3);
 
 alter sequence @extschema@.task_id_seq owned by @extschema@.task.task_id;
 
-select pg_catalog.pg_extension_config_dump('@extschema@.task', '');
+-- Index for claiming due tasks in priority order and index for
+-- finding the next scheduled task.
+create index task_priority_sched_idx
+    on @extschema@.task (task_priority, task_sched);
+create index task_sched_idx on @extschema@.task (task_sched);
+
+-- Index for claiming due tasks of a shard in priority order. The
+-- number of shards has to match TASK_SHARDS in tasks.h.
+create index task_shard_priority_sched_idx
+    on @extschema@.task (task_shard, task_priority, task_sched);
+
+-- Index for finding the earliest lease that expires. Only claimed
+-- tasks are leased, so the index is small.
+create index task_lease_idx on @extschema@.task (task_lease)
+    where task_lease is not null;
+
+select pg_catalog.pg_extension_config_dump('@extschema@.task_0', '');
+select pg_catalog.pg_extension_config_dump('@extschema@.task_1', '');
+select pg_catalog.pg_extension_config_dump('@extschema@.task_2', '');
+select pg_catalog.pg_extension_config_dump('@extschema@.task_3', '');
+select pg_catalog.pg_extension_config_dump('@extschema@.queue_state', '');
+
+-- Rotate the queue to the next partition, if the queue was last
+-- rotated at least "min_age" ago.
+--
+-- The next partition is the oldest one, which normally has been
+-- drained. Tasks that are still in it, for example tasks scheduled
+-- far ahead, are moved to the current partition before the partition
+-- is truncated. Only one session rotates the queue at a time, and the
+-- rotation is skipped if the partition is in use, so this can be
+-- called by all runners. Returns true if the queue was rotated.
+create function @extschema@.rotate_queue(min_age interval default '0')
+returns boolean as $$
+declare
+    state record;
+    next_part smallint;
+    part regclass;
+begin
+    select * into state from @extschema@.queue_state
+     where rotated_at <= now() - min_age
+       for update skip locked;
+    if not found then
+        return false;
+    end if;
+
+    next_part := (state.current_part + 1) % 4;
+    part := format('@extschema@.task_%s', next_part)::regclass;
+
+    begin
+        execute format('lock table %s in access exclusive mode nowait', part);
+    exception when lock_not_available then
+        return false;
+    end;
+
+    execute format(
+        'with moved as (delete from %s returning *) '
+        'insert into @extschema@.task (task_id, task_sched, task_priority, '
+        'task_owner, task_exec, task_config, task_attempts, task_lease, '
+        'task_shard_key, task_part) '
+        'select task_id, task_sched, task_priority, task_owner, task_exec, '
+        'task_config, task_attempts, task_lease, task_shard_key, $1 '
+        'from moved', part)
+        using state.current_part;
+    execute format('truncate %s', part);
+
+    update @extschema@.queue_state
+       set current_part = next_part, rotated_at = now();
+    return true;
+end;
+$$ language plpgsql;
+
+-- Tasks that failed "tasks.max_attempts" times, together with the
+-- error of the last attempt.
+create table @extschema@.failed_task (
+    task_id integer not null,
+    task_sched timestamptz,
+    task_priority integer not null,
+    task_owner regrole,
+    task_exec name,
+    task_config jsonb,
+    task_shard_key integer,
+    task_attempts integer not null,
+    task_error text,
+    task_failed timestamptz not null default now(),
+    primary key (task_id, task_failed)
+);
+
+select pg_catalog.pg_extension_config_dump('@extschema@.failed_task', '');
 
 create procedure @extschema@.start_runners() as 'MODULE_PATHNAME', 'tasks_start' language c;
+
+create function @extschema@.wakeup_runners() returns trigger
+    as 'MODULE_PATHNAME', 'tasks_wakeup' language c;
+
+create trigger wakeup_runners
+    before insert or update of task_sched on @extschema@.task
+    for each row execute function @extschema@.wakeup_runners();
@@ -0,0 +1,419 @@
+/*
+ * This file and its contents are licensed under the Apache License 2.0.
+ * Please see the included NOTICE for copyright information and
+ * LICENSE-APACHE for a copy of the license.
+ */
+
+/*
+ * Wakeup of task runners when tasks are added.
+ *
+ * Task runners register their latch in a registry in shared memory
+ * and mark themselves as idle while they sleep. When a transaction
+ * that inserted or rescheduled tasks commits, an idle runner for the
+ * database is woken up so that it can look for the new tasks. If no
+ * runner is idle, all runners for the database are woken up, which
+ * makes sure that a runner that is just about to go to sleep looks
+ * for tasks again.
+ *
+ * The registry also keeps the time of the next scheduled task for each
+ * database, so that runners do not all have to query the task table to
+ * find out when to wake up. The time is a lower bound: removing tasks
+ * never makes it wrong, only early, and tasks that are added lower it
+ * when the transaction commits. A runner that finds the time in the
+ * past, or older than the nap time, reads it again from the task table,
+ * which remains the source of truth and is used to rebuild the time
+ * after a restart.
+ */
+
+#include "tasks.h"
+
+#include <postgres.h>
+#include <fmgr.h>
+
+#include <miscadmin.h>
+
+#include <access/htup_details.h>
+#include <access/xact.h>
+#include <commands/trigger.h>
+#include <executor/spi.h>
+#include <postmaster/bgworker.h>
+#include <storage/ipc.h>
+#include <storage/latch.h>
+#include <storage/lwlock.h>
+#include <storage/proc.h>
+#include <storage/shmem.h>
+#include <utils/timestamp.h>
+
+PG_FUNCTION_INFO_V1(tasks_wakeup);
+
+static TaskRunnerRegistry *TaskRegistry = NULL;
+static TaskRunnerSlot *TaskRunnerMySlot = NULL;
+static int64 TaskWakeupPending = 0;
+static TimestampTz TaskWakeupPendingTime = DT_NOEND;
+static bool TaskWakeupCallbackRegistered = false;
+
+/*
+ * Get the registry, initializing it if this is the first process
+ * using it.
+ *
+ * There can never be more runners than background workers, so the
+ * registry has one slot for each background worker.
+ */
+static TaskRunnerRegistry *TaskRunnerRegistryGet(void) {
+  Size size;
+  bool found;
+
+  if (TaskRegistry != NULL)
+    return TaskRegistry;
+
+  size = add_size(offsetof(TaskRunnerRegistry, slots),
+                  mul_size(sizeof(TaskRunnerSlot), max_worker_processes));
+  size = add_size(size,
+                  mul_size(sizeof(TaskWakeupTime), max_worker_processes));
+
+  LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+  TaskRegistry = ShmemInitStruct("tasks runner registry", size, &found);
+  if (!found) {
+    memset(TaskRegistry, 0, size);
+    TaskRegistry->tranche_id = LWLockNewTrancheId();
+    TaskRegistry->nslots = max_worker_processes;
+    TaskRegistry->wakeups =
+        (TaskWakeupTime *)&TaskRegistry->slots[max_worker_processes];
+    LWLockInitialize(&TaskRegistry->lock, TaskRegistry->tranche_id);
+  }
+  LWLockRelease(AddinShmemInitLock);
+
+  LWLockRegisterTranche(TaskRegistry->tranche_id, "tasks");
+
+  return TaskRegistry;
+}
+
+static void TaskRunnerUnregister(int code, Datum arg) {
+  TaskRunnerRegistry *registry = TaskRunnerRegistryGet();
+
+  LWLockAcquire(&registry->lock, LW_EXCLUSIVE);
+  TaskRunnerMySlot->dboid = InvalidOid;
+  TaskRunnerMySlot->idle = false;
+  TaskRunnerMySlot->latch = NULL;
+  LWLockRelease(&registry->lock);
+
+  TaskRunnerMySlot = NULL;
+}
+
+/*
+ * Register the task runner in the registry so that it can be woken
+ * up when tasks are added to the database it is connected to.
+ */
+void TaskRunnerRegister(void) {
+  TaskRunnerRegistry *registry = TaskRunnerRegistryGet();
+
+  Assert(TaskRunnerMySlot == NULL);
+
+  LWLockAcquire(&registry->lock, LW_EXCLUSIVE);
+  for (int i = 0; i < registry->nslots; i++) {
+    TaskRunnerSlot *slot = &registry->slots[i];
+    if (!OidIsValid(slot->dboid)) {
+      slot->dboid = MyDatabaseId;
+      slot->idle = false;
+      slot->latch = MyLatch;
+      TaskRunnerMySlot = slot;
+      break;
+    }
+  }
+  LWLockRelease(&registry->lock);
+
+  if (TaskRunnerMySlot == NULL)
+    ereport(ERROR,
+            (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+             errmsg("no free slot in the task runner registry")));
+
+  before_shmem_exit(TaskRunnerUnregister, 0);
+}
+
+/*
+ * Mark the task runner as idle or busy.
+ *
+ * A runner is idle while it waits on its latch and is picked before
+ * busy runners when a task is added.
+ */
+void TaskRunnerSetIdle(bool idle) {
+  TaskRunnerRegistry *registry = TaskRunnerRegistryGet();
+
+  LWLockAcquire(&registry->lock, LW_EXCLUSIVE);
+  TaskRunnerMySlot->idle = idle;
+  LWLockRelease(&registry->lock);
+}
+
+/*
+ * Wake up task runners for a database.
+ *
+ * We pick up to "count" idle runners and mark them as busy, so that
+ * concurrent wakeups pick different runners. If there are no idle
+ * runners, we set the latch of all runners for the database. They
+ * are either executing a task or about to go to sleep, and in the
+ * latter case they might have looked for tasks before the new tasks
+ * were committed, so they need to look again.
+ */
+void TaskRunnerWakeup(Oid dboid, int count) {
+  TaskRunnerRegistry *registry = TaskRunnerRegistryGet();
+  int found = 0;
+
+  LWLockAcquire(&registry->lock, LW_EXCLUSIVE);
+  for (int i = 0; i < registry->nslots && found < count; i++) {
+    TaskRunnerSlot *slot = &registry->slots[i];
+    if (slot->dboid == dboid && slot->idle) {
+      slot->idle = false;
+      SetLatch(slot->latch);
+      found++;
+    }
+  }
+
+  if (found == 0) {
+    for (int i = 0; i < registry->nslots; i++)
+      if (registry->slots[i].dboid == dboid)
+        SetLatch(registry->slots[i].latch);
+  }
+  LWLockRelease(&registry->lock);
+}
+
+/*
+ * Count the task runners for a database and how many of them are
+ * idle.
+ */
+void TaskRunnerCount(Oid dboid, int *nrunners, int *nidle) {
+  TaskRunnerRegistry *registry = TaskRunnerRegistryGet();
+
+  *nrunners = 0;
+  *nidle = 0;
+
+  LWLockAcquire(&registry->lock, LW_SHARED);
+  for (int i = 0; i < registry->nslots; i++) {
+    TaskRunnerSlot *slot = &registry->slots[i];
+    if (slot->dboid == dboid) {
+      ++*nrunners;
+      if (slot->idle)
+        ++*nidle;
+    }
+  }
+  LWLockRelease(&registry->lock);
+}
+
+/*
+ * Get the rank of this task runner among the runners for the same
+ * database, which is used to pick the shards of the task table that
+ * the runner owns.
+ */
+void TaskRunnerRank(int *rank, int *nrunners) {
+  TaskRunnerRegistry *registry = TaskRunnerRegistryGet();
+
+  *rank = 0;
+  *nrunners = 0;
+
+  LWLockAcquire(&registry->lock, LW_SHARED);
+  for (int i = 0; i < registry->nslots; i++) {
+    TaskRunnerSlot *slot = &registry->slots[i];
+    if (slot == TaskRunnerMySlot)
+      *rank = *nrunners;
+    if (slot->dboid == TaskRunnerMySlot->dboid)
+      ++*nrunners;
+  }
+  LWLockRelease(&registry->lock);
+}
+
+/*
+ * Find the wakeup time entry for a database, or a free entry if there
+ * is none. Caller has to hold the registry lock.
+ */
+static TaskWakeupTime *TaskWakeupTimeFind(TaskRunnerRegistry *registry,
+                                          Oid dboid) {
+  TaskWakeupTime *free_entry = NULL;
+
+  for (int i = 0; i < registry->nslots; i++) {
+    TaskWakeupTime *entry = &registry->wakeups[i];
+    if (entry->dboid == dboid)
+      return entry;
+    if (free_entry == NULL && !OidIsValid(entry->dboid))
+      free_entry = entry;
+  }
+  return free_entry;
+}
+
+/*
+ * Get the time of the next scheduled task in a database.
+ *
+ * Returns false if the time has to be read from the task table, in
+ * which case "generation" should be passed to TaskWakeupTimeSet() once
+ * it has been read. The time is not valid until a runner has read it
+ * from the task table, which is what rebuilds it after a restart, and
+ * it is read again when it was checked more than the nap time ago. A
+ * time in the past is valid and means that there are due tasks.
+ */
+bool TaskWakeupTimeGet(Oid dboid, int nap_time, TimestampTz *next_wakeup,
+                       uint64 *generation) {
+  TaskRunnerRegistry *registry = TaskRunnerRegistryGet();
+  TimestampTz now = GetCurrentTimestamp();
+  TaskWakeupTime *entry;
+  bool valid = false;
+
+  LWLockAcquire(&registry->lock, LW_SHARED);
+  entry = TaskWakeupTimeFind(registry, dboid);
+  if (entry != NULL && entry->dboid == dboid) {
+    *next_wakeup = entry->next_wakeup;
+    *generation = entry->generation;
+    valid = entry->checked_at != 0 &&
+            (nap_time == 0 ||
+             !TimestampDifferenceExceeds(
+                 entry->checked_at, now, nap_time * 1000));
+  } else {
+    *generation = 0;
+  }
+  LWLockRelease(&registry->lock);
+
+  return valid;
+}
+
+/*
+ * Set the time of the next scheduled task in a database after reading
+ * it from the task table.
+ *
+ * If tasks were added after we got the generation, they might not be
+ * visible to the query we read the time with, so we keep the earlier
+ * of the two times. Returns the time that was set.
+ */
+TimestampTz TaskWakeupTimeSet(Oid dboid, TimestampTz next_wakeup,
+                              uint64 generation) {
+  TaskRunnerRegistry *registry = TaskRunnerRegistryGet();
+  TaskWakeupTime *entry;
+
+  LWLockAcquire(&registry->lock, LW_EXCLUSIVE);
+  entry = TaskWakeupTimeFind(registry, dboid);
+  if (entry != NULL) {
+    if (entry->dboid != dboid) {
+      entry->dboid = dboid;
+      entry->generation = 0;
+    } else if (entry->generation != generation) {
+      next_wakeup = Min(next_wakeup, entry->next_wakeup);
+    }
+    entry->next_wakeup = next_wakeup;
+    entry->checked_at = GetCurrentTimestamp();
+  }
+  LWLockRelease(&registry->lock);
+
+  return next_wakeup;
+}
+
+/*
+ * Lower the time of the next scheduled task in a database after tasks
+ * were added.
+ *
+ * Returns true if runners need to be woken up, which is not the case
+ * if they already wake up before the new tasks are due.
+ */
+static bool TaskWakeupTimeLower(Oid dboid, TimestampTz next_wakeup) {
+  TaskRunnerRegistry *registry = TaskRunnerRegistryGet();
+  TaskWakeupTime *entry;
+  bool wakeup = true;
+
+  LWLockAcquire(&registry->lock, LW_EXCLUSIVE);
+  entry = TaskWakeupTimeFind(registry, dboid);
+  if (entry != NULL && entry->dboid == dboid) {
+    wakeup = entry->checked_at == 0 || next_wakeup < entry->next_wakeup ||
+             entry->next_wakeup <= GetCurrentTimestamp();
+    entry->next_wakeup = Min(next_wakeup, entry->next_wakeup);
+    entry->generation++;
+  } else if (entry != NULL) {
+    /* No runner has read the time from the task table yet, so this
+     * only tells a runner that is reading it to keep our time. */
+    entry->dboid = dboid;
+    entry->next_wakeup = next_wakeup;
+    entry->checked_at = 0;
+    entry->generation = 1;
+  }
+  LWLockRelease(&registry->lock);
+
+  return wakeup;
+}
+
+/*
+ * Wake up runners when a transaction that added tasks commits.
+ *
+ * The runners cannot see the tasks before the transaction is
+ * committed, so waking them up any earlier would just make them go
+ * back to sleep. One runner is woken up for each batch of added tasks,
+ * so that a large number of tasks is not left to a single runner.
+ */
+static void TaskWakeupXactCallback(XactEvent event, void *arg) {
+  switch (event) {
+    case XACT_EVENT_COMMIT:
+    case XACT_EVENT_PARALLEL_COMMIT:
+      if (TaskWakeupPending > 0 &&
+          TaskWakeupTimeLower(MyDatabaseId, TaskWakeupPendingTime)) {
+        int64 batches = (TaskWakeupPending + TaskRunnerBatchSize - 1) /
+                        TaskRunnerBatchSize;
+        TaskRunnerWakeup(MyDatabaseId, (int)Min(batches, INT_MAX));
+      }
+      TaskWakeupPending = 0;
+      TaskWakeupPendingTime = DT_NOEND;
+      break;
+
+    case XACT_EVENT_ABORT:
+    case XACT_EVENT_PARALLEL_ABORT:
+    case XACT_EVENT_PREPARE:
+      TaskWakeupPending = 0;
+      TaskWakeupPendingTime = DT_NOEND;
+      break;
+
+    default:
+      break;
+  }
+}
+
+/*
+ * Trigger function for the task table that wakes up a task runner
+ * when the transaction commits.
+ *
+ * This is a row trigger that runs before the row is written, which
+ * keeps track of the earliest scheduled time of the added tasks
+ * without queueing an event for each row.
+ */
+Datum tasks_wakeup(PG_FUNCTION_ARGS) {
+  TriggerData *trigdata = (TriggerData *)fcinfo->context;
+  HeapTuple tuple;
+  Datum value;
+  bool isnull;
+
+  if (!CALLED_AS_TRIGGER(fcinfo))
+    ereport(ERROR,
+            (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+             errmsg("function \"%s\" was not called by trigger manager",
+                    __func__)));
+
+  if (!TRIGGER_FIRED_BEFORE(trigdata->tg_event) ||
+      !TRIGGER_FIRED_FOR_ROW(trigdata->tg_event))
+    ereport(ERROR,
+            (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+             errmsg("function \"%s\" must be fired before row",
+                    __func__)));
+
+  if (TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event))
+    tuple = trigdata->tg_newtuple;
+  else
+    tuple = trigdata->tg_trigtuple;
+
+  if (!TaskWakeupCallbackRegistered) {
+    RegisterXactCallback(TaskWakeupXactCallback, NULL);
+    TaskWakeupCallbackRegistered = true;
+  }
+
+  value = heap_getattr(tuple,
+                       SPI_fnumber(trigdata->tg_relation->rd_att,
+                                   "task_sched"),
+                       trigdata->tg_relation->rd_att,
+                       &isnull);
+  if (!isnull)
+    TaskWakeupPendingTime =
+        Min(TaskWakeupPendingTime, DatumGetTimestampTz(value));
+  TaskWakeupPending++;
+
+  return PointerGetDatum(tuple);
+}